@@ -0,0 +1,180 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+#include "batchlookup.hh"
+
+#include <QThread>
+#include <QDebug>
+
+#include <algorithm>
+#include <deque>
+
+namespace BatchLookup {
+
+namespace {
+
+/// An article request in flight.
+struct Pending
+{
+    sptr< Dictionary::DataRequest > request;
+    size_t word;
+    string dictionaryId;
+};
+
+/// Waits for the request to finish and adds its article, if any, to the
+/// word's ones.
+void complete( Pending const & pending, vector< vector< Article > > & result )
+{
+    Dictionary::DataRequest & request = *pending.request;
+
+    request.waitUntilFinished();
+
+    QString errorString = request.getErrorString();
+    long size = request.dataSize();
+
+    if ( size < 0 && errorString.isEmpty() )
+        return; // No article there
+
+    Article article;
+
+    article.dictionaryId = pending.dictionaryId;
+    article.errorString = errorString;
+
+    if ( size > 0 )
+    {
+        article.html.resize( size );
+        request.getDataSlice( 0, size, &article.html[ 0 ] );
+    }
+
+    result[ pending.word ].push_back( article );
+}
+
+/// Returns the indices of the words the dictionary is to be asked for the
+/// articles of, in the order it is to be asked in.
+vector< size_t > lookupOrder( Dictionary::Class & dictionary,
+                              vector< wstring > const & words )
+{
+    vector< size_t > order;
+    vector< Dictionary::ExactMatches > matches;
+
+    bool known = false;
+
+    try
+    {
+        known = dictionary.findExactMatches( words, matches );
+    }
+    catch( std::exception & e )
+    {
+        qWarning( "Batch lookup in \"%s\" failed: %s", dictionary.getName().c_str(), e.what() );
+    }
+
+    if ( !known )
+    {
+        // Just ask for every word then
+        for( size_t x = 0; x < words.size(); ++x )
+            order.push_back( x );
+
+        return order;
+    }
+
+    for( size_t x = 0; x < matches.size(); ++x )
+        if ( !matches[ x ].headwords.empty() )
+            order.push_back( x );
+
+    std::stable_sort( order.begin(), order.end(),
+                      [ &matches ]( size_t a, size_t b )
+                      { return matches[ a ].articleOrder < matches[ b ].articleOrder; } );
+
+    return order;
+}
+
+}
+
+vector< vector< Article > > lookupArticles(
+        vector< sptr< Dictionary::Class > > const & dictionaries,
+        vector< wstring > const & words )
+{
+    vector< vector< Article > > result( words.size() );
+
+    // Enough requests are kept in flight to keep all the cores busy. They're
+    // completed in the order they were made in, which keeps the articles of
+    // each word in the order of the dictionaries.
+    size_t const maxPending = std::max( 4, QThread::idealThreadCount() * 2 );
+
+    std::deque< Pending > pending;
+
+    for( auto const & dictionary : dictionaries )
+    {
+        string dictionaryId = dictionary->getId();
+
+        for( size_t word : lookupOrder( *dictionary, words ) )
+        {
+            if ( pending.size() >= maxPending )
+            {
+                complete( pending.front(), result );
+                pending.pop_front();
+            }
+
+            try
+            {
+                Pending next;
+
+                next.request = dictionary->getArticle( words[ word ], vector< wstring >() );
+                next.word = word;
+                next.dictionaryId = dictionaryId;
+
+                pending.push_back( next );
+            }
+            catch( std::exception & e )
+            {
+                // Complete everything before it, to keep the order
+                for( ; !pending.empty(); pending.pop_front() )
+                    complete( pending.front(), result );
+
+                Article article;
+
+                article.dictionaryId = dictionaryId;
+                article.errorString = QString::fromUtf8( e.what() );
+
+                result[ word ].push_back( article );
+            }
+        }
+    }
+
+    for( ; !pending.empty(); pending.pop_front() )
+        complete( pending.front(), result );
+
+    return result;
+}
+
+vector< vector< wstring > > findMatches(
+        vector< sptr< Dictionary::Class > > const & dictionaries,
+        vector< wstring > const & words )
+{
+    vector< vector< wstring > > result( words.size() );
+
+    for( auto const & dictionary : dictionaries )
+    {
+        vector< Dictionary::ExactMatches > matches;
+
+        try
+        {
+            if ( !dictionary->findExactMatches( words, matches ) )
+                continue;
+        }
+        catch( std::exception & e )
+        {
+            qWarning( "Batch lookup in \"%s\" failed: %s", dictionary->getName().c_str(), e.what() );
+            continue;
+        }
+
+        for( size_t x = 0; x < matches.size(); ++x )
+            for( auto const & headword : matches[ x ].headwords )
+                if ( std::find( result[ x ].begin(), result[ x ].end(), headword ) == result[ x ].end() )
+                    result[ x ].push_back( headword );
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,47 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+#ifndef __BATCHLOOKUP_HH_INCLUDED__
+#define __BATCHLOOKUP_HH_INCLUDED__
+
+#include "dictionary.hh"
+
+#include <QString>
+
+/// Looking up many words at once, for the bulk jobs. Each dictionary is
+/// first asked for the exact matches of all the words in one go, which lets
+/// the btree-indexed ones share the index traversal between the words. Then
+/// only the words which do have articles are looked up, in the order of the
+/// articles' locations, so that the article reads are grouped together.
+namespace BatchLookup {
+
+using std::vector;
+using std::string;
+using gd::wstring;
+
+/// An article of a word in one of the dictionaries.
+struct Article
+{
+  string dictionaryId;
+  string html; // The html fragment, as returned by getArticle()
+  QString errorString; // Non-empty if the lookup has failed
+};
+
+/// Looks up each of the words in all the dictionaries. Returns the articles
+/// of each word, in the same order as the words, with a word's articles
+/// ordered just like the dictionaries are. Blocks until done.
+vector< vector< Article > > lookupArticles(
+  vector< sptr< Dictionary::Class > > const & dictionaries,
+  vector< wstring > const & words );
+
+/// Finds the headwords exactly matching each of the words, in all the
+/// dictionaries together and without duplicates. Returns them in the same
+/// order as the words. Dictionaries which can't find the exact matches in
+/// bulk are skipped.
+vector< vector< wstring > > findMatches(
+  vector< sptr< Dictionary::Class > > const & dictionaries,
+  vector< wstring > const & words );
+
+}
+
+#endif
@@ -0,0 +1,1183 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+// A standalone benchmark of the indexing and the lookups. It generates
+// synthetic StarDict, DSL and dictd dictionaries, indexes them, and measures
+// the lookups, printing the results as JSON. Run with --help for the options.
+
+#include "dictionary.hh"
+#include "stardict.hh"
+#include "dsl.hh"
+#include "dsl_details.hh"
+#include "dictdfiles.hh"
+#include "codec.hh"
+#include "xdxf2html.hh"
+#include "utf8.hh"
+#include "folding.hh"
+#include "wstring.hh"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QThread>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#if defined( Q_OS_WIN )
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using std::string;
+using std::vector;
+using gd::wstring;
+using gd::wchar;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double msSince( Clock::time_point start )
+{
+    return std::chrono::duration< double, std::milli >( Clock::now() - start ).count();
+}
+
+/// Returns the peak resident set size of the process so far, in kilobytes.
+qint64 peakRssKb()
+{
+#if defined( Q_OS_WIN )
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+        return counters.PeakWorkingSetSize / 1024;
+
+    return 0;
+#else
+    struct rusage usage;
+
+    if ( getrusage( RUSAGE_SELF, &usage ) )
+        return 0;
+
+#if defined( Q_OS_MACOS ) || defined( Q_OS_OSX )
+    return usage.ru_maxrss / 1024; // Bytes there
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+/// Benchmark settings, as given on the command line.
+struct Options
+{
+    unsigned words;
+    QStringList languages, formats;
+    vector< int > threadCounts;
+    unsigned queries;
+    double seconds;
+    bool dictzip;
+    unsigned seed;
+    Codec::Type codec;
+    unsigned indexMemoryMb; // Zero for the indexer's default
+    QString workDir;
+    QString output; // Empty for stdout
+    QStringList compareDsl; // The .dsl files to compare the renderers on
+};
+
+/// The ranges of letters the words of each language are made of.
+struct Alphabet
+{
+    char const * name;
+    vector< std::pair< wchar, wchar > > ranges;
+    unsigned minLength, maxLength; // Letters per word
+};
+
+vector< Alphabet > const & alphabets()
+{
+    static vector< Alphabet > result = {
+        { "en", { { 'a', 'z' } }, 2, 10 },
+        { "de", { { 'a', 'z' }, { 0xE4, 0xE4 }, { 0xF6, 0xF6 }, { 0xFC, 0xFC }, { 0xDF, 0xDF } }, 2, 12 },
+        { "fr", { { 'a', 'z' }, { 0xE0, 0xE2 }, { 0xE7, 0xEB }, { 0xEE, 0xEF }, { 0xF4, 0xF4 } }, 2, 10 },
+        { "ru", { { 0x430, 0x44F }, { 0x451, 0x451 } }, 2, 11 },
+        { "el", { { 0x3B1, 0x3C9 }, { 0x3AC, 0x3AF } }, 2, 10 },
+        { "ja", { { 0x3041, 0x3093 }, { 0x30A1, 0x30F3 } }, 1, 5 },
+        { "zh", { { 0x4E00, 0x4FFF } }, 1, 3 }
+    };
+
+    return result;
+}
+
+Alphabet const * findAlphabet( QString const & name )
+{
+    for( auto const & alphabet : alphabets() )
+        if ( name == alphabet.name )
+            return &alphabet;
+
+    return nullptr;
+}
+
+/// A generated article.
+struct Entry
+{
+    wstring headword;
+    vector< wstring > synonyms;
+    wstring body;
+};
+
+/// Makes random words and articles out of the configured alphabets.
+class Generator
+{
+public:
+
+    Generator( vector< Alphabet const * > const & alphabets_, unsigned seed ):
+        alphabets( alphabets_ ), random( seed )
+    {}
+
+    wstring word( Alphabet const & alphabet )
+    {
+        unsigned length = pick( alphabet.minLength, alphabet.maxLength );
+
+        size_t letters = 0;
+
+        for( auto const & range : alphabet.ranges )
+            letters += range.second - range.first + 1;
+
+        wstring result;
+
+        while( length-- )
+        {
+            size_t letter = pick( 0, letters - 1 );
+
+            for( auto const & range : alphabet.ranges )
+            {
+                size_t size = range.second - range.first + 1;
+
+                if ( letter < size )
+                {
+                    result.push_back( range.first + letter );
+                    break;
+                }
+
+                letter -= size;
+            }
+        }
+
+        return result;
+    }
+
+    /// A word or, sometimes, a short phrase.
+    wstring headword( Alphabet const & alphabet )
+    {
+        wstring result = word( alphabet );
+
+        if ( pick( 0, 9 ) == 0 ) // Every tenth one is a phrase
+            for( unsigned x = pick( 1, 2 ); x--; )
+                result += wchar( ' ' ) + word( alphabet );
+
+        return result;
+    }
+
+    vector< Entry > entries( unsigned count )
+    {
+        vector< Entry > result( count );
+
+        for( unsigned x = 0; x < count; ++x )
+        {
+            Entry & entry = result[ x ];
+
+            Alphabet const & alphabet = *alphabets[ x % alphabets.size() ];
+
+            entry.headword = headword( alphabet );
+
+            if ( pick( 0, 19 ) == 0 )
+                entry.synonyms.push_back( headword( alphabet ) );
+
+            for( unsigned sentences = pick( 1, 4 ); sentences--; )
+            {
+                for( unsigned words = pick( 3, 12 ); words--; )
+                    entry.body += word( alphabet ) + wchar( words ? ' ' : '.' );
+
+                entry.body += ' ';
+            }
+        }
+
+        return result;
+    }
+
+    unsigned pick( unsigned min, unsigned max )
+    {
+        return std::uniform_int_distribution< unsigned >( min, max )( random );
+    }
+
+private:
+
+    vector< Alphabet const * > alphabets;
+    std::mt19937 random;
+};
+
+bool writeFile( QString const & fileName, QByteArray const & data )
+{
+    QFile file( fileName );
+
+    return file.open( QFile::WriteOnly | QFile::Truncate ) &&
+           file.write( data ) == data.size();
+}
+
+void appendBigEndian( QByteArray & out, uint32_t value )
+{
+    char bytes[ 4 ] = { char( value >> 24 ), char( value >> 16 ),
+                        char( value >> 8 ), char( value ) };
+
+    out.append( bytes, sizeof( bytes ) );
+}
+
+void appendLittleEndian16( QByteArray & out, unsigned value )
+{
+    out.append( char( value & 0xFF ) );
+    out.append( char( value >> 8 ) );
+}
+
+/// Compresses the data into the dictzip format, that is, a gzip file of
+/// separately flushed chunks with their sizes listed in the header, so that
+/// dictzip.c could read them at random.
+QByteArray makeDictzip( QByteArray const & data )
+{
+    enum
+    {
+        ChunkLength = 58315 // What dictzip itself uses
+    };
+
+    int chunkCount = ( data.size() + ChunkLength - 1 ) / ChunkLength;
+
+    if ( !chunkCount )
+        chunkCount = 1;
+
+    z_stream stream;
+
+    memset( &stream, 0, sizeof( stream ) );
+
+    if ( deflateInit2( &stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                       Z_DEFAULT_STRATEGY ) != Z_OK )
+        return QByteArray();
+
+    QByteArray compressed;
+    vector< unsigned > chunkSizes;
+    vector< char > buffer( compressBound( ChunkLength ) + 64 );
+
+    for( int x = 0; x < chunkCount; ++x )
+    {
+        int offset = x * ChunkLength;
+        int size = std::min( int( ChunkLength ), data.size() - offset );
+
+        stream.next_in = reinterpret_cast< Bytef * >( const_cast< char * >( data.constData() ) + offset );
+        stream.avail_in = size;
+
+        unsigned chunkSize = 0;
+
+        do
+        {
+            stream.next_out = reinterpret_cast< Bytef * >( buffer.data() );
+            stream.avail_out = buffer.size();
+
+            deflate( &stream, x == chunkCount - 1 ? Z_FINISH : Z_FULL_FLUSH );
+
+            unsigned produced = buffer.size() - stream.avail_out;
+
+            compressed.append( buffer.data(), produced );
+            chunkSize += produced;
+        }
+        while( stream.avail_out == 0 );
+
+        chunkSizes.push_back( chunkSize );
+    }
+
+    deflateEnd( &stream );
+
+    QByteArray result;
+
+    result.append( "\x1f\x8b\x08\x04", 4 ); // Magic, deflate, FEXTRA
+    result.append( "\0\0\0\0\x02\x03", 6 ); // No mtime, best compression, Unix
+
+    unsigned subfieldLength = 6 + 2 * chunkCount;
+
+    appendLittleEndian16( result, 4 + subfieldLength );
+    result.append( "RA", 2 );
+    appendLittleEndian16( result, subfieldLength );
+    appendLittleEndian16( result, 1 ); // Version
+    appendLittleEndian16( result, ChunkLength );
+    appendLittleEndian16( result, chunkCount );
+
+    for( unsigned size : chunkSizes )
+        appendLittleEndian16( result, size );
+
+    result.append( compressed );
+
+    uint32_t trailer[ 2 ] = {
+        uint32_t( crc32( crc32( 0, Z_NULL, 0 ),
+                         reinterpret_cast< Bytef const * >( data.constData() ),
+                         data.size() ) ),
+        uint32_t( data.size() ) };
+
+    for( uint32_t value : trailer )
+        for( int x = 0; x < 4; ++x )
+            result.append( char( value >> ( x * 8 ) ) );
+
+    return result;
+}
+
+/// Saves the article text as a .dict or a .dict.dz. Returns the name used.
+QString writeDict( QString const & base, QByteArray const & data, bool dictzip )
+{
+    if ( dictzip )
+    {
+        writeFile( base + ".dict.dz", makeDictzip( data ) );
+        return base + ".dict.dz";
+    }
+
+    writeFile( base + ".dict", data );
+
+    return base + ".dict";
+}
+
+QByteArray utf8( wstring const & str )
+{
+    return QByteArray::fromStdString( Utf8::encode( str ) );
+}
+
+/// Writes a StarDict dictionary, with a .syn file for the synonyms.
+QStringList writeStardict( QString const & dir, vector< Entry > const & entries,
+                           bool dictzip )
+{
+    QByteArray idx, syn, dict;
+    unsigned synCount = 0;
+
+    for( size_t x = 0; x < entries.size(); ++x )
+    {
+        Entry const & entry = entries[ x ];
+
+        QByteArray body = utf8( entry.body );
+
+        idx.append( utf8( entry.headword ) ).append( '\0' );
+        appendBigEndian( idx, dict.size() );
+        appendBigEndian( idx, body.size() );
+
+        dict.append( body );
+
+        for( auto const & synonym : entry.synonyms )
+        {
+            syn.append( utf8( synonym ) ).append( '\0' );
+            appendBigEndian( syn, x );
+            ++synCount;
+        }
+    }
+
+    QString base = dir + "/bench";
+
+    QByteArray ifo = "StarDict's dict ifo file\nversion=2.4.2\n";
+
+    ifo += "wordcount=" + QByteArray::number( uint( entries.size() ) ) + "\n";
+    ifo += "idxfilesize=" + QByteArray::number( idx.size() ) + "\n";
+
+    if ( synCount )
+        ifo += "synwordcount=" + QByteArray::number( synCount ) + "\n";
+
+    ifo += "bookname=Benchmark StarDict\nsametypesequence=m\n";
+
+    writeFile( base + ".ifo", ifo );
+    writeFile( base + ".idx", idx );
+
+    QStringList files;
+
+    files << base + ".ifo" << base + ".idx" << writeDict( base, dict, dictzip );
+
+    if ( synCount )
+    {
+        writeFile( base + ".syn", syn );
+        files << base + ".syn";
+    }
+
+    return files;
+}
+
+/// Writes a UTF-8 DSL dictionary. The synonyms become additional headwords.
+QStringList writeDsl( QString const & dir, vector< Entry > const & entries )
+{
+    QByteArray dsl = "\xEF\xBB\xBF#NAME \"Benchmark DSL\"\n"
+                     "#INDEX_LANGUAGE \"English\"\n"
+                     "#CONTENTS_LANGUAGE \"English\"\n\n";
+
+    for( auto const & entry : entries )
+    {
+        dsl.append( utf8( entry.headword ) ).append( '\n' );
+
+        for( auto const & synonym : entry.synonyms )
+            dsl.append( utf8( synonym ) ).append( '\n' );
+
+        dsl.append( "\t[m1][trn]" ).append( utf8( entry.body ) ).append( "[/trn][/m]\n\n" );
+    }
+
+    QString fileName = dir + "/bench.dsl";
+
+    writeFile( fileName, dsl );
+
+    return QStringList( fileName );
+}
+
+/// Writes a dictd dictionary. The synonyms get their own index lines.
+QStringList writeDictd( QString const & dir, vector< Entry > const & entries,
+                        bool dictzip )
+{
+    static char const digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    auto base64 = []( uint32_t value )
+    {
+        QByteArray result;
+
+        do
+        {
+            result.prepend( digits[ value % 64 ] );
+            value /= 64;
+        }
+        while( value );
+
+        return result;
+    };
+
+    QByteArray index, dict;
+
+    for( auto const & entry : entries )
+    {
+        QByteArray article = utf8( entry.headword ) + "\n\n   " + utf8( entry.body ) + "\n";
+        QByteArray location = '\t' + base64( dict.size() ) + '\t' + base64( article.size() ) + '\n';
+
+        index.append( utf8( entry.headword ) ).append( location );
+
+        for( auto const & synonym : entry.synonyms )
+            index.append( utf8( synonym ) ).append( location );
+
+        dict.append( article );
+    }
+
+    QString base = dir + "/bench";
+
+    writeFile( base + ".index", index );
+
+    return QStringList() << base + ".index" << writeDict( base, dict, dictzip );
+}
+
+/// Passes the indexing memory limit to the indexer, and keeps the
+/// statistics it reports back.
+class BenchInitializing: public Dictionary::Initializing
+{
+    size_t memoryLimit;
+
+public:
+
+    Dictionary::IndexingStats stats;
+
+    BenchInitializing( size_t memoryLimit_ ): memoryLimit( memoryLimit_ ), stats()
+    {}
+
+    void indexingDictionary( string const & ) override
+    {}
+
+    void indexedDictionary( string const &, Dictionary::IndexingStats const & stats_ ) override
+    { stats = stats_; }
+
+    size_t indexingMemoryLimit() override
+    { return memoryLimit; }
+};
+
+enum Operation
+{
+    PrefixMatch,
+    StemmedMatch,
+    GetArticle,
+    OperationCount
+};
+
+char const * operationName( int operation )
+{
+    static char const * const names[] = { "prefixMatch", "stemmedMatch", "getArticle" };
+
+    return names[ operation ];
+}
+
+/// Runs the operation on a word and waits for it to complete. Returns the
+/// number of matches, or the article size.
+size_t perform( Dictionary::Class & dictionary, int operation, wstring const & word )
+{
+    switch( operation )
+    {
+        case PrefixMatch:
+        {
+            // Look up about a half of the word, to get several matches
+            sptr< Dictionary::WordSearchRequest > request =
+                dictionary.prefixMatch( word.substr( 0, ( word.size() + 1 ) / 2 ), 40 );
+
+            request->waitUntilFinished();
+
+            return request->matchesCount();
+        }
+
+        case StemmedMatch:
+        {
+            sptr< Dictionary::WordSearchRequest > request =
+                dictionary.stemmedMatch( word, 3, 15, 30 );
+
+            request->waitUntilFinished();
+
+            return request->matchesCount();
+        }
+
+        default:
+        {
+            sptr< Dictionary::DataRequest > request =
+                dictionary.getArticle( word, vector< wstring >() );
+
+            request->waitUntilFinished();
+
+            return request->dataSize() > 0 ? request->dataSize() : 0;
+        }
+    }
+}
+
+QJsonObject percentiles( vector< double > & latencies )
+{
+    QJsonObject result;
+
+    std::sort( latencies.begin(), latencies.end() );
+
+    auto at = [ &latencies ]( double fraction )
+    {
+        return latencies[ std::min( latencies.size() - 1,
+                                    size_t( fraction * latencies.size() ) ) ];
+    };
+
+    double total = 0;
+
+    for( double latency : latencies )
+        total += latency;
+
+    result[ "count" ] = int( latencies.size() );
+
+    if ( !latencies.empty() )
+    {
+        result[ "mean" ] = total / latencies.size();
+        result[ "p50" ] = at( 0.5 );
+        result[ "p90" ] = at( 0.9 );
+        result[ "p99" ] = at( 0.99 );
+        result[ "max" ] = latencies.back();
+    }
+
+    return result;
+}
+
+/// Performs the operations in a loop until told to stop, counting them.
+class ThroughputRunnable: public QRunnable
+{
+    Dictionary::Class & dictionary;
+    vector< wstring > const & words;
+    unsigned seed;
+    QAtomicInt & stop;
+    QAtomicInt & operations;
+
+public:
+
+    ThroughputRunnable( Dictionary::Class & dictionary_, vector< wstring > const & words_,
+                        unsigned seed_, QAtomicInt & stop_, QAtomicInt & operations_ ):
+        dictionary( dictionary_ ), words( words_ ), seed( seed_ ), stop( stop_ ),
+        operations( operations_ )
+    {}
+
+    void run() override
+    {
+        std::mt19937 random( seed );
+
+        for( unsigned count = 0; !stop.load(); ++count )
+        {
+            perform( dictionary, count % OperationCount, words[ random() % words.size() ] );
+            operations.ref();
+        }
+    }
+};
+
+qint64 directorySize( QString const & path )
+{
+    qint64 result = 0;
+
+    for( QFileInfo const & info : QDir( path ).entryInfoList( QDir::Files ) )
+        result += info.size();
+
+    return result;
+}
+
+/// Makes an xdxf article, as found in StarDict's 'x' records, out of the
+/// entry. It uses all the tags the converter maps.
+string makeXdxfArticle( Entry const & entry )
+{
+    string headword = Utf8::encode( entry.headword );
+    string body = Utf8::encode( entry.body );
+
+    string result = "<k>" + headword + "</k>\n <tr>" + headword + "</tr>\n";
+
+    result += "<dtrn>" + body + "</dtrn>\n";
+    result += " <ex><abr>e.g.</abr> <c c=\"green\">" + headword + "</c> &amp; " +
+              body.substr( 0, body.find( '.' ) ) + "</ex>\n";
+
+    for( auto const & synonym : entry.synonyms )
+        result += " <co>see</co> <kref>" + Utf8::encode( synonym ) + "</kref>\n";
+
+    return result;
+}
+
+/// Measures the conversion of StarDict's xdxf articles to html, done in a
+/// single pass as Xdxf2Html::convert() does, against doing it by building a
+/// dom, as Xdxf2Html::convertWithDom() does.
+QJsonObject benchmarkXdxf( Options const & options, vector< Entry > const & entries )
+{
+    QJsonObject result;
+
+    result[ "format" ] = "xdxf";
+
+    vector< string > articles;
+    qint64 totalBytes = 0;
+
+    for( auto const & entry : entries )
+    {
+        articles.push_back( makeXdxfArticle( entry ) );
+        totalBytes += articles.back().size();
+    }
+
+    result[ "articles" ] = int( articles.size() );
+    result[ "averageArticleBytes" ] = double( totalBytes ) / articles.size();
+
+    struct Converter
+    {
+        char const * name;
+        string ( *convert )( string const & );
+    };
+
+    Converter const converters[] = { { "stream", &Xdxf2Html::convert },
+                                     { "dom", &Xdxf2Html::convertWithDom } };
+
+    QJsonObject conversions;
+
+    for( auto const & converter : converters )
+    {
+        QJsonObject stats;
+
+        std::mt19937 random( options.seed );
+
+        vector< double > latencies;
+
+        for( unsigned x = 0; x < options.queries; ++x )
+        {
+            string const & article = articles[ random() % articles.size() ];
+
+            Clock::time_point started = Clock::now();
+
+            converter.convert( article );
+
+            latencies.push_back( msSince( started ) * 1000 );
+        }
+
+        stats[ "latencyUs" ] = percentiles( latencies );
+
+        // Single-threaded, as the conversion doesn't share anything
+        size_t converted = 0;
+        qint64 bytes = 0;
+
+        Clock::time_point start = Clock::now();
+
+        do
+        {
+            string const & article = articles[ converted++ % articles.size() ];
+
+            converter.convert( article );
+
+            bytes += article.size();
+        }
+        while( msSince( start ) < options.seconds * 1000 );
+
+        double seconds = msSince( start ) / 1000;
+
+        stats[ "articlesPerSecond" ] = converted / seconds;
+        stats[ "megabytesPerSecond" ] = bytes / seconds / ( 1024 * 1024 );
+
+        conversions[ converter.name ] = stats;
+    }
+
+    result[ "conversions" ] = conversions;
+    result[ "peakRssKb" ] = peakRssKb();
+
+    return result;
+}
+
+/// Generates, indexes and measures a dictionary of the given format.
+QJsonObject benchmarkFormat( QString const & format, Options const & options,
+                             vector< Entry > const & entries )
+{
+    QJsonObject result;
+
+    result[ "format" ] = format;
+
+    QString sourceDir = options.workDir + "/" + format;
+    QString indexDir = sourceDir + "/index";
+
+    QDir( sourceDir ).removeRecursively();
+    QDir().mkpath( indexDir );
+
+    QStringList files;
+
+    if ( format == "stardict" )
+        files = writeStardict( sourceDir, entries, options.dictzip );
+    else
+    if ( format == "dsl" )
+        files = writeDsl( sourceDir, entries );
+    else
+        files = writeDictd( sourceDir, entries, options.dictzip );
+
+    result[ "sourceBytes" ] = directorySize( sourceDir );
+
+    vector< string > fileNames;
+
+    for( QString const & file : files )
+        fileNames.push_back( QDir::toNativeSeparators( file ).toLocal8Bit().toStdString() );
+
+    string indicesDir = QDir::toNativeSeparators( indexDir + "/" ).toLocal8Bit().toStdString();
+
+    BenchInitializing initializing( size_t( options.indexMemoryMb ) * 1024 * 1024 );
+    vector< sptr< Dictionary::Class > > dictionaries;
+
+    Clock::time_point start = Clock::now();
+
+    if ( format == "stardict" )
+        dictionaries = Stardict::makeDictionaries( fileNames, indicesDir, initializing );
+    else
+    if ( format == "dsl" )
+        dictionaries = Dsl::makeDictionaries( fileNames, indicesDir, initializing );
+    else
+        dictionaries = DictdFiles::makeDictionaries( fileNames, indicesDir, initializing );
+
+    result[ "buildMs" ] = msSince( start );
+    result[ "indexBytes" ] = directorySize( indexDir );
+    result[ "peakRssKbAfterBuild" ] = peakRssKb();
+    result[ "indexEntries" ] = double( initializing.stats.entries );
+    result[ "indexPeakKb" ] = double( initializing.stats.peakBytes / 1024 );
+    result[ "indexSpilledRuns" ] = int( initializing.stats.spilledRuns );
+
+    if ( dictionaries.empty() )
+    {
+        result[ "error" ] = "The dictionary failed to load";
+        return result;
+    }
+
+    Dictionary::Class & dictionary = *dictionaries.front();
+
+    // Warm up, which includes any deferred initialization
+    perform( dictionary, GetArticle, entries.front().headword );
+
+    vector< wstring > words;
+
+    for( auto const & entry : entries )
+        words.push_back( entry.headword );
+
+    std::mt19937 random( options.seed );
+
+    QJsonObject latency;
+
+    for( int operation = 0; operation < OperationCount; ++operation )
+    {
+        vector< double > latencies;
+        size_t found = 0;
+
+        for( unsigned x = 0; x < options.queries; ++x )
+        {
+            wstring const & word = words[ random() % words.size() ];
+
+            Clock::time_point started = Clock::now();
+
+            found += perform( dictionary, operation, word ) ? 1 : 0;
+
+            latencies.push_back( msSince( started ) * 1000 );
+        }
+
+        QJsonObject stats = percentiles( latencies );
+
+        stats[ "found" ] = int( found );
+
+        latency[ operationName( operation ) ] = stats;
+    }
+
+    result[ "latencyUs" ] = latency;
+
+    QJsonArray throughput;
+
+    for( int threads : options.threadCounts )
+    {
+        QThreadPool pool;
+        QAtomicInt stop, operations;
+
+        pool.setMaxThreadCount( threads );
+
+        for( int x = 0; x < threads; ++x )
+            pool.start( new ThroughputRunnable( dictionary, words, options.seed + x,
+                                                stop, operations ) );
+
+        QThread::msleep( options.seconds * 1000 );
+
+        stop.ref();
+
+        Clock::time_point stopped = Clock::now();
+
+        pool.waitForDone();
+
+        // Account for the operations finished after the stop was requested
+        double seconds = options.seconds + msSince( stopped ) / 1000;
+
+        QJsonObject entry;
+
+        entry[ "threads" ] = threads;
+        entry[ "operations" ] = operations.load();
+        entry[ "opsPerSecond" ] = operations.load() / seconds;
+
+        throughput.append( entry );
+    }
+
+    result[ "throughput" ] = throughput;
+    result[ "peakRssKb" ] = peakRssKb();
+
+    return result;
+}
+
+/// Reads the headwords of the given .dsl file, made the way the indexer
+/// makes them.
+vector< wstring > readDslHeadwords( string const & fileName )
+{
+    using namespace Dsl::Details;
+
+    vector< wstring > result;
+
+    DslScanner scanner( fileName );
+
+    wstring line;
+    size_t offset;
+
+    while( scanner.readNextLine( line, offset ) )
+    {
+        // The article bodies are indented
+        if ( line.empty() || line[ 0 ] == ' ' || line[ 0 ] == '\t' )
+            continue;
+
+        processUnsortedParts( line, true );
+
+        std::list< wstring > keys;
+
+        expandOptionalParts( line, keys );
+
+        for( auto & key : keys )
+        {
+            unescapeDsl( key );
+            normalizeHeadword( key );
+
+            result.push_back( Folding::trimWhitespace( key ) );
+        }
+    }
+
+    std::sort( result.begin(), result.end() );
+    result.erase( std::unique( result.begin(), result.end() ), result.end() );
+
+    return result;
+}
+
+/// Returns the html getArticle() gives for the word.
+string renderArticle( Dictionary::Class & dictionary, wstring const & word )
+{
+    sptr< Dictionary::DataRequest > request =
+        dictionary.getArticleNow( word, vector< wstring >(), wstring() );
+
+    string result;
+
+    long size = request->dataSize();
+
+    if ( size > 0 )
+    {
+        result.resize( size );
+        request->getDataSlice( 0, size, &result.front() );
+    }
+
+    return result;
+}
+
+/// Renders the articles of all the headwords of the given .dsl file with both
+/// the current renderer and the former one, which it must match byte for
+/// byte. Reports the number of the articles which differ.
+QJsonObject compareDslRenderers( QString const & file, Options const & options )
+{
+    QJsonObject result;
+
+    result[ "format" ] = "dsl-compare";
+    result[ "file" ] = file;
+
+    QString indexDir = options.workDir + "/dsl-compare/index";
+
+    QDir().mkpath( indexDir );
+
+    string fileName = QDir::toNativeSeparators( file ).toLocal8Bit().toStdString();
+    string indicesDir = QDir::toNativeSeparators( indexDir + "/" ).toLocal8Bit().toStdString();
+
+    vector< sptr< Dictionary::Class > > dictionaries;
+    vector< wstring > headwords;
+
+    try
+    {
+        BenchInitializing initializing( size_t( options.indexMemoryMb ) * 1024 * 1024 );
+
+        dictionaries = Dsl::makeDictionaries( vector< string >( 1, fileName ), indicesDir,
+                                              initializing );
+
+        headwords = readDslHeadwords( fileName );
+    }
+    catch( std::exception & e )
+    {
+        result[ "error" ] = QString::fromUtf8( e.what() );
+        return result;
+    }
+
+    if ( dictionaries.empty() )
+    {
+        result[ "error" ] = "The dictionary failed to load";
+        return result;
+    }
+
+    Dictionary::Class & dictionary = *dictionaries.front();
+
+    vector< string > current, reference;
+    double currentMs = 0, referenceMs = 0;
+
+    for( int pass = 0; pass < 2; ++pass )
+    {
+        Dsl::useReferenceRenderer( dictionary, pass == 1 );
+
+        vector< string > & htmls = pass ? reference : current;
+
+        Clock::time_point start = Clock::now();
+
+        for( auto const & headword : headwords )
+            htmls.push_back( renderArticle( dictionary, headword ) );
+
+        ( pass ? referenceMs : currentMs ) = msSince( start );
+    }
+
+    Dsl::useReferenceRenderer( dictionary, false );
+
+    int mismatches = 0;
+    QJsonArray mismatched; // The first few headwords which differ
+
+    for( size_t x = 0; x < headwords.size(); ++x )
+        if ( current[ x ] != reference[ x ] )
+        {
+            if ( ++mismatches <= 10 )
+                mismatched.append( QString::fromStdString( Utf8::encode( headwords[ x ] ) ) );
+        }
+
+    result[ "headwords" ] = int( headwords.size() );
+    result[ "mismatches" ] = mismatches;
+    result[ "mismatchedHeadwords" ] = mismatched;
+    result[ "currentMs" ] = currentMs;
+    result[ "referenceMs" ] = referenceMs;
+
+    return result;
+}
+
+bool parseOptions( QCoreApplication & app, Options & options )
+{
+    QCommandLineParser parser;
+
+    parser.setApplicationDescription(
+        "Generates synthetic dictionaries, indexes them and measures the "
+        "lookups. The results are printed as JSON." );
+    parser.addHelpOption();
+
+    parser.addOptions( {
+        { "words", "Number of articles per dictionary.", "count", "20000" },
+        { "languages", "Comma-separated languages the words are made in: "
+                       "en, de, fr, ru, el, ja, zh.", "list", "en" },
+        { "formats", "Comma-separated formats to test: stardict, dsl, dictd, "
+                     "and xdxf for the conversion of StarDict's xdxf articles "
+                     "to html, with and without a dom.",
+                     "list", "stardict,dsl,dictd,xdxf" },
+        { "threads", "Comma-separated thread counts for the throughput test.",
+                     "list", "1,2,4,8" },
+        { "queries", "Number of queries per latency test.", "count", "2000" },
+        { "seconds", "Duration of each throughput test.", "seconds", "2" },
+        { "codec", "Codec of the indexes: zlib, stored, zstd or lz4.", "name", "zlib" },
+        { "index-memory", "Memory the words being indexed may take before they're "
+                          "spilled to disk, in MiB. Zero for the default.", "mb", "0" },
+        { "no-dictzip", "Store the StarDict and dictd articles uncompressed." },
+        { "seed", "Seed of the generator.", "number", "1" },
+        { "work-dir", "Where to put the dictionaries and their indexes.", "path",
+                      QDir::tempPath() + "/goldendict-bench" },
+        { "output", "Write the results to this file instead of stdout.", "file" },
+        { "compare-dsl", "Instead of the benchmarks, check that the DSL articles of "
+                         "these comma-separated .dsl files render the same as with the "
+                         "former renderer. Exits with 2 if any of them differ.", "files" }
+    } );
+
+    parser.process( app );
+
+    options.words = parser.value( "words" ).toUInt();
+    options.languages = parser.value( "languages" ).split( ',' );
+    options.formats = parser.value( "formats" ).split( ',' );
+    options.queries = parser.value( "queries" ).toUInt();
+    options.seconds = parser.value( "seconds" ).toDouble();
+    options.dictzip = !parser.isSet( "no-dictzip" );
+    options.seed = parser.value( "seed" ).toUInt();
+    options.indexMemoryMb = parser.value( "index-memory" ).toUInt();
+    options.workDir = parser.value( "work-dir" );
+    options.output = parser.value( "output" );
+
+    if ( parser.isSet( "compare-dsl" ) )
+        options.compareDsl = parser.value( "compare-dsl" ).split( ',' );
+
+    for( QString const & threads : parser.value( "threads" ).split( ',' ) )
+        if ( threads.toInt() > 0 )
+            options.threadCounts.push_back( threads.toInt() );
+
+    if ( !options.words || !options.queries )
+    {
+        fprintf( stderr, "The word and query counts must be positive.\n" );
+        return false;
+    }
+
+    for( QString const & language : options.languages )
+        if ( !findAlphabet( language ) )
+        {
+            fprintf( stderr, "Unknown language: %s\n", language.toUtf8().constData() );
+            return false;
+        }
+
+    for( QString const & format : options.formats )
+        if ( format != "stardict" && format != "dsl" && format != "dictd" &&
+             format != "xdxf" )
+        {
+            fprintf( stderr, "Unknown format: %s\n", format.toUtf8().constData() );
+            return false;
+        }
+
+    QString codec = parser.value( "codec" );
+
+    for( int type = Codec::Zlib; type <= Codec::Lz4; ++type )
+        if ( codec == Codec::name( Codec::Type( type ) ) )
+        {
+            if ( !Codec::setIndexCodec( Codec::Type( type ) ) )
+            {
+                fprintf( stderr, "The codec isn't built in: %s\n", codec.toUtf8().constData() );
+                return false;
+            }
+
+            options.codec = Codec::Type( type );
+
+            return true;
+        }
+
+    fprintf( stderr, "Unknown codec: %s\n", codec.toUtf8().constData() );
+
+    return false;
+}
+
+}
+
+int main( int argc, char ** argv )
+{
+    QCoreApplication app( argc, argv );
+
+    Options options;
+
+    if ( !parseOptions( app, options ) )
+        return 1;
+
+    vector< Alphabet const * > languages;
+
+    for( QString const & language : options.languages )
+        languages.push_back( findAlphabet( language ) );
+
+    vector< Entry > entries = Generator( languages, options.seed ).entries( options.words );
+
+    QJsonObject config;
+
+    config[ "words" ] = int( options.words );
+    config[ "languages" ] = QJsonArray::fromStringList( options.languages );
+    config[ "queries" ] = int( options.queries );
+    config[ "seconds" ] = options.seconds;
+    config[ "codec" ] = Codec::name( options.codec );
+    config[ "indexMemoryMb" ] = int( options.indexMemoryMb );
+    config[ "dictzip" ] = options.dictzip;
+    config[ "seed" ] = int( options.seed );
+    config[ "idealThreadCount" ] = QThread::idealThreadCount();
+
+    QJsonArray results;
+    bool anyMismatches = false;
+
+    if ( !options.compareDsl.isEmpty() )
+        for( QString const & file : options.compareDsl )
+        {
+            fprintf( stderr, "Comparing the renderers on %s...\n", file.toUtf8().constData() );
+
+            QJsonObject comparison = compareDslRenderers( file, options );
+
+            if ( comparison[ "mismatches" ].toInt() || comparison.contains( "error" ) )
+                anyMismatches = true;
+
+            results.append( comparison );
+        }
+    else
+        for( QString const & format : options.formats )
+        {
+            fprintf( stderr, "Benchmarking %s...\n", format.toUtf8().constData() );
+            results.append( format == "xdxf" ? benchmarkXdxf( options, entries ) :
+                                               benchmarkFormat( format, options, entries ) );
+        }
+
+    QJsonObject report;
+
+    report[ "benchmark" ] = "goldendict-bench";
+    report[ "config" ] = config;
+    report[ "results" ] = results;
+    report[ "peakRssKb" ] = peakRssKb();
+
+    QByteArray json = QJsonDocument( report ).toJson();
+
+    if ( options.output.isEmpty() )
+    {
+        fwrite( json.constData(), 1, json.size(), stdout );
+        return anyMismatches ? 2 : 0;
+    }
+
+    if ( !writeFile( options.output, json ) )
+    {
+        fprintf( stderr, "Can't write %s\n", options.output.toUtf8().constData() );
+        return 1;
+    }
+
+    return anyMismatches ? 2 : 0;
+}
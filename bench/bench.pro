@@ -0,0 +1,23 @@
+# A standalone benchmark of the indexing and the lookups, see bench.cc.
+# Build with "qmake bench.pro && make", then run "./goldendict-bench --help".
+
+QT += network xml
+QT -= gui
+
+DEFINES += QT_DEPRECATED_WARNINGS
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x050A00
+CONFIG += console warn_on c++14
+CONFIG -= app_bundle
+
+TARGET = goldendict-bench
+TEMPLATE = app
+
+# The library's sources are built right in, as most of what is measured
+# isn't exported from it
+include( ../goldendict.pri )
+
+SOURCES += \
+    bench.cc
+
+unix: LIBS += -lz
+win32: LIBS += -lpsapi
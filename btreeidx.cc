@@ -7,53 +7,139 @@
 #include <QRunnable>
 #include <QThreadPool>
 #include <QSemaphore>
+#include <QThread>
+#include <QTemporaryFile>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <cstdlib>
 #include <QDebug>
 
-//#define __BTREE_USE_LZO
-// LZO mode is experimental and unsupported. Tests didn't show any substantial
-// speed improvements.
+namespace BtreeIndexing {
 
-#ifdef __BTREE_USE_LZO
-#include <lzo/lzo1x.h>
+using gd::wstring;
+using gd::wchar;
 
-namespace {
-struct __LzoInit
+enum
+{
+    BtreeMinElements = 64,
+    BtreeMaxElements = 4096
+};
+
+enum
+{
+    /// The most chains the batch findArticles() scans through on its way
+    /// from one word to the next before giving up and descending the tree.
+    MaxChainsScanned = 256
+};
+
+NodeCache::NodeCache( size_t maxBytes_ ):
+    bytes( 0 ), maxBytes( maxBytes_ ), hits( 0 ), misses( 0 ), metrics( nullptr )
 {
-    __LzoInit()
+}
+
+size_t NodeCache::nodeCost( Node const & node )
+{
+    // Account for the bookkeeping too, not just for the payload
+    return node.data.capacity() + sizeof( Node ) + 64;
+}
+
+NodePtr NodeCache::find( uint32_t offset )
+{
+    Metrics::Lock _( mutex, metrics );
+
+    auto i = index.find( offset );
+
+    if ( i == index.end() )
     {
-        lzo_init();
+        ++misses;
+        return NodePtr();
     }
-} __lzoInit;
+
+    ++hits;
+
+    GD_METRICS_ADD( metrics, IndexNodeCacheHit );
+
+    // Move to the front, as the most recently used one
+    lru.splice( lru.begin(), lru, i->second );
+
+    return i->second->second;
 }
 
-#else
-#include <zlib.h>
-#endif
+void NodeCache::insert( uint32_t offset, NodePtr const & node )
+{
+    Metrics::Lock _( mutex, metrics );
 
-namespace BtreeIndexing {
+    if ( !maxBytes || index.find( offset ) != index.end() )
+        return;
 
-using gd::wstring;
-using gd::wchar;
+    lru.emplace_front( offset, node );
+    index[ offset ] = lru.begin();
+    bytes += nodeCost( *node );
 
-enum
+    evict();
+}
+
+void NodeCache::setMaxBytes( size_t maxBytes_ )
 {
-    BtreeMinElements = 64,
-    BtreeMaxElements = 4096
-};
+    Mutex::Lock _( mutex );
+
+    maxBytes = maxBytes_;
+
+    evict();
+}
+
+void NodeCache::clear()
+{
+    Mutex::Lock _( mutex );
+
+    lru.clear();
+    index.clear();
+    bytes = 0;
+}
+
+NodeCacheStats NodeCache::getStats()
+{
+    Mutex::Lock _( mutex );
+
+    NodeCacheStats stats;
+
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.nodes = index.size();
+    stats.bytes = bytes;
+    stats.maxBytes = maxBytes;
+
+    return stats;
+}
+
+void NodeCache::evict()
+{
+    while( bytes > maxBytes && !lru.empty() )
+    {
+        bytes -= nodeCost( *lru.back().second );
+        index.erase( lru.back().first );
+        lru.pop_back();
+    }
+}
 
 BtreeIndex::BtreeIndex():
-    idxFileMutex( nullptr ), idxFile( nullptr ), indexNodeSize( 0 ),
-    rootOffset( 0 ), rootNodeLoaded( false )
+    idxFileMutex( nullptr ), idxFile( nullptr ), metrics( nullptr ),
+    indexNodeSize( 0 ), rootOffset( 0 ), codec( Codec::Zlib )
+{
+}
+
+void BtreeIndex::setMetrics( Metrics::Set * metrics_ )
 {
+    metrics = metrics_;
+    nodeCache.setMetrics( metrics );
 }
 
 BtreeDictionary::BtreeDictionary( string const & id,
                                   vector< string > const & dictionaryFiles ):
     Dictionary::Class( id, dictionaryFiles )
 {
+    setMetrics( &Metrics::forDictionary( id ) );
 }
 
 string const & BtreeDictionary::ensureInitDone()
@@ -68,23 +154,35 @@ void BtreeIndex::openIndex( IndexInfo const & indexInfo,
 {
     indexNodeSize = indexInfo.btreeMaxElements;
     rootOffset = indexInfo.rootOffset;
+    codec = indexInfo.codec;
 
     idxFile = &file;
     idxFileMutex = &mutex;
 
-    rootNodeLoaded = false;
-    rootNode.clear();
+    idxFile->map();
+
+    {
+        Mutex::Lock _( rootNodeMutex );
+        rootNode.reset();
+    }
+
+    nodeCache.clear();
 }
 
 vector< WordArticleLink > BtreeIndex::findArticles( wstring const & str )
 {
     vector< WordArticleLink > result;
 
-    wstring folded = Folding::apply( str );
+    wstring folded;
+
+    {
+        GD_METRICS_TIME( metrics, Folding );
+        folded = Folding::apply( str );
+    }
 
     bool exactMatch;
 
-    vector< char > leaf;
+    NodePtr leaf;
     uint32_t nextLeaf;
 
     char const * leafEnd;
@@ -103,6 +201,134 @@ vector< WordArticleLink > BtreeIndex::findArticles( wstring const & str )
     return result;
 }
 
+/// Returns the pointer to the chain which follows the given one in a leaf.
+static char const * skipChain( char const * chain )
+{
+    chain += strlen( chain ) + 1; // Skip the folded key
+
+    uint32_t chainSize;
+
+    memcpy( &chainSize, chain, sizeof( uint32_t ) );
+
+    return chain + sizeof( uint32_t ) + chainSize;
+}
+
+vector< vector< WordArticleLink > > BtreeIndex::findArticles( vector< wstring > const & words )
+{
+    vector< vector< WordArticleLink > > result( words.size() );
+
+    vector< wstring > folded( words.size() );
+    vector< string > keys( words.size() );
+    vector< size_t > order( words.size() );
+
+    for( size_t x = 0; x < words.size(); ++x )
+    {
+        {
+            GD_METRICS_TIME( metrics, Folding );
+            folded[ x ] = Folding::apply( words[ x ] );
+        }
+
+        keys[ x ] = Utf8::encode( folded[ x ] );
+        order[ x ] = x;
+    }
+
+    std::sort( order.begin(), order.end(),
+               [ &keys ]( size_t a, size_t b ) { return keys[ a ] < keys[ b ]; } );
+
+    // The leaf we're at, and the first chain in it whose key isn't less than
+    // the one of the previous word. All the words are at it or after it.
+    NodePtr leaf;
+    char const * cursor = nullptr;
+    char const * leafEnd = nullptr;
+    uint32_t nextLeaf = 0;
+
+    vector< WordArticleLink > chain; // Of the previous word, before antialias()
+
+    for( size_t x = 0; x < order.size(); ++x )
+    {
+        size_t wordIndex = order[ x ];
+        string const & key = keys[ wordIndex ];
+
+        if ( !x || key != keys[ order[ x - 1 ] ] )
+        {
+            chain.clear();
+
+            // Scan on from the previous word, if it was found anywhere near
+            bool located = false;
+            bool exactMatch = false;
+
+            for( unsigned scanned = 0; leaf && scanned < MaxChainsScanned; ++scanned )
+            {
+                if ( cursor == leafEnd )
+                {
+                    if ( !nextLeaf )
+                    {
+                        // That was the last leaf, so there's no match
+                        leaf.reset();
+                        located = true;
+                        break;
+                    }
+
+                    leaf = readNode( nextLeaf );
+                    nextLeaf = leaf->nextLeaf;
+                    cursor = &leaf->data.front() + sizeof( uint32_t );
+                    leafEnd = &leaf->data.front() + leaf->data.size();
+
+                    continue;
+                }
+
+                int compareResult = strcmp( key.c_str(), cursor );
+
+                if ( compareResult <= 0 )
+                {
+                    exactMatch = !compareResult;
+                    located = true;
+                    break;
+                }
+
+                cursor = skipChain( cursor );
+            }
+
+            if ( !located )
+            {
+                cursor = findChainOffsetExactOrPrefix( folded[ wordIndex ], exactMatch,
+                                                       leaf, nextLeaf, leafEnd );
+
+                if ( !cursor )
+                    leaf.reset();
+            }
+
+            if ( exactMatch )
+            {
+                char const * ptr = cursor;
+
+                chain = readChain( ptr );
+            }
+        }
+
+        if ( !chain.empty() )
+        {
+            result[ wordIndex ] = chain;
+
+            antialias( words[ wordIndex ], result[ wordIndex ] );
+        }
+    }
+
+    return result;
+}
+
+/// Returns the number of characters in the given utf8 string.
+static size_t utf8Length( char const * str, size_t size )
+{
+    size_t result = 0;
+
+    for( ; size--; ++str )
+        if ( ( *str & 0xC0 ) != 0x80 ) // Skip continuation bytes
+            ++result;
+
+    return result;
+}
+
 class BtreeWordSearchRequest;
 
 class BtreeWordSearchRunnable: public QRunnable
@@ -204,7 +430,12 @@ void BtreeWordSearchRequest::run()
         return;
     }
 
-    wstring folded = Folding::apply( str );
+    wstring folded;
+
+    {
+        GD_METRICS_TIME( dict.metrics, Folding );
+        folded = Folding::apply( str );
+    }
 
     int initialFoldedSize = folded.size();
 
@@ -225,7 +456,7 @@ void BtreeWordSearchRequest::run()
     {
         bool exactMatch;
 
-        vector< char > leaf;
+        NodePtr leaf;
         uint32_t nextLeaf;
         char const * leafEnd;
 
@@ -233,6 +464,8 @@ void BtreeWordSearchRequest::run()
                                                                       leaf, nextLeaf,
                                                                       leafEnd );
 
+        string foldedUtf8 = Utf8::encode( folded );
+
         if ( chainOffset )
             for( ; ; )
             {
@@ -241,24 +474,29 @@ void BtreeWordSearchRequest::run()
 
                 //printf( "offset = %u, size = %u\n", chainOffset - &leaf.front(), leaf.size() );
 
-                vector< WordArticleLink > chain = dict.readChain( chainOffset );
-
-                wstring chainHead = Utf8::decode( chain[ 0 ].word );
+                // The chain begins with its folded key, so we match against it
+                // directly, without decoding and folding the words.
+                char const * key = chainOffset;
+                size_t keySize = strlen( key );
 
-                wstring resultFolded = Folding::apply( chainHead );
+                vector< WordArticleLink > chain = dict.readChain( chainOffset );
 
-                if ( resultFolded.size() >= folded.size() && !resultFolded.compare( 0, folded.size(), folded ) )
+                if ( keySize >= foldedUtf8.size() && !memcmp( key, foldedUtf8.data(), foldedUtf8.size() ) )
                 {
                     // Exact or prefix match
 
+                    // If suffix variation is specified, make sure the string isn't
+                    // larger than requested.
+                    bool suffixFits = ( maxSuffixVariation < 0 ||
+                                        static_cast<int>( utf8Length( key, keySize ) ) - initialFoldedSize <= maxSuffixVariation );
+
                     Mutex::Lock _( dataMutex );
 
                     for( auto & cx : chain )
                     {
-                        // Skip middle matches, if requested. If suffix variation is specified,
-                        // make sure the string isn't larger than requested.
+                        // Skip middle matches, if requested.
                         if ( ( allowMiddleMatches || Folding::apply( Utf8::decode( cx.prefix ) ).empty() ) &&
-                             ( maxSuffixVariation < 0 || static_cast<int>(resultFolded.size()) - initialFoldedSize <= maxSuffixVariation ) )
+                             suffixFits )
                             matches.emplace_back( Utf8::decode( cx.prefix + cx.word ) );
                     }
 
@@ -284,13 +522,11 @@ void BtreeWordSearchRequest::run()
 
                     if ( nextLeaf )
                     {
-                        Mutex::Lock _( *dict.idxFileMutex );
-
-                        dict.readNode( nextLeaf, leaf );
-                        leafEnd = &leaf.front() + leaf.size();
+                        leaf = dict.readNode( nextLeaf );
+                        leafEnd = &leaf->data.front() + leaf->data.size();
 
-                        nextLeaf = dict.idxFile->read< uint32_t >();
-                        chainOffset = &leaf.front() + sizeof( uint32_t );
+                        nextLeaf = leaf->nextLeaf;
+                        chainOffset = &leaf->data.front() + sizeof( uint32_t );
                     }
                     else
                         break; // That was the last leaf
@@ -323,57 +559,120 @@ sptr< Dictionary::WordSearchRequest > BtreeDictionary::stemmedMatch(
                                        false, maxResults );
 }
 
-void BtreeIndex::readNode( uint32_t offset, vector< char > & out )
+bool BtreeDictionary::findExactMatches( vector< wstring > const & words,
+                                        vector< Dictionary::ExactMatches > & matches )
+{
+    if ( !ensureInitDone().empty() )
+        return false;
+
+    vector< vector< WordArticleLink > > links = findArticles( words );
+
+    matches.assign( words.size(), Dictionary::ExactMatches() );
+
+    for( size_t x = 0; x < links.size(); ++x )
+    {
+        Dictionary::ExactMatches & match = matches[ x ];
+
+        for( size_t y = 0; y < links[ x ].size(); ++y )
+        {
+            WordArticleLink const & link = links[ x ][ y ];
+
+            wstring headword = Utf8::decode( link.prefix + link.word );
+
+            if ( std::find( match.headwords.begin(), match.headwords.end(),
+                            headword ) == match.headwords.end() )
+                match.headwords.push_back( headword );
+
+            if ( !y || link.articleOffset < match.articleOrder )
+                match.articleOrder = link.articleOffset;
+        }
+    }
+
+    return true;
+}
+
+NodePtr BtreeIndex::readNode( uint32_t offset )
+{
+    NodePtr node = nodeCache.find( offset );
+
+    if ( !node )
+    {
+        node = loadNode( offset );
+        nodeCache.insert( offset, node );
+    }
+
+    return node;
+}
+
+NodePtr BtreeIndex::loadNode( uint32_t offset )
 {
-    idxFile->seek( offset );
+    GD_METRICS_TIME( metrics, IndexNodeRead );
 
-    auto uncompressedSize = idxFile->read< uint32_t >();
-    auto compressedSize = idxFile->read< uint32_t >();
+    // Only positional reads are used here, so the shared file position is
+    // never touched and no locking is needed.
+    auto uncompressedSize = idxFile->readAt< uint32_t >( offset );
+    auto compressedSize = idxFile->readAt< uint32_t >( offset + sizeof( uint32_t ) );
 
     //printf( "%x,%x\n", uncompressedSize, compressedSize );
 
+    std::shared_ptr< Node > node = std::make_shared< Node >();
+
+    vector< char > & out = node->data;
+
     out.resize( uncompressedSize );
 
-    vector< unsigned char > compressedData( compressedSize );
+    // Uncompress straight from the mapping if the file is mapped, otherwise
+    // read the compressed data in first.
+    vector< unsigned char > compressedData;
+
+    unsigned char const * compressed = reinterpret_cast< unsigned char const * >(
+        idxFile->mappedAt( offset + 2 * sizeof( uint32_t ), compressedSize ) );
 
-    idxFile->read( &compressedData.front(), compressedData.size() );
+    if ( !compressed )
+    {
+        compressedData.resize( compressedSize );
 
-#ifdef __BTREE_USE_LZO
+        idxFile->readAt( &compressedData.front(), compressedData.size(),
+                         offset + 2 * sizeof( uint32_t ) );
 
-    lzo_uint decompressedLength = out.size();
+        compressed = &compressedData.front();
+    }
 
-    if ( lzo1x_decompress( &compressedData.front(), compressedData.size(),
-                           (unsigned char *)&out.front(), &decompressedLength, 0 )
-         != LZO_E_OK || decompressedLength != out.size() )
+    if ( !Codec::decompress( codec, compressed, compressedSize,
+                             &out.front(), out.size() ) )
         throw exFailedToDecompressNode();
 
-#else
+    if ( out.size() < sizeof( uint32_t ) )
+        throw exFailedToDecompressNode();
 
-    unsigned long decompressedLength = out.size();
+    // Leaves are followed by a link to the next leaf. Read it now, so that
+    // the cached leaves wouldn't need any file access at all.
+    uint32_t leafEntries;
 
-    if ( uncompress( reinterpret_cast<unsigned char *>(&out.front()),
-                     &decompressedLength,
-                     &compressedData.front(),
-                     compressedData.size() ) != Z_OK ||
-         decompressedLength != out.size() )
-        throw exFailedToDecompressNode();
-#endif
+    memcpy( &leafEntries, &out.front(), sizeof( uint32_t ) );
+
+    if ( leafEntries != 0xffffFFFF )
+        node->nextLeaf = idxFile->readAt< uint32_t >( offset + 2 * sizeof( uint32_t ) +
+                                                      compressedSize );
+
+    return node;
 }
 
 char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
                                                        bool & exactMatch,
-                                                       vector< char > & extLeaf,
+                                                       NodePtr & extLeaf,
                                                        uint32_t & nextLeaf,
                                                        char const * & leafEnd )
 {
     if ( !idxFile )
         throw exIndexWasNotOpened();
 
-    Mutex::Lock _( *idxFileMutex );
-
-    // Lookup the index by traversing the index btree
+    // Lookup the index by traversing the index btree. All the keys stored in
+    // it are already folded and utf8-encoded, and utf8 sorts just like the
+    // code points do, so we only have to encode the target once and then use
+    // plain byte comparisons.
 
-    vector< wchar > wcharBuffer;
+    string targetUtf8 = Utf8::encode( target );
 
     exactMatch = false;
 
@@ -381,15 +680,21 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
 
     uint32_t currentNodeOffset = rootOffset;
 
-    if ( !rootNodeLoaded )
     {
-        // Time to load our root node. We do it only once, at the first request.
-        readNode( rootOffset, rootNode );
-        rootNodeLoaded = true;
+        Mutex::Lock _( rootNodeMutex );
+
+        if ( !rootNode )
+        {
+            // Time to load our root node. We do it only once, at the first request.
+            // It is kept outside of the cache, so it never gets evicted.
+            rootNode = loadNode( rootOffset );
+        }
+
+        extLeaf = rootNode;
     }
 
-    char const * leaf = &rootNode.front();
-    leafEnd = leaf + rootNode.size();
+    char const * leaf = &extLeaf->data.front();
+    leafEnd = leaf + extLeaf->data.size();
 
     for( ; ; )
     {
@@ -431,19 +736,9 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
 
                 size_t wordSize = strlen( closestString );
 
-                if ( wcharBuffer.size() <= wordSize )
-                    wcharBuffer.resize( wordSize + 1 );
-
-                long result = Utf8::decode( closestString, wordSize, &wcharBuffer.front() );
-
-                if ( result < 0 )
-                    throw Utf8::exCantDecode( closestString );
-
-                wcharBuffer[ result ] = 0;
-
                 //printf( "Checking against %s\n", closestString );
 
-                compareResult = target.compare( &wcharBuffer.front() );
+                compareResult = strcmp( targetUtf8.c_str(), closestString );
 
                 if ( !compareResult )
                 {
@@ -526,9 +821,9 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
             }
 
             //printf( "reading node at %x\n", currentNodeOffset );
-            readNode( currentNodeOffset, extLeaf );
-            leaf = &extLeaf.front();
-            leafEnd = leaf + extLeaf.size();
+            extLeaf = readNode( currentNodeOffset );
+            leaf = &extLeaf->data.front();
+            leafEnd = leaf + extLeaf->data.size();
         }
         else
         {
@@ -536,9 +831,7 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
             // A leaf
 
             // If this leaf is the root, there's no next leaf, it just can't be.
-            // We do this check because the file's position indicator just won't
-            // be in the right place for root node anyway, since we precache it.
-            nextLeaf = ( currentNodeOffset != rootOffset ? idxFile->read< uint32_t >() : 0 );
+            nextLeaf = ( currentNodeOffset != rootOffset ? extLeaf->nextLeaf : 0 );
 
             if ( !leafEntries )
             {
@@ -563,9 +856,9 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
                 {
                     *nextOffset++ = ptr;
 
-                    memcpy( &chainSize, ptr, sizeof( uint32_t ) );
+                    ptr += strlen( ptr ) + 1; // Skip the folded key
 
-                    //printf( "%s + %s\n", ptr + sizeof( uint32_t ), ptr + sizeof( uint32_t ) + strlen( ptr + sizeof( uint32_t ) ) + 1 );
+                    memcpy( &chainSize, ptr, sizeof( uint32_t ) );
 
                     ptr += sizeof( uint32_t ) + chainSize;
                 }
@@ -584,33 +877,18 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
                 char const ** chainToCheck = window + windowSize/2;
                 ptr = *chainToCheck;
 
-                memcpy( &chainSize, ptr, sizeof( uint32_t ) );
-                ptr += sizeof( uint32_t );
-
-                size_t wordSize = strlen( ptr );
-
-                if ( wcharBuffer.size() <= wordSize )
-                    wcharBuffer.resize( wordSize + 1 );
-
-                //printf( "checking agaist word %s, left = %u\n", ptr, leafEntries );
-
-                long result = Utf8::decode( ptr, wordSize, &wcharBuffer.front() );
-
-                if ( result < 0 )
-                    throw Utf8::exCantDecode( ptr );
+                //printf( "checking agaist key %s\n", ptr );
 
-                wcharBuffer[ result ] = 0;
-
-                wstring foldedWord = Folding::apply( &wcharBuffer.front() );
-
-                int compareResult = target.compare( foldedWord );
+                // The chain begins with its folded key, so no decoding or
+                // folding is needed here.
+                int compareResult = strcmp( targetUtf8.c_str(), ptr );
 
                 if ( !compareResult )
                 {
                     // Exact match -- return and be done
                     exactMatch = true;
 
-                    return ptr - sizeof( uint32_t );
+                    return ptr;
                 }
 
                 if ( compareResult < 0 )
@@ -625,7 +903,7 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
                         // That finishes our search. Since our target string
                         // landed before the last tested chain, we return a possible
                         // prefix match against that chain.
-                        return ptr - sizeof( uint32_t );
+                        return ptr;
                     }
 
                 } else {
@@ -645,13 +923,13 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
                         {
                             if ( nextLeaf )
                             {
-                                readNode( nextLeaf, extLeaf );
+                                extLeaf = readNode( nextLeaf );
 
-                                leafEnd = &extLeaf.front() + extLeaf.size();
+                                leafEnd = &extLeaf->data.front() + extLeaf->data.size();
 
-                                nextLeaf = idxFile->read< uint32_t >();
+                                nextLeaf = extLeaf->nextLeaf;
 
-                                return &extLeaf.front() + sizeof( uint32_t );
+                                return &extLeaf->data.front() + sizeof( uint32_t );
                             }
 
                             return nullptr; // This was the last leaf
@@ -669,6 +947,9 @@ char const * BtreeIndex::findChainOffsetExactOrPrefix( wstring const & target,
 
 vector< WordArticleLink > BtreeIndex::readChain( char const * & ptr )
 {
+    // Skip the folded key
+    ptr += strlen( ptr ) + 1;
+
     uint32_t chainSize;
 
     memcpy( &chainSize, ptr, sizeof( uint32_t ) );
@@ -725,153 +1006,618 @@ void BtreeIndex::antialias( wstring const & str,
 }
 
 
-/// A function which recursively creates btree node.
-/// The nextIndex iterator is being iterated over and increased when building
-/// leaf nodes.
-static uint32_t buildBtreeNode( IndexedWords::const_iterator & nextIndex,
-                                size_t indexSize,
-                                File::Class & file, size_t maxElements,
-                                uint32_t & lastLeafLinkOffset )
+enum
 {
-    // We compress all the node data. This buffer would hold it.
-    vector< unsigned char > uncompressedData;
+    SingleWordFlag = 1, // Marks the entries added by addSingleWord()
+    MaxMiddleMatches = 1024, // Don't overpopulate chains with middle matches
+    MinRecordsPerSortPart = 65536,
+    SpillBufferSize = 1024 * 1024
+};
 
-    bool isLeaf = indexSize <= maxElements;
+IndexedWords::IndexedWords():
+    memoryLimit( DefaultIndexedWordsMemoryLimit ), maxThreads( 0 ),
+    entryCount( 0 ), peakBytes( 0 ), sorted( true )
+{
+}
 
-    if ( isLeaf )
-    {
-        // A leaf.
+IndexedWords::~IndexedWords()
+{
+}
 
-        uint32_t totalChainsLength = 0;
+int IndexedWords::getMaxThreads() const
+{
+    int threads = maxThreads > 0 ? maxThreads : QThread::idealThreadCount();
 
-        auto nextWord = nextIndex;
+    return threads < 1 ? 1 : threads;
+}
 
-        for( unsigned x = indexSize; x--; ++nextWord )
-        {
-            totalChainsLength += sizeof( uint32_t );
+/// Orders the records by their keys.
+class IndexedWords::RecordLess
+{
+    char const * arena;
 
-            vector< WordArticleLink > const & chain = nextWord->second;
+public:
+
+    RecordLess( char const * arena_ ): arena( arena_ )
+    {}
 
-            for( const WordArticleLink& link : chain )
-                totalChainsLength += link.word.size() + 1 + link.prefix.size() + 1 + sizeof( uint32_t );
+    bool operator()( Record const & a, Record const & b ) const
+    {
+        if ( a.head != b.head )
+            return a.head < b.head;
+
+        // The first eight bytes are the same, compare the rest
+        size_t size = std::min( a.keySize, b.keySize );
+
+        if ( size > sizeof( a.head ) )
+        {
+            int result = memcmp( arena + a.offset + 1 + sizeof( a.head ),
+                                 arena + b.offset + 1 + sizeof( b.head ),
+                                 size - sizeof( a.head ) );
+            if ( result )
+                return result < 0;
         }
 
-        uncompressedData.resize( sizeof( uint32_t ) + totalChainsLength );
+        return a.keySize < b.keySize;
+    }
+};
 
-        // First uint32_t indicates that this is a leaf.
-        *reinterpret_cast<uint32_t *>(&uncompressedData.front()) = indexSize;
+namespace {
+
+/// Stably sorts a range of records, or merges its two sorted halves.
+template< class Iterator, class Less >
+class RecordSortRunnable: public QRunnable
+{
+    Iterator begin, middle, end;
+    Less less;
+
+public:
+
+    /// If middle is equal to begin, the whole range is sorted. Otherwise,
+    /// [begin, middle) and [middle, end) are merged.
+    RecordSortRunnable( Iterator begin_, Iterator middle_, Iterator end_,
+                        Less const & less_ ):
+        begin( begin_ ), middle( middle_ ), end( end_ ), less( less_ )
+    {}
+
+    void run() override
+    {
+        if ( middle == begin )
+            std::stable_sort( begin, end, less );
+        else
+            std::inplace_merge( begin, middle, end, less );
+    }
+};
 
-        unsigned char * ptr = &uncompressedData.front() + sizeof( uint32_t );
+}
+
+void IndexedWords::sortRecords()
+{
+    if ( sorted )
+        return;
 
-        for( unsigned x = indexSize; x--; ++nextIndex )
+    RecordLess less( arena.data() );
+
+    size_t parts = getMaxThreads();
+
+    if ( parts > records.size() / MinRecordsPerSortPart )
+        parts = records.size() / MinRecordsPerSortPart;
+
+    if ( parts < 2 )
+        std::stable_sort( records.begin(), records.end(), less );
+    else
+    {
+        typedef RecordSortRunnable< vector< Record >::iterator, RecordLess > Runnable;
+
+        // Sort the parts in parallel, and then merge the neighbouring ones,
+        // halving their number each time. Both operations are stable, so
+        // the records with the same key retain their order.
+        QThreadPool pool;
+
+        pool.setMaxThreadCount( parts );
+
+        vector< vector< Record >::iterator > bounds;
+
+        for( size_t x = 0; x <= parts; ++x )
+            bounds.push_back( records.begin() + records.size() * x / parts );
+
+        for( size_t x = 0; x < parts; ++x )
+            pool.start( new Runnable( bounds[ x ], bounds[ x ], bounds[ x + 1 ], less ) );
+
+        pool.waitForDone();
+
+        for( size_t step = 1; step < parts; step *= 2 )
         {
-            vector< WordArticleLink > const & chain = nextIndex->second;
+            for( size_t x = 0; x + step < parts; x += step * 2 )
+                pool.start( new Runnable( bounds[ x ], bounds[ x + step ],
+                                          bounds[ std::min( x + step * 2, parts ) ],
+                                          less ) );
+
+            pool.waitForDone();
+        }
+    }
 
-            unsigned char * saveSizeHere = ptr;
+    sorted = true;
+}
 
-            ptr += sizeof( uint32_t );
+void IndexedWords::spill()
+{
+    sortRecords();
 
-            uint32_t size = 0;
+    std::unique_ptr< QTemporaryFile > file( new QTemporaryFile );
 
-            for(const WordArticleLink & link : chain )
-            {
-                memcpy( ptr, link.word.c_str(), link.word.size() + 1 );
-                ptr += link.word.size() + 1;
+    if ( !file->open() )
+        throw exCantWriteTemporaryFile();
 
-                memcpy( ptr, link.prefix.c_str(), link.prefix.size() + 1 );
-                ptr += link.prefix.size() + 1;
+    // Each entry is saved as its article offset, key size and data size,
+    // followed by the data the way it's stored in the arena.
+    vector< char > buffer;
 
-                memcpy( ptr, &(link.articleOffset), sizeof( uint32_t ) );
-                ptr += sizeof( uint32_t );
+    buffer.reserve( SpillBufferSize );
 
-                size += link.word.size() + 1 + link.prefix.size() + 1 + sizeof( uint32_t );
-            }
+    for( size_t x = 0; x <= records.size(); ++x )
+    {
+        if ( x == records.size() || buffer.size() >= SpillBufferSize )
+        {
+            if ( file->write( buffer.data(), buffer.size() ) != static_cast< qint64 >( buffer.size() ) )
+                throw exCantWriteTemporaryFile();
 
-            memcpy( saveSizeHere, &size, sizeof( uint32_t ) );
+            buffer.clear();
+
+            if ( x == records.size() )
+                break;
         }
+
+        Record const & record = records[ x ];
+
+        char const * data = &arena.front() + record.offset;
+        char const * word = data + 1 + record.keySize;
+        char const * prefix = word + strlen( word ) + 1;
+
+        uint32_t header[ 3 ] = { record.articleOffset, record.keySize,
+                                 static_cast< uint32_t >( prefix + strlen( prefix ) + 1 - data ) };
+
+        buffer.insert( buffer.end(), reinterpret_cast< char const * >( header ),
+                       reinterpret_cast< char const * >( header + 3 ) );
+        buffer.insert( buffer.end(), data, data + header[ 2 ] );
+    }
+
+    if ( !file->flush() )
+        throw exCantWriteTemporaryFile();
+
+    runs.push_back( std::move( file ) );
+
+    records.clear();
+    arena.clear();
+}
+
+void IndexedWords::addRecord( unsigned char flags, string const & folded,
+                              string const & word, string const & prefix,
+                              uint32_t articleOffset )
+{
+    if ( memoryLimit && !records.empty() &&
+         arena.size() + records.size() * sizeof( Record ) >= memoryLimit )
+        spill();
+
+    Record record;
+
+    record.head = 0;
+
+    for( size_t x = 0; x < sizeof( record.head ); ++x )
+        record.head = ( record.head << 8 ) |
+                      ( x < folded.size() ? static_cast< unsigned char >( folded[ x ] ) : 0 );
+
+    record.offset = arena.size();
+    record.keySize = folded.size();
+    record.articleOffset = articleOffset;
+
+    arena.push_back( flags );
+    arena.insert( arena.end(), folded.begin(), folded.end() );
+    arena.insert( arena.end(), word.c_str(), word.c_str() + word.size() + 1 );
+    arena.insert( arena.end(), prefix.c_str(), prefix.c_str() + prefix.size() + 1 );
+
+    records.push_back( record );
+
+    sorted = false;
+    ++entryCount;
+
+    size_t bytes = arena.capacity() + records.capacity() * sizeof( Record );
+
+    if ( bytes > peakBytes )
+        peakBytes = bytes;
+}
+
+void IndexedWords::clear()
+{
+    vector< char >().swap( arena );
+    vector< Record >().swap( records );
+    runs.clear();
+
+    entryCount = 0;
+    peakBytes = 0;
+    sorted = true;
+}
+
+IndexedWordsStats IndexedWords::getStats() const
+{
+    IndexedWordsStats result;
+
+    result.entries = entryCount;
+    result.peakBytes = peakBytes;
+    result.spilledRuns = runs.size();
+
+    return result;
+}
+
+class IndexedWords::Reader
+{
+public:
+
+    /// Sorts the entries, if needed, and positions at the first key.
+    Reader( IndexedWords & );
+
+    /// The number of distinct keys.
+    size_t size() const
+    { return keyCount; }
+
+    bool atEnd() const
+    { return isAtEnd; }
+
+    /// The folded key of the current group.
+    string const & key() const
+    { return groupKey; }
+
+    /// The chain of the current group, in the leaf format: the zero-terminated
+    /// word and prefix, followed by the article offset, for each link.
+    vector< char > const & chain() const
+    { return groupChain; }
+
+    /// Moves on to the next key.
+    void next();
+
+    /// Goes back to the first key.
+    void rewind();
+
+private:
+
+    /// A sorted run of entries, either in a temporary file, or in memory.
+    struct Cursor
+    {
+        QTemporaryFile * file; // Zero for the records in memory
+        Record const * nextRecord, * endRecord;
+        vector< char > buffer;
+
+        // The current entry
+        char const * data;
+        uint32_t keySize, articleOffset;
+
+        Cursor( QTemporaryFile * file_ ): file( file_ ), nextRecord( 0 ),
+            endRecord( 0 ), data( 0 ), keySize( 0 ), articleOffset( 0 )
+        {}
+    };
+
+    IndexedWords & words;
+    vector< Cursor > cursors;
+    vector< unsigned > heap; // Cursors which have entries left
+    size_t keyCount;
+    bool isAtEnd;
+    string groupKey;
+    vector< char > groupChain;
+
+    /// Loads the cursor's next entry. Returns false if it has no more.
+    bool advance( Cursor & );
+
+    /// Orders the cursors' current entries so that the heap yields the
+    /// smallest keys first, and of the same keys, those added first.
+    bool cursorGreater( unsigned, unsigned ) const;
+};
+
+IndexedWords::Reader::Reader( IndexedWords & words_ ): words( words_ ),
+    keyCount( 0 ), isAtEnd( true )
+{
+    words.sortRecords();
+
+    // The runs were saved in the order they were added, and the records
+    // still in memory are the most recent ones.
+    for( auto const & run : words.runs )
+        cursors.emplace_back( run.get() );
+
+    if ( !words.records.empty() )
+        cursors.emplace_back( nullptr );
+
+    if ( words.runs.empty() )
+    {
+        // Everything is in memory, so there's no need to merge just to count
+        RecordLess less( words.arena.data() );
+
+        for( size_t x = 0; x < words.records.size(); ++x )
+            if ( !x || less( words.records[ x - 1 ], words.records[ x ] ) )
+                ++keyCount;
     }
     else
     {
-        // A node which will have children.
+        for( rewind(); !isAtEnd; next() )
+            ++keyCount;
+    }
 
-        uncompressedData.resize( sizeof( uint32_t ) + ( maxElements + 1 ) * sizeof( uint32_t ) );
+    rewind();
+}
 
-        // First uint32_t indicates that this is a node.
-        *reinterpret_cast<uint32_t *>(&uncompressedData.front()) = 0xffffFFFF;
+bool IndexedWords::Reader::advance( Cursor & cursor )
+{
+    if ( !cursor.file )
+    {
+        if ( cursor.nextRecord == cursor.endRecord )
+            return false;
 
-        unsigned prevEntry = 0;
+        cursor.data = &words.arena.front() + cursor.nextRecord->offset;
+        cursor.keySize = cursor.nextRecord->keySize;
+        cursor.articleOffset = cursor.nextRecord->articleOffset;
 
-        for( unsigned x = 0; x < maxElements; ++x )
-        {
-            unsigned curEntry = static_cast<uint64_t>(indexSize) * ( x + 1 ) / ( maxElements + 1 );
+        ++cursor.nextRecord;
 
-            uint32_t offset = buildBtreeNode( nextIndex,
-                                              curEntry - prevEntry,
-                                              file, maxElements,
-                                              lastLeafLinkOffset );
+        return true;
+    }
 
-            memcpy( &uncompressedData.front() + sizeof( uint32_t ) + x * sizeof( uint32_t ), &offset, sizeof( uint32_t ) );
+    uint32_t header[ 3 ];
 
-            size_t sz = nextIndex->first.size() + 1;
+    qint64 result = cursor.file->read( reinterpret_cast< char * >( header ), sizeof( header ) );
 
-            size_t prevSize = uncompressedData.size();
-            uncompressedData.resize( prevSize + sz );
+    if ( !result )
+        return false;
 
-            memcpy( &uncompressedData.front() + prevSize, nextIndex->first.c_str(),
-                    sz );
+    if ( result != sizeof( header ) )
+        throw exCantReadTemporaryFile();
 
-            prevEntry = curEntry;
+    cursor.articleOffset = header[ 0 ];
+    cursor.keySize = header[ 1 ];
+    cursor.buffer.resize( header[ 2 ] );
+
+    if ( !header[ 2 ] ||
+         cursor.file->read( &cursor.buffer.front(), header[ 2 ] ) != header[ 2 ] )
+        throw exCantReadTemporaryFile();
+
+    cursor.data = &cursor.buffer.front();
+
+    return true;
+}
+
+bool IndexedWords::Reader::cursorGreater( unsigned a, unsigned b ) const
+{
+    Cursor const & x = cursors[ a ];
+    Cursor const & y = cursors[ b ];
+
+    int result = memcmp( x.data + 1, y.data + 1, std::min( x.keySize, y.keySize ) );
+
+    if ( result )
+        return result > 0;
+
+    if ( x.keySize != y.keySize )
+        return x.keySize > y.keySize;
+
+    return a > b;
+}
+
+void IndexedWords::Reader::rewind()
+{
+    heap.clear();
+
+    for( unsigned x = 0; x < cursors.size(); ++x )
+    {
+        Cursor & cursor = cursors[ x ];
+
+        if ( cursor.file )
+        {
+            if ( !cursor.file->seek( 0 ) )
+                throw exCantReadTemporaryFile();
+        }
+        else
+        {
+            cursor.nextRecord = words.records.data();
+            cursor.endRecord = cursor.nextRecord + words.records.size();
         }
 
-        // Rightmost child
-        uint32_t offset = buildBtreeNode( nextIndex,
-                                          indexSize - prevEntry,
-                                          file, maxElements,
-                                          lastLeafLinkOffset );
-        memcpy( &uncompressedData.front() + sizeof( uint32_t ) +
-                maxElements * sizeof( uint32_t ), &offset, sizeof( offset ) );
+        if ( advance( cursor ) )
+            heap.push_back( x );
     }
 
-    // Save the result.
+    std::make_heap( heap.begin(), heap.end(),
+                    [ this ]( unsigned a, unsigned b ) { return cursorGreater( a, b ); } );
+
+    next();
+}
 
-#ifdef __BTREE_USE_LZO
+void IndexedWords::Reader::next()
+{
+    if ( heap.empty() )
+    {
+        isAtEnd = true;
+        return;
+    }
 
-    vector< unsigned char > compressedData( uncompressedData.size() + uncompressedData.size() / 16 + 64 + 3 );
+    isAtEnd = false;
 
-    char workMem[ LZO1X_1_MEM_COMPRESS ];
+    auto greater = [ this ]( unsigned a, unsigned b ) { return cursorGreater( a, b ); };
 
-    lzo_uint compressedSize;
+    Cursor const & first = cursors[ heap.front() ];
 
-    if ( lzo1x_1_compress( &uncompressedData.front(), uncompressedData.size(),
-                           &compressedData.front(), &compressedSize, workMem )
-         != LZO_E_OK )
+    groupKey.assign( first.data + 1, first.keySize );
+    groupChain.clear();
+
+    // Go through all the entries with this key, in the order they were added
+    // in, and link them up the same way a map of chains would.
+    size_t linkCount = 0;
+
+    for( bool isFirst = true; !heap.empty(); isFirst = false )
     {
-        qCritical() << "Failed to compress btree node.";
-        abort();
+        Cursor & cursor = cursors[ heap.front() ];
+
+        if ( cursor.keySize != groupKey.size() ||
+             memcmp( cursor.data + 1, groupKey.data(), groupKey.size() ) )
+            break;
+
+        char const * word = cursor.data + 1 + cursor.keySize;
+        size_t wordSize = strlen( word ) + 1;
+
+        char const * prefix = word + wordSize;
+        size_t prefixSize = strlen( prefix ) + 1;
+
+        bool isLinked;
+
+        if ( *cursor.data & SingleWordFlag )
+            isLinked = isFirst; // Only ever added to new keys
+        else
+            isLinked = linkCount < MaxMiddleMatches || prefixSize == 1;
+
+        if ( isLinked )
+        {
+            groupChain.insert( groupChain.end(), word, prefix + prefixSize );
+            groupChain.insert( groupChain.end(),
+                               reinterpret_cast< char const * >( &cursor.articleOffset ),
+                               reinterpret_cast< char const * >( &cursor.articleOffset + 1 ) );
+            ++linkCount;
+        }
+
+        std::pop_heap( heap.begin(), heap.end(), greater );
+
+        if ( advance( cursor ) )
+            std::push_heap( heap.begin(), heap.end(), greater );
+        else
+            heap.pop_back();
     }
+}
+
+namespace {
+
+/// A btree node or leaf queued to be written.
+struct PendingNode
+{
+    Codec::Type codec;
+    size_t number;
+    bool isLeaf;
+    uint32_t uncompressedSize;
+    vector< unsigned char > uncompressedData, compressedData;
+    QSemaphore isCompressed;
+};
 
-#else
+class NodeCompressRunnable: public QRunnable
+{
+    sptr< PendingNode > node;
 
-    vector< unsigned char > compressedData( compressBound( uncompressedData.size() ) );
+public:
 
-    unsigned long compressedSize = compressedData.size();
+    NodeCompressRunnable( sptr< PendingNode > const & node_ ): node( node_ )
+    {}
 
-    if ( compress( &compressedData.front(), &compressedSize,
-                   &uncompressedData.front(), uncompressedData.size() ) != Z_OK )
+    void run() override
     {
-        qCritical() << "Failed to compress btree node.";
-        abort();
+        if ( !Codec::compress( node->codec, &node->uncompressedData.front(),
+                               node->uncompressedData.size(), node->compressedData ) )
+        {
+            qCritical() << "Failed to compress btree node.";
+            abort();
+        }
+
+        vector< unsigned char >().swap( node->uncompressedData );
+
+        node->isCompressed.release();
     }
+};
 
-#endif
+/// Compresses the btree nodes on a pool of threads, and writes them to the
+/// file in the order they were added in, linking the leaves up as it goes.
+/// The number of nodes compressed at once is bounded, so that the memory use
+/// stays low.
+class NodeWriter
+{
+public:
+
+    NodeWriter( File::Class & file, Codec::Type codec, int threads );
+
+    /// Waits for any compression still running.
+    ~NodeWriter();
+
+    /// Queues the node for compression and writing, taking the data from the
+    /// given vector. Returns the node's number, to get its offset with once
+    /// the node is written out.
+    size_t add( vector< unsigned char > & uncompressedData, bool isLeaf );
+
+    /// Writes out all the queued nodes.
+    void flush();
+
+    /// Returns the offset of the node with the given number, which must have
+    /// already been written out.
+    uint32_t getOffset( size_t number ) const
+    { return offsets[ number ]; }
+
+private:
+
+    File::Class & file;
+    Codec::Type codec;
+    QThreadPool pool;
+    size_t maxPending;
+    std::list< sptr< PendingNode > > pending;
+    vector< uint32_t > offsets;
+    uint32_t lastLeafLinkOffset;
+
+    /// Waits for the first queued node to be compressed, and writes it.
+    void writeFirst();
+};
+
+NodeWriter::NodeWriter( File::Class & file_, Codec::Type codec_, int threads ):
+    file( file_ ), codec( codec_ ), lastLeafLinkOffset( 0 )
+{
+    pool.setMaxThreadCount( threads );
+    maxPending = threads * 4;
+}
+
+NodeWriter::~NodeWriter()
+{
+    pool.waitForDone();
+}
+
+size_t NodeWriter::add( vector< unsigned char > & uncompressedData, bool isLeaf )
+{
+    if ( pending.size() >= maxPending )
+        writeFirst();
+
+    sptr< PendingNode > node( new PendingNode );
+
+    node->codec = codec;
+    node->number = offsets.size();
+    node->isLeaf = isLeaf;
+    node->uncompressedSize = uncompressedData.size();
+    node->uncompressedData.swap( uncompressedData );
+
+    offsets.push_back( 0 );
+    pending.push_back( node );
+
+    pool.start( new NodeCompressRunnable( node ) );
+
+    return node->number;
+}
+
+void NodeWriter::flush()
+{
+    while( !pending.empty() )
+        writeFirst();
+}
+
+void NodeWriter::writeFirst()
+{
+    sptr< PendingNode > node = pending.front();
+
+    pending.pop_front();
+
+    node->isCompressed.acquire();
 
     uint32_t offset = file.tell();
 
-    file.write< uint32_t >( uncompressedData.size() );
-    file.write< uint32_t >( compressedSize );
-    file.write( &compressedData.front(), compressedSize );
+    file.write< uint32_t >( node->uncompressedSize );
+    file.write< uint32_t >( node->compressedData.size() );
+    file.write( &node->compressedData.front(), node->compressedData.size() );
 
-    if ( isLeaf )
+    if ( node->isLeaf )
     {
         // A link to the next leef, which is zero and which will be updated
         // should we happen to have another leaf.
@@ -892,10 +1638,117 @@ static uint32_t buildBtreeNode( IndexedWords::const_iterator & nextIndex,
         lastLeafLinkOffset = here - sizeof( uint32_t );
     }
 
-    return offset;
+    offsets[ node->number ] = offset;
+}
+
+}
+
+/// A function which recursively creates btree node.
+/// The nextIndex reader is being advanced when building leaf nodes.
+/// The nodes are serialized in order and then handed over to the writer.
+/// Returns the number the writer has assigned to the node.
+static size_t buildBtreeNode( IndexedWords::Reader & nextIndex,
+                              size_t indexSize,
+                              NodeWriter & writer, size_t maxElements )
+{
+    // We compress all the node data. This buffer would hold it.
+    vector< unsigned char > uncompressedData;
+
+    bool isLeaf = indexSize <= maxElements;
+
+    if ( isLeaf )
+    {
+        // A leaf.
+
+        uncompressedData.resize( sizeof( uint32_t ) );
+
+        // First uint32_t indicates that this is a leaf.
+        *reinterpret_cast<uint32_t *>(&uncompressedData.front()) = indexSize;
+
+        for( unsigned x = indexSize; x--; nextIndex.next() )
+        {
+            string const & key = nextIndex.key();
+            vector< char > const & chain = nextIndex.chain();
+
+            // Each chain begins with its folded key, so that lookups could
+            // compare against it directly.
+            uncompressedData.insert( uncompressedData.end(),
+                                     key.c_str(), key.c_str() + key.size() + 1 );
+
+            uint32_t size = chain.size();
+
+            uncompressedData.insert( uncompressedData.end(),
+                                     reinterpret_cast< unsigned char const * >( &size ),
+                                     reinterpret_cast< unsigned char const * >( &size + 1 ) );
+
+            uncompressedData.insert( uncompressedData.end(), chain.begin(), chain.end() );
+        }
+    }
+    else
+    {
+        // A node which will have children.
+
+        uncompressedData.resize( sizeof( uint32_t ) + ( maxElements + 1 ) * sizeof( uint32_t ) );
+
+        // First uint32_t indicates that this is a node.
+        *reinterpret_cast<uint32_t *>(&uncompressedData.front()) = 0xffffFFFF;
+
+        unsigned prevEntry = 0;
+
+        vector< size_t > children;
+
+        for( unsigned x = 0; x < maxElements; ++x )
+        {
+            unsigned curEntry = static_cast<uint64_t>(indexSize) * ( x + 1 ) / ( maxElements + 1 );
+
+            children.push_back( buildBtreeNode( nextIndex,
+                                                curEntry - prevEntry,
+                                                writer, maxElements ) );
+
+            size_t sz = nextIndex.key().size() + 1;
+
+            size_t prevSize = uncompressedData.size();
+            uncompressedData.resize( prevSize + sz );
+
+            memcpy( &uncompressedData.front() + prevSize, nextIndex.key().c_str(),
+                    sz );
+
+            prevEntry = curEntry;
+        }
+
+        // Rightmost child
+        children.push_back( buildBtreeNode( nextIndex,
+                                            indexSize - prevEntry,
+                                            writer, maxElements ) );
+
+        // The children's offsets are only known once they're written out
+        writer.flush();
+
+        for( unsigned x = 0; x <= maxElements; ++x )
+        {
+            uint32_t offset = writer.getOffset( children[ x ] );
+
+            memcpy( &uncompressedData.front() + sizeof( uint32_t ) + x * sizeof( uint32_t ),
+                    &offset, sizeof( offset ) );
+        }
+    }
+
+    // Save the result.
+
+    return writer.add( uncompressedData, isLeaf );
 }
 
 void IndexedWords::addWord( wstring const & word, uint32_t articleOffset )
+{
+    vector< Entry > entries;
+
+    makeEntries( word, entries );
+
+    for( auto const & entry : entries )
+        addEntry( entry, articleOffset );
+}
+
+void IndexedWords::makeEntries( wstring const & word, vector< Entry > & entries )
 {
     wchar const * wordBegin = word.c_str();
     string::size_type wordSize = word.size();
@@ -927,28 +1780,26 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset )
                 break;
         }
 
-        // Insert this word
+        // Make an entry for this word
         wstring folded = Folding::apply( nextChar );
 
-        auto i = insert(
-                     IndexedWords::value_type(
-                         string( &utfBuffer.front(),
-                                 Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) ),
-                         vector< WordArticleLink >() ) ).first;
+        // Full case folding can make the string longer
+        if ( utfBuffer.size() < folded.size() * 4 )
+            utfBuffer.resize( folded.size() * 4 );
 
-        if ( ( i->second.size() < 1024 ) || ( nextChar == wordBegin ) ) // Don't overpopulate chains with middle matches
-        {
-            // Try to conserve memory somewhat -- slow insertions are ok
-            i->second.reserve( i->second.size() + 1 );
+        entries.emplace_back();
 
-            string utfWord( &utfBuffer.front(),
-                            Utf8::encode( nextChar, wordSize - ( nextChar - wordBegin ), &utfBuffer.front() ) );
+        Entry & entry = entries.back();
 
-            string utfPrefix( &utfBuffer.front(),
-                              Utf8::encode( wordBegin, nextChar - wordBegin, &utfBuffer.front() ) );
+        entry.folded.assign( &utfBuffer.front(),
+                             Utf8::encode( folded.data(), folded.size(), &utfBuffer.front() ) );
 
-            i->second.emplace_back( WordArticleLink( utfWord, articleOffset, utfPrefix ) );
-        }
+        entry.word.assign( &utfBuffer.front(),
+                           Utf8::encode( nextChar, wordSize - ( nextChar - wordBegin ), &utfBuffer.front() ) );
+
+        // The prefix is empty for the word beginning itself only
+        entry.prefix.assign( &utfBuffer.front(),
+                             Utf8::encode( wordBegin, nextChar - wordBegin, &utfBuffer.front() ) );
 
         // Skip all non-whitespace/punctuation
         for( ++nextChar; ; ++nextChar )
@@ -962,28 +1813,31 @@ void IndexedWords::addWord( wstring const & word, uint32_t articleOffset )
     }
 }
 
-void IndexedWords::addSingleWord( wstring const & word, uint32_t articleOffset )
+void IndexedWords::addEntry( Entry const & entry, uint32_t articleOffset )
 {
-    vector< WordArticleLink > links( 1, WordArticleLink( Utf8::encode( word ),
-                                                         articleOffset ) );
+    addRecord( 0, entry.folded, entry.word, entry.prefix, articleOffset );
+}
 
-    insert(
-                IndexedWords::value_type(
-                    Utf8::encode( Folding::apply( word ) ), links ) );
+void IndexedWords::addSingleWord( wstring const & word, uint32_t articleOffset )
+{
+    addRecord( SingleWordFlag, Utf8::encode( Folding::apply( word ) ),
+               Utf8::encode( word ), string(), articleOffset );
 }
 
-IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file )
+IndexInfo buildIndex( IndexedWords & indexedWords, File::Class & file,
+                      Codec::Type codec )
 {
-    size_t indexSize = indexedWords.size();
-    auto nextIndex = indexedWords.cbegin();
+    IndexedWords::Reader nextIndex( indexedWords );
+
+    size_t indexSize = nextIndex.size();
 
     // Skip any empty words. No point in indexing those, and some dictionaries
     // are known to have buggy empty-word entries (Stardict's jargon for instance).
 
-    while( indexSize && nextIndex->first.empty() )
+    while( indexSize && nextIndex.key().empty() )
     {
         indexSize--;
-        ++nextIndex;
+        nextIndex.next();
     }
 
     // We try to stick to two-level tree for most dictionaries. Try finding
@@ -1000,13 +1854,22 @@ IndexInfo buildIndex( IndexedWords const & indexedWords, File::Class & file )
     //printf( "Building a tree of %u elements\n", btreeMaxElements );
 
 
-    uint32_t lastLeafOffset = 0;
+    NodeWriter writer( file, codec, indexedWords.getMaxThreads() );
+
+    size_t root = buildBtreeNode( nextIndex, indexSize,
+                                  writer, btreeMaxElements );
+
+    writer.flush();
 
-    uint32_t rootOffset = buildBtreeNode( nextIndex, indexSize,
-                                          file, btreeMaxElements,
-                                          lastLeafOffset );
+    return IndexInfo( btreeMaxElements, writer.getOffset( root ), codec );
+}
+
+void applyIndexingLimits( IndexedWords & indexedWords, Dictionary::Initializing & initializing )
+{
+    indexedWords.setMaxThreads( initializing.indexingThreads() );
 
-    return IndexInfo( btreeMaxElements, rootOffset );
+    if ( size_t memoryLimit = initializing.indexingMemoryLimit() )
+        indexedWords.setMemoryLimit( memoryLimit );
 }
 
 }
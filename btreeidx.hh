@@ -6,13 +6,20 @@
 
 #include "dictionary.hh"
 #include "file.hh"
+#include "codec.hh"
+#include "metrics.hh"
 
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <memory>
 
 #include <cstdint>
 
+class QTemporaryFile;
+
 /// A base for the dictionary which creates a btree index to look up
 /// the words.
 namespace BtreeIndexing {
@@ -27,7 +34,20 @@ enum
   /// This is to be bumped up each time the internal format changes.
   /// The value isn't used here by itself, it is supposed to be added
   /// to each dictionary's internal format version.
-  FormatVersion = 3
+  FormatVersion = 4
+};
+
+enum
+{
+  /// The default memory budget of each index' node cache, in bytes.
+  DefaultNodeCacheSize = 2 * 1024 * 1024
+};
+
+enum
+{
+  /// The default amount of memory IndexedWords may take before it starts
+  /// spilling its entries to disk, in bytes.
+  DefaultIndexedWordsMemoryLimit = 256 * 1024 * 1024
 };
 
 // These exceptions which might be thrown during the index traversal
@@ -36,6 +56,11 @@ DEF_EX( exIndexWasNotOpened, "The index wasn't opened", Dictionary::Ex )
 DEF_EX( exFailedToDecompressNode, "Failed to decompress a btree's node", Dictionary::Ex )
 DEF_EX( exCorruptedChainData, "Corrupted chain data in the leaf of a btree encountered", Dictionary::Ex )
 
+// These are thrown while building the index, should the temporary files fail
+
+DEF_EX( exCantWriteTemporaryFile, "Failed to spill the index data to a temporary file", Dictionary::Ex )
+DEF_EX( exCantReadTemporaryFile, "Failed to read the spilled index data back", Dictionary::Ex )
+
 /// This structure describes a word linked to its translation. The
 /// translation is represented as an abstract 32-bit offset.
 struct WordArticleLink
@@ -55,12 +80,82 @@ struct WordArticleLink
 struct IndexInfo
 {
   uint32_t btreeMaxElements, rootOffset;
+  Codec::Type codec; // The nodes are compressed with this one
+
+  IndexInfo( uint32_t btreeMaxElements_, uint32_t rootOffset_,
+             Codec::Type codec_ = Codec::Zlib ):
+    btreeMaxElements( btreeMaxElements_ ), rootOffset( rootOffset_ ),
+    codec( codec_ )
+  {}
+};
+
+/// A decompressed btree node or leaf. For leaves, nextLeaf holds the offset
+/// of the leaf which follows this one, or zero if this is the last leaf.
+/// Nodes are shared between the cache and any lookups using them, so they
+/// must never be modified once read.
+struct Node
+{
+  vector< char > data;
+  uint32_t nextLeaf;
 
-  IndexInfo( uint32_t btreeMaxElements_, uint32_t rootOffset_ ):
-    btreeMaxElements( btreeMaxElements_ ), rootOffset( rootOffset_ )
+  Node(): nextLeaf( 0 )
   {}
 };
 
+typedef std::shared_ptr< Node const > NodePtr;
+
+/// Statistics of the node cache, as returned by NodeCache::getStats().
+struct NodeCacheStats
+{
+  uint64_t hits, misses;
+  size_t nodes, bytes, maxBytes;
+};
+
+/// A bounded LRU cache of decompressed btree nodes, keyed by their offsets
+/// in the index file. The cache is thread-safe.
+class NodeCache
+{
+public:
+
+  NodeCache( size_t maxBytes = DefaultNodeCacheSize );
+
+  /// Returns the cached node at the given offset, or an empty pointer if
+  /// there's none. Counts a hit or a miss respectively.
+  NodePtr find( uint32_t offset );
+
+  /// Adds the node to the cache, evicting least recently used nodes if the
+  /// memory budget is exceeded.
+  void insert( uint32_t offset, NodePtr const & );
+
+  /// Changes the memory budget. Zero disables the caching altogether.
+  void setMaxBytes( size_t );
+
+  /// Drops all the cached nodes. The counters are left intact.
+  void clear();
+
+  NodeCacheStats getStats();
+
+  /// Sets where the hits and the waits for the cache's lock are recorded.
+  /// Null, the default, means nowhere.
+  void setMetrics( Metrics::Set * metrics_ )
+  { metrics = metrics_; }
+
+private:
+
+  typedef std::list< std::pair< uint32_t, NodePtr > > Lru;
+
+  Mutex mutex;
+  Lru lru; // Most recently used nodes go first
+  std::unordered_map< uint32_t, Lru::iterator > index;
+  size_t bytes, maxBytes;
+  uint64_t hits, misses;
+  Metrics::Set * metrics;
+
+  static size_t nodeCost( Node const & );
+
+  void evict(); // Must be called with the mutex locked
+};
+
 /// Base btree indexing class which allows using what buildIndex() function
 /// created. It's quite low-lovel and is basically a set of 'bulding blocks'
 /// functions.
@@ -70,10 +165,24 @@ public:
 
   BtreeIndex();
 
+  /// Sets the memory budget of the decompressed node cache, in bytes. Zero
+  /// disables the caching.
+  void setNodeCacheMaxSize( size_t maxBytes )
+  { nodeCache.setMaxBytes( maxBytes ); }
+
+  /// Returns the hit/miss counters and the memory use of the node cache.
+  NodeCacheStats getNodeCacheStats()
+  { return nodeCache.getStats(); }
+
+  /// Sets where the node reads, the folding and the like are recorded.
+  /// BtreeDictionary sets this to the dictionary's own metrics.
+  void setMetrics( Metrics::Set * );
+
 protected:
 
   /// Opens the index. The file reference is saved to be used for
-  /// subsequent lookups.
+  /// subsequent lookups. The file gets memory-mapped, if possible, so that
+  /// the nodes could be uncompressed right from the mapping.
   /// The mutex is the one to be locked when working with the file.
   void openIndex( IndexInfo const &, File::Class &, Mutex & );
 
@@ -81,30 +190,37 @@ protected:
   /// is performed.
   vector< WordArticleLink > findArticles( wstring const & );
 
+  /// Does what the function above does for each of the given words, and
+  /// returns the results in the same order. The words are looked up in the
+  /// order of their folded keys, so each one is mostly found by scanning on
+  /// from where the previous one was, through the same or the following
+  /// leaf, rather than by descending the tree anew.
+  vector< vector< WordArticleLink > > findArticles( vector< wstring > const & );
+
   /// Finds the offset in the btree leaf for the given word, either matching
   /// by an exact match, or by finding the smallest entry that might match
   /// by prefix. It can return zero if there isn't even a possible prefx
   /// match. The input string must already be folded. The exactMatch is set
   /// to true when an exact match is located, and to false otherwise.
-  /// The located leaf is loaded to 'leaf', and the pointer to the next
-  /// leaf is saved to 'nextLeaf'.
-  /// However, due to root node being permanently cached, the 'leaf' passed
-  /// might not get used at all if the root node was the terminal one. In that
-  /// case, the returned pointer wouldn't belong to 'leaf' at all. To that end,
-  /// the leafEnd pointer always holds the pointer to the first byte outside
-  /// the node data.
+  /// The located leaf is saved to 'leaf', which keeps it alive for as long as
+  /// the returned pointer is used, and the pointer to the next leaf is saved
+  /// to 'nextLeaf'. The leafEnd pointer always holds the pointer to the
+  /// first byte outside the leaf data.
+  /// The index file is read using positional reads only, so the function
+  /// needs no locking and can be run from several threads at once.
   char const * findChainOffsetExactOrPrefix( wstring const & target,
                                              bool & exactMatch,
-                                             vector< char > & leaf,
+                                             NodePtr & leaf,
                                              uint32_t & nextLeaf,
                                              char const * & leafEnd );
 
-  /// Reads a node or leaf at the given offset. Just uncompresses its data
-  /// to the given vector and does nothing more.
-  void readNode( uint32_t offset, vector< char > & out );
+  /// Returns the node or leaf at the given offset, either from the node
+  /// cache, or by reading and uncompressing it. Thread-safe.
+  NodePtr readNode( uint32_t offset );
 
   /// Reads the word-article links' chain at the given offset. The pointer
-  /// is updated to point to the next chain, if there's any.
+  /// is updated to point to the next chain, if there's any. Each chain
+  /// begins with its folded, zero-terminated utf8 key, which is skipped.
   vector< WordArticleLink > readChain( char const * & );
 
   /// Drops any alises which arose due to folding. Only case-folded aliases
@@ -113,16 +229,27 @@ protected:
 
 protected:
 
+  /// Not needed for the btree lookups themselves, since those only use
+  /// positional reads. Kept for the derivatives, which share the file.
   Mutex * idxFileMutex;
   File::Class * idxFile;
 
+  /// The metrics of the dictionary, for the derivatives to record their own
+  /// probes to. Can be null.
+  Metrics::Set * metrics;
+
 private:
 
   uint32_t indexNodeSize;
   uint32_t rootOffset;
-  bool rootNodeLoaded;
-  vector< char > rootNode; // We load root note here and keep it at all times,
-                           // since all searches always start with it.
+  Codec::Type codec;
+  Mutex rootNodeMutex; // Protects rootNode
+  NodePtr rootNode; // We load root note here and keep it at all times,
+                    // since all searches always start with it.
+  NodeCache nodeCache;
+
+  /// Reads and uncompresses the node at the given offset, bypassing the cache.
+  NodePtr loadNode( uint32_t offset );
 };
 
 class BtreeWordSearchRequest;
@@ -149,6 +276,11 @@ public:
                                                               unsigned maxSuffixVariation,
                                                               unsigned long maxResults );
 
+  /// Uses the batch findArticles(), so the words share the index traversal.
+  /// The article order is the smallest article offset of the word's links.
+  virtual bool findExactMatches( vector< wstring > const & words,
+                                 vector< Dictionary::ExactMatches > & matches );
+
 protected:
 
   /// Called before each matching operation to ensure that any child init
@@ -163,26 +295,124 @@ protected:
 
 // Everything below is for building the index data.
 
-/// This represents the index in its source form, as a map which binds folded
-/// words to sequences of their unfolded source forms and the corresponding
-/// article offsets. The words are utf8-encoded -- it doesn't break Unicode
-/// sorting, but conserves space.
-struct IndexedWords: public map< string, vector< WordArticleLink > >
+/// Statistics of the IndexedWords' memory use, as returned by
+/// IndexedWords::getStats().
+typedef Dictionary::IndexingStats IndexedWordsStats;
+
+/// This represents the index in its source form, which binds folded words to
+/// sequences of their unfolded source forms and the corresponding article
+/// offsets. The words are utf8-encoded -- it doesn't break Unicode sorting,
+/// but conserves space.
+/// The entries are only appended to an arena as they are added, and get
+/// sorted by their folded forms in one go once buildIndex() is called. When
+/// they take more memory than the limit allows, the entries accumulated so
+/// far are sorted and saved to a temporary file, and all such runs are then
+/// merged together.
+class IndexedWords
 {
-  /// Instead of adding to the map directly, use this function. It does folding
-  /// itself, and for phrases/sentences it adds additional entries beginning with
-  /// each new word.
+public:
+
+  IndexedWords();
+  ~IndexedWords();
+
+  /// Instead of adding to the index directly, use this function. It does
+  /// folding itself, and for phrases/sentences it adds additional entries
+  /// beginning with each new word.
   void addWord( wstring const & word, uint32_t articleOffset );
 
-  /// Differs from addWord() in that it only adds a single entry. We use this
-  /// for zip's file names.
+  /// Differs from addWord() in that it only adds a single entry, and only if
+  /// there's no entry with the same folded form yet. We use this for zip's
+  /// file names.
   void addSingleWord( wstring const & word, uint32_t articleOffset );
+
+  /// A single entry addWord() adds, with all its strings utf8-encoded. Making
+  /// the entries is the costly part of addWord(), and since it needs no
+  /// access to the index, it can be done in parallel for different words.
+  struct Entry
+  {
+    string folded, word, prefix;
+  };
+
+  /// Appends the entries addWord() would add for the given word to 'entries'.
+  static void makeEntries( wstring const & word, vector< Entry > & entries );
+
+  /// Adds an entry made by makeEntries(). Adding the entries of a word in
+  /// order has exactly the same effect as addWord().
+  void addEntry( Entry const &, uint32_t articleOffset );
+
+  bool empty() const
+  { return !entryCount; }
+
+  /// Drops all the entries and any temporary files.
+  void clear();
+
+  /// Sets the amount of memory the entries may take before they are spilled
+  /// to disk. The actual use may exceed it by the vectors' growth. Zero means
+  /// the entries are never spilled.
+  void setMemoryLimit( size_t bytes )
+  { memoryLimit = bytes; }
+
+  /// Sets the number of threads the entries may be sorted on, which is also
+  /// what buildIndex() compresses the nodes on. Zero or less, the default,
+  /// means one per core.
+  void setMaxThreads( int threads )
+  { maxThreads = threads; }
+
+  /// Returns the number of threads to use, one at least.
+  int getMaxThreads() const;
+
+  IndexedWordsStats getStats() const;
+
+  /// Reads the entries back, sorted and grouped by their folded forms, with
+  /// their chains assembled. Used by buildIndex().
+  class Reader;
+
+private:
+
+  /// An entry in the arena. The arena holds a flags byte, followed by the
+  /// folded key, and then by the zero-terminated word and prefix.
+  struct Record
+  {
+    uint64_t head; // The first eight bytes of the key, for quick comparisons
+    uint64_t offset; // Of the entry data in the arena
+    uint32_t keySize;
+    uint32_t articleOffset;
+  };
+
+  class RecordLess;
+
+  vector< char > arena;
+  vector< Record > records;
+  std::vector< std::unique_ptr< QTemporaryFile > > runs;
+  size_t memoryLimit;
+  int maxThreads;
+  uint64_t entryCount;
+  size_t peakBytes;
+  bool sorted;
+
+  void addRecord( unsigned char flags, string const & folded,
+                  string const & word, string const & prefix,
+                  uint32_t articleOffset );
+
+  /// Sorts the records in memory, in parallel if there are many of them.
+  /// Entries with the same key retain the order they were added in.
+  void sortRecords();
+
+  /// Sorts the records in memory and moves them to a new temporary file.
+  void spill();
+
+  friend class Reader;
 };
 
-/// Builds the index, as a compressed btree. Returns IndexInfo.
-/// All the data is stored to the given file, beginning from its current
-/// position.
-IndexInfo buildIndex( IndexedWords const &, File::Class & file );
+/// Builds the index, as a btree compressed with the given codec. Returns
+/// IndexInfo. All the data is stored to the given file, beginning from its
+/// current position.
+IndexInfo buildIndex( IndexedWords &, File::Class & file,
+                      Codec::Type codec = Codec::Zlib );
+
+/// Applies to the IndexedWords the limits the caller of makeDictionaries()
+/// has set for indexing a single dictionary, see Dictionary::Initializing.
+void applyIndexingLimits( IndexedWords &, Dictionary::Initializing & );
 
 }
 
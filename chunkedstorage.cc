@@ -5,10 +5,6 @@
 #include <cstring>
 #include <cstdint>
 
-extern "C" {
-#include <zlib.h>
-}
-
 namespace ChunkedStorage {
 
 enum
@@ -16,8 +12,8 @@ enum
   ChunkMaxSize = 65536 // Can't be more since it would overflow the address
 };
 
-Writer::Writer( File::Class & f ):
-  file( f ), chunkStarted( false ), bufferUsed( 0 )
+Writer::Writer( File::Class & f, Codec::Type codec_ ):
+  file( f ), codec( codec_ ), chunkStarted( false ), bufferUsed( 0 )
 {
   // Create a sratchpad at the beginning of file. We use it to write chunk
   // table if it would fit, in order to save some seek times.
@@ -65,22 +61,14 @@ void Writer::addToBlock( void const * data, size_t size )
 
 void Writer::saveCurrentChunk()
 {
-  size_t maxCompressedSize = compressBound( bufferUsed );
-
-  if ( bufferCompressed.size() < maxCompressedSize )
-    bufferCompressed.resize( maxCompressedSize );
-
-  unsigned long compressedSize = bufferCompressed.size();
-
-  if ( compress( &bufferCompressed.front(), &compressedSize,
-                 &buffer.front(), bufferUsed ) != Z_OK )
+  if ( !Codec::compress( codec, buffer.data(), bufferUsed, bufferCompressed ) )
     throw exFailedToCompressChunk();
 
   offsets.push_back( file.tell() );
 
   file.write( static_cast<uint32_t>(bufferUsed) );
-  file.write( static_cast<uint32_t>(compressedSize) );
-  file.write( &bufferCompressed.front(), compressedSize );
+  file.write( static_cast<uint32_t>(bufferCompressed.size()) );
+  file.write( bufferCompressed.data(), bufferCompressed.size() );
 
   bufferUsed = 0;
 
@@ -118,7 +106,9 @@ uint32_t Writer::finish()
   return offset;
 }
 
-Reader::Reader( File::Class & f, uint32_t offset ): file( f )
+Reader::Reader( File::Class & f, uint32_t offset, Codec::Type codec_ ):
+  file( f ), codec( codec_ ), cacheHand( 0 ), cacheBytes( 0 ), cacheMaxBytes( DefaultChunkCacheSize ),
+  cacheHits( 0 ), cacheMisses( 0 ), metrics( nullptr )
 {
   file.seek( offset );
 
@@ -129,42 +119,155 @@ Reader::Reader( File::Class & f, uint32_t offset ): file( f )
   file.read( &offsets.front(), offsets.size() * sizeof( uint32_t ) );
 }
 
-char * Reader::getBlock( uint32_t address, vector< char > & chunk )
+char const * Reader::getBlock( uint32_t address, ChunkPtr & chunk )
 {
-  size_t chunkIdx = address >> 16;
+  uint32_t chunkIdx = address >> 16;
 
   if ( chunkIdx >= offsets.size() )
     throw exAddressOutOfRange();
 
-  // Read and decompress the chunk
+  chunk.reset();
+
   {
-    file.seek( offsets[ chunkIdx ] );
+    Metrics::Lock _( cacheMutex, metrics );
 
-    auto uncompressedSize = file.read< uint32_t >();
-    auto compressedSize = file.read< uint32_t >();
+    auto i = cacheIndex.find( chunkIdx );
 
-    chunk.resize( uncompressedSize );
+    if ( i != cacheIndex.end() )
+    {
+      ++cacheHits;
 
-    vector< unsigned char > compressedData( compressedSize );
+      GD_METRICS_ADD( metrics, ChunkCacheHit );
 
-    file.read( &compressedData.front(), compressedData.size() );
+      CacheEntry & entry = cache[ i->second ];
 
-    unsigned long decompressedLength = chunk.size();
+      entry.referenced = true;
+      chunk = entry.chunk;
+    }
+    else
+      ++cacheMisses;
+  }
 
-    if ( uncompress( reinterpret_cast<unsigned char *>(&chunk.front()),
-                     &decompressedLength,
-                     &compressedData.front(),
-                     compressedData.size() ) != Z_OK ||
-         decompressedLength != chunk.size() )
-      throw exFailedToDecompressChunk();
+  if ( !chunk )
+  {
+    // Decompress it without holding the lock, so other chunks could be
+    // served in the meantime
+    chunk = loadChunk( chunkIdx );
+
+    Metrics::Lock _( cacheMutex, metrics );
+
+    // Someone else might have loaded it while we did
+    if ( cacheMaxBytes && cacheIndex.find( chunkIdx ) == cacheIndex.end() )
+    {
+      evictChunks( chunk->capacity() );
+
+      CacheEntry entry;
+
+      entry.chunkIdx = chunkIdx;
+      entry.chunk = chunk;
+      entry.referenced = false;
+
+      cacheIndex[ chunkIdx ] = cache.size();
+      cache.push_back( entry );
+
+      cacheBytes += chunk->capacity();
+    }
   }
 
   size_t offsetInChunk = address & 0xffFF;
 
-  if ( offsetInChunk > chunk.size() ) // It can be equal to for 0-sized blocks
+  if ( offsetInChunk > chunk->size() ) // It can be equal to for 0-sized blocks
     throw exAddressOutOfRange();
 
-  return &chunk.front() + offsetInChunk;
+  return chunk->data() + offsetInChunk;
+}
+
+void Reader::setCacheMaxSize( size_t maxBytes )
+{
+  Mutex::Lock _( cacheMutex );
+
+  cacheMaxBytes = maxBytes;
+
+  evictChunks( 0 );
+}
+
+void Reader::getCacheStats( uint64_t & hits, uint64_t & misses )
+{
+  Mutex::Lock _( cacheMutex );
+
+  hits = cacheHits;
+  misses = cacheMisses;
+}
+
+void Reader::evictChunks( size_t extra )
+{
+  while( !cache.empty() && cacheBytes + extra > cacheMaxBytes )
+  {
+    if ( cacheHand >= cache.size() )
+      cacheHand = 0;
+
+    CacheEntry & entry = cache[ cacheHand ];
+
+    if ( entry.referenced )
+    {
+      // Give it a second chance
+      entry.referenced = false;
+      ++cacheHand;
+      continue;
+    }
+
+    // Evict it, moving the last entry into its place
+
+    cacheBytes -= entry.chunk->capacity();
+    cacheIndex.erase( entry.chunkIdx );
+
+    if ( cacheHand != cache.size() - 1 )
+    {
+      entry = cache.back();
+      cacheIndex[ entry.chunkIdx ] = cacheHand;
+    }
+
+    cache.pop_back();
+  }
+}
+
+ChunkPtr Reader::loadChunk( uint32_t chunkIdx )
+{
+  GD_METRICS_TIME( metrics, ChunkRead );
+
+  std::shared_ptr< vector< char > > chunk = std::make_shared< vector< char > >();
+
+  // Read and decompress the chunk
+  {
+    uint32_t chunkOffset = offsets[ chunkIdx ];
+
+    auto uncompressedSize = file.readAt< uint32_t >( chunkOffset );
+    auto compressedSize = file.readAt< uint32_t >( chunkOffset + sizeof( uint32_t ) );
+
+    chunk->resize( uncompressedSize );
+
+    // If the file is mapped, decompress right from the mapping
+    vector< unsigned char > compressedData;
+
+    unsigned char const * compressed = reinterpret_cast< unsigned char const * >(
+      file.mappedAt( chunkOffset + 2 * sizeof( uint32_t ), compressedSize ) );
+
+    if ( !compressed )
+    {
+      compressedData.resize( compressedSize );
+
+      file.readAt( &compressedData.front(), compressedData.size(),
+                   chunkOffset + 2 * sizeof( uint32_t ) );
+
+      compressed = &compressedData.front();
+    }
+
+    if ( !Codec::decompress( codec, compressed, compressedSize,
+                             chunk->data(), chunk->size() ) )
+      throw exFailedToDecompressChunk();
+  }
+
+  return chunk;
 }
 
 }
@@ -6,8 +6,13 @@
 
 #include "ex.hh"
 #include "file.hh"
+#include "mutex.hh"
+#include "codec.hh"
+#include "metrics.hh"
 
 #include <vector>
+#include <memory>
+#include <unordered_map>
 #include <stdint.h>
 
 /// A chunked compression storage. We use this for articles' bodies. The idea
@@ -26,16 +31,28 @@ DEF_EX( exFailedToCompressChunk, "Failed to compress a chunk", Ex )
 DEF_EX( exAddressOutOfRange, "The given chunked address is out of range", Ex )
 DEF_EX( exFailedToDecompressChunk, "Failed to decompress a chunk", Ex )
 
+enum
+{
+  /// The default memory budget of each reader's chunk cache, in bytes.
+  DefaultChunkCacheSize = 1024 * 1024
+};
+
+/// A decompressed chunk. It is shared between the reader's cache and the
+/// callers, so it must never be modified.
+typedef std::shared_ptr< vector< char > const > ChunkPtr;
+
 /// This class writes data blocks in chunks.
 class Writer
 {
   vector< uint32_t > offsets;
   File::Class & file;
+  Codec::Type codec;
   size_t scratchPadOffset, scratchPadSize;
 
 public:
 
-  Writer( File::Class & );
+  /// The chunks are compressed with the given codec.
+  Writer( File::Class &, Codec::Type = Codec::Zlib );
 
   /// Starts new block. Returns its address.
   uint32_t startNewBlock();
@@ -68,21 +85,62 @@ private:
   void saveCurrentChunk();
 };
 
-/// This class reads data blocks previously written by Writer.
+/// This class reads data blocks previously written by Writer. Recently used
+/// chunks are kept decompressed in a cache, which is managed by the CLOCK
+/// algorithm and limited in size. The reader is thread-safe.
 class Reader
 {
   vector< uint32_t > offsets;
   File::Class & file;
+  Codec::Type codec;
 
 public:
-  /// Creates reader by giving it a file to read from and the offset returned
-  /// by Writer::finish().
-  Reader( File::Class &, uint32_t );
+  /// Creates reader by giving it a file to read from, the offset returned
+  /// by Writer::finish() and the codec the Writer was using.
+  Reader( File::Class &, uint32_t, Codec::Type = Codec::Zlib );
 
   /// Reads the block previously written by Writer, identified by its address.
-  /// Uses the user-provided storage to load the entire chunk, and then to
-  /// return a pointer to the requested block inside it.
-  char * getBlock( uint32_t address, vector< char > & );
+  /// The chunk containing the block is stored to 'chunk', which keeps it
+  /// alive, and the pointer to the block inside it is returned. The chunk is
+  /// read with positional reads, or straight from the mapping if the file is
+  /// mapped, so the file position is left intact.
+  char const * getBlock( uint32_t address, ChunkPtr & chunk );
+
+  /// Sets the memory budget of the chunk cache, in bytes. Zero disables the
+  /// caching.
+  void setCacheMaxSize( size_t maxBytes );
+
+  /// Returns the number of cache hits and misses so far.
+  void getCacheStats( uint64_t & hits, uint64_t & misses );
+
+  /// Sets where the chunk reads, the cache hits and the waits for the
+  /// cache's lock are recorded. Null, the default, means nowhere.
+  void setMetrics( Metrics::Set * metrics_ )
+  { metrics = metrics_; }
+
+private:
+
+  struct CacheEntry
+  {
+    uint32_t chunkIdx;
+    ChunkPtr chunk;
+    bool referenced; // The CLOCK's reference bit
+  };
+
+  Mutex cacheMutex;
+  vector< CacheEntry > cache;
+  std::unordered_map< uint32_t, size_t > cacheIndex; // chunkIdx -> cache entry
+  size_t cacheHand; // The CLOCK's hand
+  size_t cacheBytes, cacheMaxBytes;
+  uint64_t cacheHits, cacheMisses;
+  Metrics::Set * metrics;
+
+  /// Reads and decompresses the given chunk, bypassing the cache.
+  ChunkPtr loadChunk( uint32_t chunkIdx );
+
+  /// Evicts chunks until the cache fits into cacheMaxBytes with 'extra'
+  /// more bytes added. Must be called with cacheMutex locked.
+  void evictChunks( size_t extra );
 };
 
 }
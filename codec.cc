@@ -0,0 +1,203 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+#include "codec.hh"
+#include <atomic>
+#include <cstring>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace Codec {
+
+namespace {
+
+#ifdef HAVE_ZSTD
+enum
+{
+    // Decompression speed barely depends on the level, so we favor the size
+    // somewhat, while still keeping the indexing fast.
+    ZstdLevel = 9
+};
+#endif
+
+std::atomic< int > indexCodec( Zlib );
+
+}
+
+bool isSupported( uint32_t type )
+{
+    switch( type )
+    {
+        case Zlib:
+        case Stored:
+            return true;
+#ifdef HAVE_ZSTD
+        case Zstd:
+            return true;
+#endif
+#ifdef HAVE_LZ4
+        case Lz4:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+char const * name( Type type )
+{
+    switch( type )
+    {
+        case Zlib:
+            return "zlib";
+        case Stored:
+            return "stored";
+        case Zstd:
+            return "zstd";
+        case Lz4:
+            return "lz4";
+    }
+
+    return "unknown";
+}
+
+bool compress( Type type, void const * data, size_t size,
+               std::vector< unsigned char > & out )
+{
+    switch( type )
+    {
+        case Zlib:
+        {
+            out.resize( compressBound( size ) );
+
+            unsigned long compressedSize = out.size();
+
+            if ( ::compress( &out.front(), &compressedSize,
+                             static_cast< unsigned char const * >( data ), size ) != Z_OK )
+                return false;
+
+            out.resize( compressedSize );
+
+            return true;
+        }
+
+        case Stored:
+        {
+            unsigned char const * ptr = static_cast< unsigned char const * >( data );
+
+            out.assign( ptr, ptr + size );
+
+            return true;
+        }
+
+#ifdef HAVE_ZSTD
+        case Zstd:
+        {
+            out.resize( ZSTD_compressBound( size ) );
+
+            size_t result = ZSTD_compress( &out.front(), out.size(), data, size, ZstdLevel );
+
+            if ( ZSTD_isError( result ) )
+                return false;
+
+            out.resize( result );
+
+            return true;
+        }
+#endif
+
+#ifdef HAVE_LZ4
+        case Lz4:
+        {
+            int bound = LZ4_compressBound( size );
+
+            if ( bound <= 0 )
+                return false;
+
+            out.resize( bound );
+
+            int result = LZ4_compress_default( static_cast< char const * >( data ),
+                                               reinterpret_cast< char * >( &out.front() ),
+                                               size, bound );
+            if ( result <= 0 )
+                return false;
+
+            out.resize( result );
+
+            return true;
+        }
+#endif
+
+        default:
+            return false;
+    }
+}
+
+bool decompress( Type type, void const * data, size_t size,
+                 void * out, size_t outSize )
+{
+    switch( type )
+    {
+        case Zlib:
+        {
+            unsigned long decompressedLength = outSize;
+
+            return ::uncompress( static_cast< unsigned char * >( out ), &decompressedLength,
+                                 static_cast< unsigned char const * >( data ), size ) == Z_OK &&
+                   decompressedLength == outSize;
+        }
+
+        case Stored:
+            if ( size != outSize )
+                return false;
+
+            if ( size )
+                memcpy( out, data, size );
+
+            return true;
+
+#ifdef HAVE_ZSTD
+        case Zstd:
+        {
+            size_t result = ZSTD_decompress( out, outSize, data, size );
+
+            return !ZSTD_isError( result ) && result == outSize;
+        }
+#endif
+
+#ifdef HAVE_LZ4
+        case Lz4:
+            return LZ4_decompress_safe( static_cast< char const * >( data ),
+                                        static_cast< char * >( out ),
+                                        size, outSize ) == static_cast< int >( outSize );
+#endif
+
+        default:
+            return false;
+    }
+}
+
+bool setIndexCodec( Type type )
+{
+    if ( !isSupported( type ) )
+        return false;
+
+    indexCodec = type;
+
+    return true;
+}
+
+Type getIndexCodec()
+{
+    return static_cast< Type >( indexCodec.load() );
+}
+
+}
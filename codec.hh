@@ -0,0 +1,56 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+#ifndef __CODEC_HH_INCLUDED__
+#define __CODEC_HH_INCLUDED__
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/// The compression codecs the indexes' btree nodes and chunked storages can
+/// be written with. Zlib and Stored are always available, while zstd and
+/// LZ4 are only built in when enabled with CONFIG+=zstd and CONFIG+=lz4
+/// respectively.
+namespace Codec {
+
+/// The codec is saved to the index files, so the values must never change.
+enum Type
+{
+  Zlib = 0,
+  Stored = 1, // No compression at all
+  Zstd = 2,
+  Lz4 = 3
+};
+
+/// Returns true if the given codec is known and built in. Takes an integer,
+/// since the values come from the index files.
+bool isSupported( uint32_t type );
+
+/// Returns the codec's short name, such as "zlib".
+char const * name( Type );
+
+/// Compresses the given data, replacing the contents of 'out' with the
+/// result. Returns false if the compression fails, or if the codec isn't
+/// built in.
+bool compress( Type, void const * data, size_t size,
+               std::vector< unsigned char > & out );
+
+/// Decompresses the given data into 'out', which must hold exactly the size
+/// of the original data. Returns false if the data is corrupt, or if the
+/// codec isn't built in.
+bool decompress( Type, void const * data, size_t size,
+                 void * out, size_t outSize );
+
+/// Sets the codec the new indexes are to be written with. The existing
+/// indexes are kept as they are, whatever their codec is. Returns false and
+/// changes nothing if the codec isn't built in.
+bool setIndexCodec( Type );
+
+/// Returns the codec the new indexes are to be written with. Zlib is the
+/// default.
+Type getIndexCodec();
+
+}
+
+#endif
@@ -41,7 +41,7 @@ DEF_EX( exInvalidBase64, "Invalid base64 sequence encountered", Dictionary::Ex )
 enum
 {
     Signature = 0x58444344, // DCDX on little-endian, XDCD on big-endian
-            CurrentFormatVersion = 3 + BtreeIndexing::FormatVersion + Folding::Version
+            CurrentFormatVersion = 4 + BtreeIndexing::FormatVersion + Folding::Version
 };
 
 struct IdxHeader
@@ -53,6 +53,7 @@ struct IdxHeader
     uint32_t indexRootOffset;
     uint32_t langFrom;  // Source language
     uint32_t langTo;    // Target language
+    uint32_t codec; // Codec::Type of the btree
 }
 __attribute__((packed))
 ;
@@ -65,7 +66,8 @@ bool indexIsOldOrBad( string const & indexFile )
 
     return (idx.readRecords( &header, sizeof( header ), 1 ) != 1) ||
             (header.signature != Signature) ||
-            (header.formatVersion != CurrentFormatVersion);
+            (header.formatVersion != CurrentFormatVersion) ||
+            !Codec::isSupported( header.codec );
 }
 
 class DictdDictionary: public BtreeIndexing::BtreeDictionary
@@ -128,7 +130,8 @@ DictdDictionary::DictdDictionary( string const & id,
     // Initialize the index
 
     openIndex( IndexInfo( idxHeader.indexBtreeMaxElements,
-                          idxHeader.indexRootOffset ),
+                          idxHeader.indexRootOffset,
+                          static_cast< Codec::Type >( idxHeader.codec ) ),
                idx, idxMutex );
 }
 
@@ -234,17 +237,26 @@ sptr< Dictionary::DataRequest > DictdDictionary::getArticle( wstring const & wor
             uint32_t articleOffset = decodeBase64( string( tab1 + 1, tab2 - tab1 - 1 ) );
             uint32_t articleSize = decodeBase64( tab2 + 1 );
 
-            char * articleBody = dict_data_read_( dz, articleOffset, articleSize, nullptr, nullptr );
+            // The dictzip reader is thread-safe, so no locking is needed here
+            dictView articleBody;
 
-            if ( !articleBody )
-                throw exCantReadFile( getDictionaryFilenames()[ 1 ] );
+            {
+                GD_METRICS_TIME( metrics, ArticleRead );
+
+                if ( dict_data_read_view( dz, articleOffset, articleSize, &articleBody ) != 0 )
+                    throw exCantReadFile( getDictionaryFilenames()[ 1 ] );
+            }
 
             //sprintf( buf, "Offset: %u, Size: %u\n", articleOffset, articleSize );
 
-            string articleText = string( "<div class=\"dictd_article\">" ) +
-                                 Html::preformat( articleBody ) + "</div>";
+            // The body used to be read up to its first zero byte, if any
+            string body( articleBody.data,
+                         strnlen( articleBody.data, articleBody.size ) );
 
-            free( articleBody );
+            dict_data_release_view( &articleBody );
+
+            string articleText = string( "<div class=\"dictd_article\">" ) +
+                                 Html::preformat( body ) + "</div>";
 
             // Ok. Now, does it go to main articles, or to alternate ones? We list
             // main ones first, and alternates after.
@@ -361,6 +373,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                 IndexedWords indexedWords;
 
+                BtreeIndexing::applyIndexingLimits( indexedWords, initializing );
+
                 File::Class indexFile( dictFiles[ 0 ], "rb" );
 
                 // Read words from index until none's left.
@@ -392,7 +406,13 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                 // Build index
 
-                IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx );
+                idxHeader.codec = Codec::getIndexCodec();
+
+                IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx,
+                                                               static_cast< Codec::Type >( idxHeader.codec ) );
+
+                initializing.indexedDictionary( nameFromFileName( dictFiles[ 0 ] ),
+                                                indexedWords.getStats() );
 
                 idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
                 idxHeader.indexRootOffset = idxInfo.rootOffset;
@@ -7,6 +7,7 @@
 #include "dictionary.hh"
 
 #include <QCryptographicHash>
+#include <QElapsedTimer>
 
 // For needToRebuildIndex(), read below
 #include <QFileInfo>
@@ -24,6 +25,35 @@ bool Request::isFinished()
   return (isFinishedFlag.load()!=0);
 }
 
+void Request::waitUntilFinished()
+{
+  Mutex::Lock _( finishedMutex );
+
+  while( isFinishedFlag.load() == 0 )
+    finishedCondition.wait( &finishedMutex );
+}
+
+bool Request::waitUntilFinished( unsigned long timeoutMs )
+{
+  QElapsedTimer elapsed;
+
+  elapsed.start();
+
+  Mutex::Lock _( finishedMutex );
+
+  while( isFinishedFlag.load() == 0 )
+  {
+    qint64 left = qint64( timeoutMs ) - elapsed.elapsed();
+
+    if ( left <= 0 )
+      return false;
+
+    finishedCondition.wait( &finishedMutex, left );
+  }
+
+  return true;
+}
+
 void Request::update()
 {
   if ( isFinishedFlag.load() == 0 )
@@ -34,7 +64,13 @@ void Request::finish()
 {
   if ( isFinishedFlag.load() == 0 )
   {
-    isFinishedFlag.ref();
+    {
+      Mutex::Lock _( finishedMutex );
+
+      isFinishedFlag.ref();
+
+      finishedCondition.wakeAll();
+    }
 
     emit finished();
   }
@@ -126,6 +162,22 @@ sptr< WordSearchRequest > Class::stemmedMatch( wstring const & /*str*/,
   return new WordSearchRequestInstant();
 }
 
+sptr< DataRequest > Class::getArticleNow( wstring const & word,
+                                         vector< wstring > const & alts,
+                                         wstring const & context )
+{
+  sptr< DataRequest > result = getArticle( word, alts, context );
+
+  result->waitUntilFinished();
+
+  return result;
+}
+
+bool Class::findExactMatches( vector< wstring > const &, vector< ExactMatches > & )
+{
+  return false;
+}
+
 sptr< WordSearchRequest > Class::findHeadwordsForSynonym( wstring const & )
 {
   return new WordSearchRequestInstant();
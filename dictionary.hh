@@ -7,7 +7,9 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <cstdint>
 #include <QObject>
+#include <QWaitCondition>
 #include "sptr.hh"
 #include "ex.hh"
 #include "mutex.hh"
@@ -46,7 +48,10 @@ DEF_EX( exRequestUnfinished, "The request hasn't yet finished", Ex )
 /// operations are fast (this is most important for word searches, where
 /// new requests are created and old ones deleted immediately upon a user
 /// changing query).
-class Request: public QObject
+///
+/// Requests are reference-counted intrusively, so that an sptr to a newly
+/// created request costs no allocations other than the request itself.
+class Request: public QObject, public sptr_counted
 {
   Q_OBJECT
 
@@ -56,6 +61,16 @@ public:
   /// This means that the data accumulated is final and won't change anymore.
   bool isFinished();
 
+  /// Blocks the calling thread until the request has finished. This is for
+  /// the requests which are processed in other threads, as those of the
+  /// local dictionaries are. Don't use it for the requests which depend on
+  /// the calling thread's event loop to make progress.
+  void waitUntilFinished();
+
+  /// Same as the above, but gives up after the given number of milliseconds.
+  /// Returns whether the request has finished.
+  bool waitUntilFinished( unsigned long timeoutMs );
+
   /// Either returns an empty string in case there was no error processing
   /// the request, or otherwise a human-readable string describing the problem.
   /// Note that an empty result, such as a lack of word or of an article isn't
@@ -104,6 +119,9 @@ private:
 
   QAtomicInt isFinishedFlag;
 
+  Mutex finishedMutex; // Protects the flag's change for waitUntilFinished()
+  QWaitCondition finishedCondition;
+
   Mutex errorStringMutex;
   QString errorString;
 };
@@ -248,6 +266,20 @@ enum Feature
 Q_DECLARE_FLAGS( Features, Feature )
 Q_DECLARE_OPERATORS_FOR_FLAGS( Features )
 
+/// The exact matches of a word, as found by Class::findExactMatches().
+struct ExactMatches
+{
+  vector< wstring > headwords; // Empty if the word has no articles
+
+  /// Where the word's first article is stored, in a dictionary-specific
+  /// sense. Looking the words up in the order of these makes the article
+  /// reads as sequential as possible.
+  quint32 articleOrder;
+
+  ExactMatches(): articleOrder( 0 )
+  {}
+};
+
 /// A dictionary. Can be used to query words.
 class Class
 {
@@ -331,6 +363,14 @@ public:
   /// result.
   virtual sptr< WordSearchRequest > findHeadwordsForSynonym( wstring const & );
 
+  /// Finds the exact matches of many words at once, synchronously, storing
+  /// them to 'matches' in the same order as the words. A word without any
+  /// exact matches has no articles, so getArticle() needs not be asked for
+  /// it. Returns false if the dictionary can't tell, which is what the
+  /// default implementation does.
+  virtual bool findExactMatches( vector< wstring > const & words,
+                                 vector< ExactMatches > & matches );
+
   /// For a given word, provides alternate writings of it which are to be looked
   /// up alongside with it. Transliteration dictionaries implement this. The
   /// default implementation returns an empty list. Note that this function is
@@ -350,6 +390,14 @@ public:
                                           vector< wstring > const & alts,
                                           wstring const & context = wstring() )=0;
 
+  /// Does the same as getArticle(), but returns the request finished. The
+  /// local dictionaries do the lookup right in the calling thread, so no
+  /// event loop or thread switching is involved. The default implementation
+  /// calls getArticle() and waits for the request to finish.
+  virtual sptr< DataRequest > getArticleNow( wstring const &,
+                                             vector< wstring > const & alts,
+                                             wstring const & context = wstring() );
+
   /// Loads contents of a resource named 'name' into the 'data' vector. This is
   /// usually a picture file referenced in the article or something like that.
   /// The default implementation always returns the non-existing resource
@@ -360,6 +408,15 @@ public:
   {}
 };
 
+/// Statistics of the memory the words of a dictionary took while it was
+/// being indexed, as reported by Initializing::indexedDictionary().
+struct IndexingStats
+{
+  uint64_t entries; // Number of entries added, in total
+  size_t peakBytes; // The most memory held at once by the entries
+  unsigned spilledRuns; // Number of sorted runs saved to disk
+};
+
 /// Callbacks to be used when the dictionaries are being initialized.
 class Initializing
 {
@@ -371,6 +428,24 @@ public:
   /// The dictionaryName is in utf8.
   virtual void indexingDictionary( string const & dictionaryName ) =0;
 
+  /// Called once the given dictionary has been indexed, with the statistics
+  /// of its words' memory use. The default does nothing.
+  virtual void indexedDictionary( string const & /*dictionaryName*/,
+                                  IndexingStats const & )
+  {}
+
+  /// Returns the number of threads the indexing of a single dictionary may
+  /// use. Those indexing several dictionaries at once share their threads
+  /// between them through this. Zero, the default, means one per core.
+  virtual int indexingThreads()
+  { return 0; }
+
+  /// Returns the amount of memory, in bytes, the words being indexed of a
+  /// single dictionary may take before they're spilled to disk. Zero, the
+  /// default, leaves the indexer's own default limit.
+  virtual size_t indexingMemoryLimit()
+  { return 0; }
+
   virtual ~Initializing()
   {}
 };
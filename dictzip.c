@@ -138,7 +138,9 @@
 
 #include <sys/stat.h>
 
-#define USE_CACHE 1
+#ifndef __WIN32
+#include <unistd.h>
+#endif
 
 #define dict_data_filter( ... )
 #define PRINTF( ... )
@@ -451,10 +453,387 @@ static int dict_read_header( const char *filename,
    return 0;
 }
 
+/* Portable mutexes and positional reads */
+
+static void dict_mutex_init( dictMutex *m )
+{
+#ifdef __WIN32
+   InitializeCriticalSection( m );
+#else
+   pthread_mutex_init( m, NULL );
+#endif
+}
+
+static void dict_mutex_destroy( dictMutex *m )
+{
+#ifdef __WIN32
+   DeleteCriticalSection( m );
+#else
+   pthread_mutex_destroy( m );
+#endif
+}
+
+static void dict_mutex_lock( dictMutex *m )
+{
+#ifdef __WIN32
+   EnterCriticalSection( m );
+#else
+   pthread_mutex_lock( m );
+#endif
+}
+
+static void dict_mutex_unlock( dictMutex *m )
+{
+#ifdef __WIN32
+   LeaveCriticalSection( m );
+#else
+   pthread_mutex_unlock( m );
+#endif
+}
+
+/* Reads exactly 'size' bytes at the given offset. Returns 0 on success. The
+   file position is left intact where positional reads are available, so no
+   locking is needed there. */
+static int dict_read_at( dictData *h, void *buffer, unsigned long size,
+                         unsigned long offset )
+{
+#ifdef __WIN32
+   int result;
+
+   dict_mutex_lock( &h->fileMutex );
+   result = ( fseek( h->fd, offset, SEEK_SET ) != 0 ||
+              fread( buffer, size, 1, h->fd ) != 1 ) ? -1 : 0;
+   dict_mutex_unlock( &h->fileMutex );
+
+   return result;
+#else
+   char *pt = buffer;
+
+   while ( size ) {
+      ssize_t result = pread( fileno( h->fd ), pt, size, offset );
+
+      if ( result < 0 && errno == EINTR )
+         continue;
+
+      if ( result <= 0 )
+         return -1;
+
+      pt     += result;
+      offset += result;
+      size   -= result;
+   }
+
+   return 0;
+#endif
+}
+
+/* The chunk cache */
+
+static void dict_cache_free( dictData *h )
+{
+   int i, j;
+
+   for (i = 0; i < h->shardCount; ++i) {
+      dictCacheShard *shard = &h->shards[i];
+
+      for (j = 0; j < shard->entryCount; ++j) {
+         dictChunk *chunk = shard->entries[j].chunk;
+
+         /* Any views outstanding at this point are a caller's bug */
+         if (chunk && --chunk->refs == 0) {
+            xfree( chunk->inBuffer );
+            xfree( chunk );
+         }
+      }
+
+      xfree( shard->entries );
+      dict_mutex_destroy( &shard->mutex );
+   }
+
+   if (h->shards)
+      xfree( h->shards );
+
+   h->shards     = NULL;
+   h->shardCount = 0;
+}
+
+void dict_data_set_cache_size( dictData *h, int chunks )
+{
+   int i, shardCount;
+
+   dict_cache_free( h );
+
+   if (chunks <= 0)
+      return;
+
+   shardCount = chunks < DICT_CACHE_SHARDS ? chunks : DICT_CACHE_SHARDS;
+
+   h->shards = xmalloc( shardCount * sizeof( dictCacheShard ) );
+   if (!h->shards)
+      return;
+
+   for (i = 0; i < shardCount; ++i) {
+      dictCacheShard *shard = &h->shards[i];
+
+      /* Spread the remainder over the first shards */
+      shard->entryCount = chunks / shardCount + ( i < chunks % shardCount );
+      shard->entries    = calloc( shard->entryCount, sizeof( dictCacheEntry ) );
+      shard->stamp      = 0;
+      dict_mutex_init( &shard->mutex );
+
+      if (!shard->entries)
+         shard->entryCount = 0;
+   }
+
+   h->shardCount = shardCount;
+}
+
+/* Returns the cached chunk, with its reference count increased, or NULL. */
+static dictChunk *dict_cache_find( dictData *h, int i )
+{
+   dictCacheShard *shard;
+   dictChunk      *result = NULL;
+   int            j;
+
+   if (!h->shardCount)
+      return NULL;
+
+   shard = &h->shards[i % h->shardCount];
+
+   dict_mutex_lock( &shard->mutex );
+
+   for (j = 0; j < shard->entryCount; ++j) {
+      if (shard->entries[j].chunk && shard->entries[j].chunk->chunk == i) {
+         result = shard->entries[j].chunk;
+         ++result->refs;
+         shard->entries[j].stamp = ++shard->stamp;
+         break;
+      }
+   }
+
+   dict_mutex_unlock( &shard->mutex );
+
+   return result;
+}
+
+/* Puts the freshly decompressed chunk to the cache, evicting the least
+   recently used one. If another thread has cached the same chunk in the
+   meantime, the new one is dropped and the cached one is returned instead.
+   The chunk returned always has a reference held for the caller. */
+static dictChunk *dict_cache_insert( dictData *h, dictChunk *chunk )
+{
+   dictCacheShard *shard;
+   dictChunk      *evicted = NULL;
+   int            j, target = 0, lastStamp = INT_MAX;
+
+   chunk->refs = 1;
+
+   if (!h->shardCount)
+      return chunk;
+
+   shard = &h->shards[chunk->chunk % h->shardCount];
+   chunk->shard = shard;
+
+   dict_mutex_lock( &shard->mutex );
+
+   for (j = 0; j < shard->entryCount; ++j) {
+      dictCacheEntry *entry = &shard->entries[j];
+
+      if (entry->chunk && entry->chunk->chunk == chunk->chunk) {
+         /* Someone else was faster */
+         dictChunk *cached = entry->chunk;
+
+         ++cached->refs;
+         entry->stamp = ++shard->stamp;
+
+         dict_mutex_unlock( &shard->mutex );
+
+         xfree( chunk->inBuffer );
+         xfree( chunk );
+
+         return cached;
+      }
+
+      if (!entry->chunk) {
+         if (lastStamp > -1) {
+            lastStamp = -1;
+            target = j;
+         }
+      }
+      else if (entry->stamp < lastStamp) {
+         lastStamp = entry->stamp;
+         target = j;
+      }
+   }
+
+   if (shard->entryCount) {
+      dictCacheEntry *entry = &shard->entries[target];
+
+      if (entry->chunk && --entry->chunk->refs == 0)
+         evicted = entry->chunk;
+
+      ++chunk->refs;
+      entry->chunk = chunk;
+      entry->stamp = ++shard->stamp;
+   }
+
+   dict_mutex_unlock( &shard->mutex );
+
+   if (evicted) {
+      xfree( evicted->inBuffer );
+      xfree( evicted );
+   }
+
+   return chunk;
+}
+
+static void dict_chunk_release( dictChunk *chunk )
+{
+   int last;
+
+   if (chunk->shard) {
+      dict_mutex_lock( &chunk->shard->mutex );
+      last = ( --chunk->refs == 0 );
+      dict_mutex_unlock( &chunk->shard->mutex );
+   }
+   else
+      last = ( --chunk->refs == 0 ); /* Was never shared */
+
+   if (last) {
+      xfree( chunk->inBuffer );
+      xfree( chunk );
+   }
+}
+
+/* The inflate stream pool */
+
+static dictStream *dict_stream_acquire( dictData *h )
+{
+   dictStream *stream;
+
+   dict_mutex_lock( &h->streamMutex );
+   stream = h->freeStreams;
+   if (stream)
+      h->freeStreams = stream->next;
+   dict_mutex_unlock( &h->streamMutex );
+
+   if (stream)
+      return stream;
+
+   stream = xmalloc( sizeof( dictStream ) );
+   if (!stream)
+      return NULL;
+
+   memset( stream, 0, sizeof( dictStream ) );
+
+   if (inflateInit2( &stream->zStream, -15 ) != Z_OK) {
+      err_internal( __func__,
+                    "Cannot initialize inflation engine: %s\n",
+                    stream->zStream.msg );
+      xfree( stream );
+      return NULL;
+   }
+
+   return stream;
+}
+
+static void dict_stream_release( dictData *h, dictStream *stream )
+{
+   dict_mutex_lock( &h->streamMutex );
+   stream->next   = h->freeStreams;
+   h->freeStreams = stream;
+   dict_mutex_unlock( &h->streamMutex );
+}
+
+static void dict_stream_free( dictStream *stream )
+{
+   if (inflateEnd( &stream->zStream ))
+      err_internal( __func__,
+                    "Cannot shut down inflation engine: %s\n",
+                    stream->zStream.msg );
+   xfree( stream );
+}
+
+/* Returns the given chunk decompressed, with a reference held for the
+   caller, or NULL on failure. */
+static dictChunk *dict_chunk_get( dictData *h, int i )
+{
+   dictChunk  *chunk;
+   dictStream *stream;
+   char       outBuffer[OUT_BUFFER_SIZE];
+   int        result;
+
+   chunk = dict_cache_find( h, i );
+   if (chunk)
+      return chunk;
+
+   if (h->chunks[i] >= OUT_BUFFER_SIZE ) {
+      err_internal( __func__,
+                    "h->chunks[%d] = %d >= %ld (OUT_BUFFER_SIZE)\n",
+                    i, h->chunks[i], OUT_BUFFER_SIZE );
+      return NULL;
+   }
+
+   if (dict_read_at( h, outBuffer, h->chunks[i], h->offsets[i] ))
+      return NULL;
+
+   chunk = xmalloc( sizeof( dictChunk ) );
+   if (!chunk)
+      return NULL;
+
+   memset( chunk, 0, sizeof( dictChunk ) );
+   chunk->chunk    = i;
+   chunk->inBuffer = xmalloc( IN_BUFFER_SIZE );
+
+   stream = dict_stream_acquire( h );
+
+   if (!chunk->inBuffer || !stream) {
+      if (stream)
+         dict_stream_release( h, stream );
+      xfree( chunk->inBuffer );
+      xfree( chunk );
+      return NULL;
+   }
+
+   /* Each chunk ends with a full flush, so any stream can decompress any
+      chunk, regardless of what it has decompressed before */
+   stream->zStream.next_in   = (Bytef *)outBuffer;
+   stream->zStream.avail_in  = h->chunks[i];
+   stream->zStream.next_out  = (Bytef *)chunk->inBuffer;
+   stream->zStream.avail_out = IN_BUFFER_SIZE;
+
+   result = inflate( &stream->zStream, Z_PARTIAL_FLUSH );
+
+   /* The last chunk ends the deflate stream, so the inflate stream needs a
+      reset to go on with other chunks */
+   if (result == Z_STREAM_END)
+      result = inflateReset( &stream->zStream );
+
+   if (result != Z_OK)
+      err_fatal( __func__, "inflate: %s\n", stream->zStream.msg );
+   else if (stream->zStream.avail_in)
+      err_internal( __func__,
+                    "inflate did not flush (%d pending, %d avail)\n",
+                    stream->zStream.avail_in, stream->zStream.avail_out );
+
+   chunk->count = IN_BUFFER_SIZE - stream->zStream.avail_out;
+
+   if (result != Z_OK || stream->zStream.avail_in) {
+      /* The stream's state is unknown now, so don't reuse it */
+      dict_stream_free( stream );
+      xfree( chunk->inBuffer );
+      xfree( chunk );
+      return NULL;
+   }
+
+   dict_stream_release( h, stream );
+
+   return dict_cache_insert( h, chunk );
+}
+
 dictData *dict_data_open( const char *filename, int computeCRC )
 {
    dictData    *h = NULL;
-   int         j;
 
    if (!filename)
       return NULL;
@@ -464,7 +843,6 @@ dictData *dict_data_open( const char *filename, int computeCRC )
        return NULL;
 
    memset( h, 0, sizeof( struct dictData ) );
-   h->initialized = 0;
 
    if (dict_read_header( filename, h, computeCRC )) {
      return 0; /*
@@ -485,20 +863,16 @@ dictData *dict_data_open( const char *filename, int computeCRC )
 
    h->size = ftell( h->fd );
 
-   for (j = 0; j < DICT_CACHE_SIZE; j++) {
-      h->cache[j].chunk    = -1;
-      h->cache[j].stamp    = -1;
-      h->cache[j].inBuffer = NULL;
-      h->cache[j].count    = 0;
-   }
+   dict_mutex_init( &h->fileMutex );
+   dict_mutex_init( &h->streamMutex );
+
+   dict_data_set_cache_size( h, DICT_CACHE_SIZE );
    
    return h;
 }
 
 void dict_data_close( dictData *header )
 {
-   int i;
-
    if (!header)
       return;
 
@@ -508,53 +882,39 @@ void dict_data_close( dictData *header )
    if (header->chunks)       xfree( header->chunks );
    if (header->offsets)      xfree( header->offsets );
 
-   if (header->initialized) {
-      if (inflateEnd( &header->zStream ))
-	 err_internal( __func__,
-		       "Cannot shut down inflation engine: %s\n",
-		       header->zStream.msg );
-   }
+   while (header->freeStreams) {
+      dictStream *next = header->freeStreams->next;
 
-   for (i = 0; i < DICT_CACHE_SIZE; ++i){
-      if (header -> cache [i].inBuffer)
-	 xfree (header -> cache [i].inBuffer);
+      dict_stream_free( header->freeStreams );
+      header->freeStreams = next;
    }
 
+   dict_cache_free( header );
+
+   dict_mutex_destroy( &header->fileMutex );
+   dict_mutex_destroy( &header->streamMutex );
+
    memset( header, 0, sizeof( struct dictData ) );
    xfree( header );
 }
 
-char *dict_data_read_ (
+int dict_data_read_view (
    dictData *h, unsigned long start, unsigned long size,
-   const char *preFilter, const char *postFilter )
+   dictView *view )
 {
-   char          *buffer, *pt;
+   char          *pt;
    unsigned long end;
-   int           count;
-   char          *inBuffer;
-   char          outBuffer[OUT_BUFFER_SIZE];
+   dictChunk     *chunk;
    int           firstChunk, lastChunk;
    int           firstOffset, lastOffset;
-   int           i, j;
-   int           found, target, lastStamp;
-   static int    stamp = 0;
+   int           i;
 
-   UNUSED(preFilter);
-   UNUSED(postFilter);
+   memset( view, 0, sizeof( dictView ) );
 
    end  = start + size;
 
-   buffer = xmalloc( size + 1 );
-
-   if ( !size )
-   {
-     *buffer = 0;
-     return buffer;
-   }
-   
    PRINTF(DBG_UNZIP,
-	  ("dict_data_read( %p, %lu, %lu, %s, %s )\n",
-	   h, start, size, preFilter, postFilter ));
+	  ("dict_data_read_view( %p, %lu, %lu )\n", h, start, size ));
 
    assert( h != NULL);
    switch (h->type) {
@@ -563,34 +923,21 @@ char *dict_data_read_ (
 		 "Cannot seek on pure gzip format files.\n"
 		 "Use plain text (for performance)"
 		 " or dzip format (for space savings).\n" );
-      break;
+      return -1;
    case DICT_TEXT:
    {
-     if ( fseek( h->fd, start, SEEK_SET ) != 0 ||
-          fread( buffer, size, 1, h->fd ) != 1 )
+     view->buffer = xmalloc( size + 1 );
+
+     if ( !view->buffer || ( size && dict_read_at( h, view->buffer, size, start ) ) )
      {
-       xfree( buffer );
-       return 0;
+       dict_data_release_view( view );
+       return -1;
      }
 
-     buffer[size] = '\0';
+     view->buffer[size] = '\0';
    }
    break;
    case DICT_DZIP:
-      if (!h->initialized) {
-	 ++h->initialized;
-	 h->zStream.zalloc    = NULL;
-	 h->zStream.zfree     = NULL;
-	 h->zStream.opaque    = NULL;
-	 h->zStream.next_in   = 0;
-	 h->zStream.avail_in  = 0;
-	 h->zStream.next_out  = NULL;
-	 h->zStream.avail_out = 0;
-	 if (inflateInit2( &h->zStream, -15 ) != Z_OK)
-	    err_internal( __func__,
-			  "Cannot initialize inflation engine: %s\n",
-			  h->zStream.msg );
-      }
       firstChunk  = start / h->chunkLength;
       firstOffset = start - firstChunk * h->chunkLength;
       lastChunk   = end / h->chunkLength;
@@ -600,96 +947,121 @@ char *dict_data_read_ (
 	      "firstChunk = %d, firstOffset = %d,"
 	      " lastChunk = %d, lastOffset = %d\n",
 	      start, end, firstChunk, firstOffset, lastChunk, lastOffset ));
-      for (pt = buffer, i = firstChunk; i <= lastChunk; i++) {
-
-				/* Access cache */
-	 found  = 0;
-	 target = 0;
-	 lastStamp = INT_MAX;
-	 for (j = 0; j < DICT_CACHE_SIZE; j++) {
-#if USE_CACHE
-	    if (h->cache[j].chunk == i) {
-	       found  = 1;
-	       target = j;
-	       break;
-	    }
-#endif
-	    if (h->cache[j].stamp < lastStamp) {
-	       lastStamp = h->cache[j].stamp;
-	       target = j;
-	    }
-	 }
 
-	 h->cache[target].stamp = ++stamp;
-	 if (found) {
-	    count = h->cache[target].count;
-	    inBuffer = h->cache[target].inBuffer;
-	 } else {
-	    h->cache[target].chunk = i;
-	    if (!h->cache[target].inBuffer)
-	       h->cache[target].inBuffer = xmalloc( IN_BUFFER_SIZE );
-	    inBuffer = h->cache[target].inBuffer;
-
-	    if (h->chunks[i] >= OUT_BUFFER_SIZE ) {
-	       err_internal( __func__,
-			     "h->chunks[%d] = %d >= %ld (OUT_BUFFER_SIZE)\n",
-			     i, h->chunks[i], OUT_BUFFER_SIZE );
-	    }
+      if ( !size ) {
+         view->buffer = xmalloc( 1 );
+         if (!view->buffer)
+            return -1;
+         *view->buffer = 0;
+         break;
+      }
 
-      if ( fseek( h->fd, h->offsets[ i ], SEEK_SET ) != 0 ||
-           fread( outBuffer, h->chunks[ i ], 1, h->fd ) != 1 )
-      {
-        xfree( buffer );
-        return 0;
+      if ( firstChunk >= h->chunkCount ||
+           ( lastChunk >= h->chunkCount && lastOffset ) )
+         return -1;
+
+      if ( firstChunk == lastChunk || ( firstChunk + 1 == lastChunk && !lastOffset ) ) {
+         /* The block lies within a single chunk, so just point into it */
+         chunk = dict_chunk_get( h, firstChunk );
+         if (!chunk)
+            return -1;
+
+         if ( firstOffset + size > (unsigned long) chunk->count ) {
+            dict_chunk_release( chunk );
+            return -1;
+         }
+
+         view->chunk = chunk;
+         view->data  = chunk->inBuffer + firstOffset;
+         view->size  = size;
+         return 0;
       }
 
-      dict_data_filter( outBuffer, &count, OUT_BUFFER_SIZE, preFilter );
-	 
-        h->zStream.next_in   = (Bytef *)outBuffer;
-	    h->zStream.avail_in  = h->chunks[i];
-        h->zStream.next_out  = (Bytef *)inBuffer;
-	    h->zStream.avail_out = IN_BUFFER_SIZE;
-	    if (inflate( &h->zStream,  Z_PARTIAL_FLUSH ) != Z_OK)
-	       err_fatal( __func__, "inflate: %s\n", h->zStream.msg );
-	    if (h->zStream.avail_in)
-	       err_internal( __func__,
-			     "inflate did not flush (%d pending, %d avail)\n",
-			     h->zStream.avail_in, h->zStream.avail_out );
-	    
-	    count = IN_BUFFER_SIZE - h->zStream.avail_out;
-      dict_data_filter( inBuffer, &count, IN_BUFFER_SIZE, postFilter );
+      view->buffer = xmalloc( size + 1 );
+      if (!view->buffer)
+         return -1;
+
+      for (pt = view->buffer, i = firstChunk; i <= lastChunk; i++) {
+         if (i == lastChunk && !lastOffset)
+            break;
+
+         chunk = dict_chunk_get( h, i );
+         if (!chunk) {
+            dict_data_release_view( view );
+            return -1;
+         }
 
-	    h->cache[target].count = count;
-	 }
-	 
 	 if (i == firstChunk) {
-	    if (i == lastChunk) {
-	       memcpy( pt, inBuffer + firstOffset, lastOffset-firstOffset);
-	       pt += lastOffset - firstOffset;
-	    } else {
-	       if (count != h->chunkLength )
-		  err_internal( __func__,
-				"Length = %d instead of %d\n",
-				count, h->chunkLength );
-	       memcpy( pt, inBuffer + firstOffset,
-		       h->chunkLength - firstOffset );
-	       pt += h->chunkLength - firstOffset;
-	    }
+	    if (chunk->count != h->chunkLength )
+	       err_internal( __func__,
+			     "Length = %d instead of %d\n",
+			     chunk->count, h->chunkLength );
+	    memcpy( pt, chunk->inBuffer + firstOffset,
+		    h->chunkLength - firstOffset );
+	    pt += h->chunkLength - firstOffset;
 	 } else if (i == lastChunk) {
-	    memcpy( pt, inBuffer, lastOffset );
+	    memcpy( pt, chunk->inBuffer, lastOffset );
 	    pt += lastOffset;
 	 } else {
-	    assert( count == h->chunkLength );
-	    memcpy( pt, inBuffer, h->chunkLength );
+	    assert( chunk->count == h->chunkLength );
+	    memcpy( pt, chunk->inBuffer, h->chunkLength );
 	    pt += h->chunkLength;
 	 }
+
+         dict_chunk_release( chunk );
       }
       *pt = '\0';
       break;
    case DICT_UNKNOWN:
+   default:
       err_fatal( __func__, "Cannot read unknown file type\n" );
-      break;
+      return -1;
    }
-   
+
+   view->data = view->buffer;
+   view->size = size;
+
+   return 0;
+}
+
+void dict_data_release_view( dictView *view )
+{
+   if (view->chunk)
+      dict_chunk_release( view->chunk );
+
+   if (view->buffer)
+      xfree( view->buffer );
+
+   memset( view, 0, sizeof( dictView ) );
+}
+
+char *dict_data_read_ (
+   dictData *h, unsigned long start, unsigned long size,
+   const char *preFilter, const char *postFilter )
+{
+   dictView view;
+   char     *buffer;
+
+   UNUSED(preFilter);
+   UNUSED(postFilter);
+
+   if (dict_data_read_view( h, start, size, &view ))
+      return NULL;
+
+   if (view.buffer) {
+      /* Already a zero-terminated copy, so just take it over */
+      buffer = view.buffer;
+      view.buffer = NULL;
+   }
+   else {
+      buffer = xmalloc( size + 1 );
+      if (buffer) {
+         memcpy( buffer, view.data, size );
+         buffer[size] = '\0';
+      }
+   }
+
+   dict_data_release_view( &view );
+
    return buffer;
 }
@@ -39,14 +39,48 @@ extern "C"
 
 /* Excerpts from defs.h */
 
-#define DICT_CACHE_SIZE 5
+/* The default number of decompressed chunks to be cached per file, and the
+   number of independently locked shards the cache is split into. */
+#define DICT_CACHE_SIZE   32
+#define DICT_CACHE_SHARDS 4
 
-typedef struct dictCache {
+#ifdef __WIN32
+typedef CRITICAL_SECTION dictMutex;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t dictMutex;
+#endif
+
+struct dictCacheShard;
+
+/* A decompressed chunk. It is reference-counted, so that it could be handed
+   out to the readers and outlive its eviction from the cache. */
+typedef struct dictChunk {
    int           chunk;
    char          *inBuffer;
-   int           stamp;
    int           count;
-} dictCache;
+   int           refs;          /* Guarded by the shard's mutex */
+   struct dictCacheShard *shard;
+} dictChunk;
+
+typedef struct dictCacheEntry {
+   dictChunk     *chunk;
+   int           stamp;
+} dictCacheEntry;
+
+/* Chunk number i is cached in shard i % shardCount. */
+typedef struct dictCacheShard {
+   dictMutex      mutex;
+   dictCacheEntry *entries;
+   int            entryCount;
+   int            stamp;
+} dictCacheShard;
+
+/* An inflate stream. Each reading thread takes its own one from the pool. */
+typedef struct dictStream {
+   z_stream          zStream;
+   struct dictStream *next;
+} dictStream;
 
 typedef struct dictData {
 
@@ -56,8 +90,6 @@ typedef struct dictData {
    
    int           type;
    const char    *filename;
-   z_stream      zStream;
-   int           initialized;
 
    int           headerLength;
    int           method;
@@ -75,9 +107,24 @@ typedef struct dictData {
    unsigned long crc;
    unsigned long length;
    unsigned long compressedLength;
-   dictCache     cache[DICT_CACHE_SIZE];
+
+   dictMutex      fileMutex;    /* Guards fd where positional reads are absent */
+   dictMutex      streamMutex;  /* Guards freeStreams */
+   dictStream     *freeStreams;
+   dictCacheShard *shards;
+   int            shardCount;
 } dictData;
 
+/* A block of the uncompressed data. It either points right into a cached
+   chunk, which is kept alive until the view is released, or into a buffer of
+   its own, which is zero-terminated then. */
+typedef struct dictView {
+   const char    *data;
+   unsigned long size;
+   dictChunk     *chunk;
+   char          *buffer;
+} dictView;
+
 
 /* initialize .data file */
 extern dictData *dict_data_open (
@@ -86,12 +133,30 @@ extern dictData *dict_data_open (
 extern void dict_data_close (
    dictData *data);
 
+/* Changes the number of chunks cached, DICT_CACHE_SIZE by default. Zero
+   disables the caching. Must not be called while any reads are running. */
+extern void dict_data_set_cache_size (
+   dictData *data, int chunks );
+
+/* Reads the given block. The result is malloc()ed and zero-terminated, and
+   is to be free()d by the caller. Thread-safe. */
 extern char *dict_data_read_ (
    dictData *data,
    unsigned long start, unsigned long end,
    const char *preFilter,
    const char *postFilter );
 
+/* Reads the given block into the view, avoiding the copying when the block
+   lies within a single chunk. Returns 0 on success, or -1 on failure. The
+   view must be released with dict_data_release_view(). Thread-safe. */
+extern int dict_data_read_view (
+   dictData *data,
+   unsigned long start, unsigned long size,
+   dictView *view );
+
+extern void dict_data_release_view (
+   dictView *view );
+
 extern int        mmap_mode;
 
 #ifdef __cplusplus
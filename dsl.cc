@@ -26,7 +26,10 @@ extern "C" {
 #include <string>
 #include <vector>
 #include <list>
+#include <algorithm>
 #include <cwctype>
+#include <cstring>
+#include <exception>
 
 #include <QSemaphore>
 #include <QThreadPool>
@@ -60,7 +63,7 @@ DEF_EX_STR( exCantReadFile, "Can't read file", Dictionary::Ex )
 enum
 {
     Signature = 0x584c5344, // DSLX on little-endian, XLSD on big-endian
-            CurrentFormatVersion = 14 + BtreeIndexing::FormatVersion + Folding::Version,
+            CurrentFormatVersion = 15 + BtreeIndexing::FormatVersion + Folding::Version,
             CurrentZipSupportVersion = 1
 };
 
@@ -86,6 +89,7 @@ struct IdxHeader
     uint32_t zipIndexBtreeMaxElements; // Two fields from IndexInfo of the zip
     // resource index.
     uint32_t zipIndexRootOffset;
+    uint32_t codec; // Codec::Type of the btrees and the chunks
 }
 __attribute__((packed))
 ;
@@ -100,7 +104,8 @@ bool indexIsOldOrBad( string const & indexFile, bool hasZipFile )
             (header.signature != Signature) ||
             (header.formatVersion != CurrentFormatVersion) ||
             (static_cast<bool>(header.hasZipFile) != hasZipFile) ||
-            ( hasZipFile && header.zipSupportVersion != CurrentZipSupportVersion );
+            ( hasZipFile && header.zipSupportVersion != CurrentZipSupportVersion ) ||
+            !Codec::isSupported( header.codec );
 }
 
 class DslDictionary: public BtreeIndexing::BtreeDictionary
@@ -111,8 +116,7 @@ class DslDictionary: public BtreeIndexing::BtreeDictionary
     sptr< ChunkedStorage::Reader > chunks;
     string dictionaryName;
     map< string, string > abrv;
-    Mutex dzMutex;
-    dictData * dz;
+    dictData * dz; // Thread-safe, needs no locking
     Mutex resourceZipMutex;
     IndexedZip resourceZip;
     BtreeIndex resourceZipIndex;
@@ -152,6 +156,10 @@ public:
     inline quint32 getLangTo() const override
     { return idxHeader.langTo; }
 
+    sptr< Dictionary::DataRequest > getArticleNow( wstring const &,
+                                                   vector< wstring > const & alts,
+                                                   wstring const & ) override;
+
     sptr< Dictionary::DataRequest > getArticle( wstring const &,
                                                 vector< wstring > const & alts,
                                                 wstring const & ) override;
@@ -176,12 +184,23 @@ private:
                       unsigned & headwordIndex,
                       wstring & articleText );
 
-    /// Converts DSL language to an Html.
-    string dslToHtml( wstring const & );
+    /// Converts DSL language to an Html, appending it to the given string.
+    void dslToHtml( wstring const &, string & html );
 
     // Parts of dslToHtml()
-    string nodeToHtml( ArticleDom::Node const & );
-    string processNodeChildren( ArticleDom::Node const & node );
+    void nodeToHtml( ArticleDom::Node const &, string & html );
+    void processNodeChildren( ArticleDom::Node const & node, string & html );
+
+    /// The former dslToHtml(), which built a string per node and inserted
+    /// the paragraphs one by one. Used instead of dslToHtml() when set with
+    /// useReferenceRenderer(), to check the two against each other.
+    string referenceDslToHtml( wstring const & );
+    string referenceNodeToHtml( ArticleDom::Node const & );
+    string referenceProcessNodeChildren( ArticleDom::Node const & node );
+
+    QAtomicInt useReferenceRenderer; // See Dsl::useReferenceRenderer()
+
+    friend bool Dsl::useReferenceRenderer( Dictionary::Class &, bool );
 
     friend class DslArticleRequest;
     friend class DslResourceRequest;
@@ -297,7 +316,10 @@ void DslDictionary::doDeferredInit()
             // the init is complete.
             //Mutex::Lock _( idxMutex );
 
-            chunks = new ChunkedStorage::Reader( idx, idxHeader.chunksOffset );
+            chunks = new ChunkedStorage::Reader( idx, idxHeader.chunksOffset,
+                                                 static_cast< Codec::Type >( idxHeader.codec ) );
+
+            chunks->setMetrics( metrics );
 
             // Open the .dict file
 
@@ -310,9 +332,9 @@ void DslDictionary::doDeferredInit()
 
             if ( idxHeader.hasAbrv )
             {
-                vector< char > chunk;
+                ChunkedStorage::ChunkPtr chunk;
 
-                char * abrvBlock = chunks->getBlock( idxHeader.abrvAddress, chunk );
+                char const * abrvBlock = chunks->getBlock( idxHeader.abrvAddress, chunk );
 
                 uint32_t total;
                 memcpy( &total, abrvBlock, sizeof( uint32_t ) );
@@ -326,7 +348,7 @@ void DslDictionary::doDeferredInit()
                     memcpy( &keySz, abrvBlock, sizeof( uint32_t ) );
                     abrvBlock += sizeof( uint32_t );
 
-                    char * key = abrvBlock;
+                    char const * key = abrvBlock;
 
                     abrvBlock += keySz;
 
@@ -343,7 +365,8 @@ void DslDictionary::doDeferredInit()
             // Initialize the index
 
             openIndex( IndexInfo( idxHeader.indexBtreeMaxElements,
-                                  idxHeader.indexRootOffset ),
+                                  idxHeader.indexRootOffset,
+                                  static_cast< Codec::Type >( idxHeader.codec ) ),
                        idx, idxMutex );
 
             // Open a resource zip file, if there's one
@@ -353,7 +376,8 @@ void DslDictionary::doDeferredInit()
                    idxHeader.zipIndexRootOffset ) )
             {
                 resourceZip.openIndex( IndexInfo( idxHeader.zipIndexBtreeMaxElements,
-                                                  idxHeader.zipIndexRootOffset ),
+                                                  idxHeader.zipIndexRootOffset,
+                                                  static_cast< Codec::Type >( idxHeader.codec ) ),
                                        idx, idxMutex );
 
                 QString zipName = QDir::fromNativeSeparators(
@@ -406,15 +430,9 @@ void DslDictionary::loadArticle( uint32_t address,
     wstring articleData;
 
     {
-        vector< char > chunk;
-
-        char * articleProps;
+        ChunkedStorage::ChunkPtr chunk;
 
-        {
-            Mutex::Lock _( idxMutex );
-
-            articleProps = chunks->getBlock( address, chunk );
-        }
+        char const * articleProps = chunks->getBlock( address, chunk );
 
         uint32_t articleOffset, articleSize;
 
@@ -425,28 +443,24 @@ void DslDictionary::loadArticle( uint32_t address,
         //printf( "offset = %x\n", articleOffset );
 
 
-        char * articleBody;
+        dictView articleBody;
 
         {
-            Mutex::Lock _( dzMutex );
+            GD_METRICS_TIME( metrics, ArticleRead );
 
-            articleBody = dict_data_read_( dz, articleOffset, articleSize, nullptr, nullptr );
+            if ( dict_data_read_view( dz, articleOffset, articleSize, &articleBody ) != 0 )
+                throw exCantReadFile( getDictionaryFilenames()[ 0 ] );
         }
 
-        if ( !articleBody )
-            throw exCantReadFile( getDictionaryFilenames()[ 0 ] );
-
         try
         {
-            articleData =
-                    DslIconv::toWstring(
-                        DslIconv::getEncodingNameFor( DslEncoding( idxHeader.dslEncoding ) ),
-                        articleBody, articleSize );
-            free( articleBody );
+            DslScanner::decode( DslEncoding( idxHeader.dslEncoding ),
+                                articleBody.data, articleSize, articleData );
+            dict_data_release_view( &articleBody );
         }
         catch( ... )
         {
-            free( articleBody );
+            dict_data_release_view( &articleBody );
             throw;
         }
     }
@@ -564,14 +578,330 @@ void DslDictionary::loadArticle( uint32_t address,
         articleText.clear();
 }
 
-string DslDictionary::dslToHtml( wstring const & str )
+/// Appends the text, Utf8-encoded and html-escaped, to the given string. The
+/// result is the same as of Html::escape( Utf8::encode( text ) ), but without
+/// the intermediate strings.
+void appendEscaped( string & html, wstring const & text )
+{
+    for( wchar ch : text )
+        switch( ch )
+        {
+            case '&':
+                html += "&amp;";
+                break;
+
+            case '<':
+                html += "&lt;";
+                break;
+
+            case '>':
+                html += "&gt;";
+                break;
+
+            case '"':
+                html += "&quot;";
+                break;
+
+            default:
+                if ( ch < 0x80 )
+                    html.push_back( ch );
+                else
+                {
+                    char buf[ 4 ];
+
+                    html.append( buf, Utf8::encode( &ch, 1, buf ) );
+                }
+        }
+}
+
+void DslDictionary::dslToHtml( wstring const & str, string & html )
+{
+    GD_METRICS_TIME( metrics, ArticleRender );
+
+    if ( useReferenceRenderer.load() != 0 )
+    {
+        html += referenceDslToHtml( str );
+        return;
+    }
+
+    // Normalize the string. Everything below U+0300, where the combining
+    // characters start, is in the NFC already, which spares most articles
+    // the round trip through QString.
+    bool isNormalized = true;
+
+    for( wchar ch : str )
+        if ( ch >= 0x300 )
+        {
+            isNormalized = false;
+            break;
+        }
+
+    ArticleDom dom( isNormalized ? str :
+                                   gd::toWString( gd::toQString( str ).normalized( QString::NormalizationForm_C ) ) );
+
+    #if 0 // Enable this to enable dsl source in html as a comment
+    html += "<!-- DSL Source:\n" + Utf8::encode( str ) + "\n-->";
+    #endif
+
+    html += "<p>";
+
+    size_t start = html.size();
+
+    processNodeChildren( dom.root, html );
+
+    // Lines seem to indicate paragraphs in Dsls, so we enclose each line within
+    // a <p></p>. The html is spread out from its end in a single pass, moving
+    // each byte just once.
+
+    size_t newLines = std::count( html.begin() + start, html.end(), '\n' );
+
+    if ( newLines )
+    {
+        char const paragraphBreak[] = "</p><p>";
+        size_t const breakSize = sizeof( paragraphBreak ) - 1;
+
+        size_t from = html.size();
+
+        html.resize( html.size() + newLines * breakSize );
+
+        for( size_t to = html.size(); to != from; )
+        {
+            char c = html[ --from ];
+
+            if ( c == '\n' )
+            {
+                to -= breakSize;
+                memcpy( &html[ to ], paragraphBreak, breakSize );
+            }
+
+            html[ --to ] = c;
+        }
+    }
+
+    html += "</p>";
+}
+
+void DslDictionary::processNodeChildren( ArticleDom::Node const & node, string & html )
+{
+    for( const auto & i : node )
+        nodeToHtml( i, html );
+}
+
+void DslDictionary::nodeToHtml( ArticleDom::Node const & node, string & html )
+{
+    if ( !node.isTag )
+    {
+        appendEscaped( html, node.text );
+        return;
+    }
+
+    if ( node.tagName == GD_NATIVE_TO_WS( L"b" ) ) {
+        html += R"(<b class="dsl_b">)";
+        processNodeChildren( node, html );
+        html += "</b>";
+    } else if ( node.tagName == GD_NATIVE_TO_WS( L"i" ) ) {
+        html += R"(<i class="dsl_i">)";
+        processNodeChildren( node, html );
+        html += "</i>";
+    } else if ( node.tagName == GD_NATIVE_TO_WS( L"u" ) )
+    {
+        size_t start = html.size();
+
+        html += R"(<span class="dsl_u">)";
+
+        size_t textStart = html.size();
+
+        processNodeChildren( node, html );
+
+        if ( html.size() > textStart && isDslWs( html[ textStart ] ) )
+            html.insert( start, 1, ' ' ); // Fix a common problem where in "foo[i] bar[/i]"
+        // the space before "bar" gets underlined.
+
+        html += "</span>";
+    }
+    else if ( node.tagName == GD_NATIVE_TO_WS( L"c" ) )
+    {
+        html += R"(<font color=")";
+        if( !node.tagAttrs.empty() )
+            html += Html::escape( Utf8::encode( node.tagAttrs ) );
+        else
+            html += "c_default_color";
+        html += R"(">)";
+        processNodeChildren( node, html );
+        html += "</font>";
+    }
+    else if ( node.tagName == GD_NATIVE_TO_WS( L"*" ) ) {
+        html += R"(<span class="dsl_opt">)";
+        processNodeChildren( node, html );
+        html += "</span>";
+    } else if ( node.tagName.size() == 2 && node.tagName[ 0 ] == L'm' &&
+                iswdigit( node.tagName[ 1 ] ) ) {
+        html += R"(<div class="dsl_)";
+        html += Utf8::encode( node.tagName );
+        html += R"(">)";
+        processNodeChildren( node, html );
+        html += "</div>";
+    } else if ( node.tagName == GD_NATIVE_TO_WS( L"trn" ) ) {
+        html += R"(<span class="dsl_trn">)";
+        processNodeChildren( node, html );
+        html += "</span>";
+    } else if ( node.tagName == GD_NATIVE_TO_WS( L"ex" ) ) {
+        html += R"(<span class="dsl_ex">)";
+        processNodeChildren( node, html );
+        html += "</span>";
+    } else if ( node.tagName == GD_NATIVE_TO_WS( L"com" ) ) {
+        html += R"(<span class="dsl_com">)";
+        processNodeChildren( node, html );
+        html += "</span>";
+    } else if ( node.tagName == GD_NATIVE_TO_WS( L"s" ) ) {
+        string filename = Utf8::encode( node.renderAsText() );
+
+        if ( Filetype::isNameOfPicture( filename ) )
+        {
+            QUrl url;
+            url.setScheme( "bres" );
+            url.setHost( QString::fromUtf8( getId().c_str() ) );
+            url.setPath( QString::fromUtf8( filename.c_str() ) );
+
+            html += R"(<img src=")";
+            html += url.toEncoded().constData();
+            html += R"(" alt=")";
+            html += Html::escape( filename );
+            html += R"("/>)";
+        }
+        else
+        {
+            // Unknown file type, downgrade to a hyperlink
+
+            QUrl url;
+            url.setScheme( "bres" );
+            url.setHost( QString::fromUtf8( getId().c_str() ) );
+            url.setPath( QString::fromUtf8( filename.c_str() ) );
+
+            html += R"(<a class="dsl_s" href=")";
+            html += url.toEncoded().constData();
+            html += R"(">)";
+            processNodeChildren( node, html );
+            html += "</a>";
+        }
+    }
+    else
+        if ( node.tagName == GD_NATIVE_TO_WS( L"url" ) ) {
+            html += R"(<a class="dsl_url" href=")";
+            html += Html::escape( Utf8::encode( node.renderAsText() ) );
+            html += R"(">)";
+            processNodeChildren( node, html );
+            html += "</a>";
+        } else if ( node.tagName == GD_NATIVE_TO_WS( L"!trs" ) ) {
+            html += R"(<span class="dsl_trs">)";
+            processNodeChildren( node, html );
+            html += "</span>";
+        } else if ( node.tagName == GD_NATIVE_TO_WS( L"p") )
+        {
+            html += R"(<span class="dsl_p")";
+
+            string val = Utf8::encode( node.renderAsText() );
+
+            // If we have such a key, display a title
+
+            map< string, string >::const_iterator i = abrv.find( val );
+
+            if ( i != abrv.end() )
+            {
+                string title;
+
+                if ( Utf8::decode( i->second ).size() < 70 )
+                {
+                    // Replace all spaces with non-breakable ones, since that's how
+                    // Lingvo shows tooltips
+                    title.reserve( i->second.size() );
+
+                    for( char const * c = i->second.c_str(); *c; ++c )
+                        if ( *c == ' ' || *c == '\t' )
+                        {
+                            // u00A0 in utf8
+                            title.push_back( 0xC2 );
+                            title.push_back( 0xA0 );
+                        }
+                        else
+                            title.push_back( *c );
+                }
+                else
+                    title = i->second;
+
+                html += R"( title=")";
+                html += Html::escape( title );
+                html += R"(")";
+            }
+
+            html += ">";
+            processNodeChildren( node, html );
+            html += "</span>";
+        }
+        else if ( node.tagName == GD_NATIVE_TO_WS( L"'" ) )
+        {
+            html += R"(<span class="dsl_stress">)";
+            processNodeChildren( node, html );
+            html += Utf8::encode( wstring( 1, 0x301 ) );
+            html += "</span>";
+        }
+        else if ( node.tagName == GD_NATIVE_TO_WS( L"lang" ) )
+        {
+            html += R"(<span class="dsl_lang">)";
+            processNodeChildren( node, html );
+            html += "</span>";
+        }
+        else if ( node.tagName == GD_NATIVE_TO_WS( L"ref" ) )
+        {
+            QUrl url;
+
+            url.setScheme( "gdlookup" );
+            url.setHost( "localhost" );
+            QUrlQuery urlq;
+            urlq.addQueryItem("word", gd::toQString( node.renderAsText() ));
+            url.setQuery(urlq);
+
+            html += R"(<a class="dsl_ref" href=")";
+            html += url.toEncoded().constData();
+            html += R"(")";
+            processNodeChildren( node, html );
+            html += "</a>";
+        }
+        else if ( node.tagName == GD_NATIVE_TO_WS( L"sub" ) )
+        {
+            html += "<sub>";
+            processNodeChildren( node, html );
+            html += "</sub>";
+        }
+        else if ( node.tagName == GD_NATIVE_TO_WS( L"sup" ) )
+        {
+            html += "<sup>";
+            processNodeChildren( node, html );
+            html += "</sup>";
+        }
+        else if ( node.tagName == GD_NATIVE_TO_WS( L"t" ) )
+        {
+            html += R"(<span class="dsl_t">)";
+            processNodeChildren( node, html );
+            html += "</span>";
+        }
+        else {
+            html += R"(<span class="dsl_unknown">)";
+            processNodeChildren( node, html );
+            html += "</span>";
+        }
+}
+
+// The former renderer, kept as it was, see useReferenceRenderer()
+
+string DslDictionary::referenceDslToHtml( wstring const & str )
 {
     // Normalize the string
     wstring normalizedStr = gd::toWString( gd::toQString( str ).normalized( QString::NormalizationForm_C ) );
 
     ArticleDom dom( normalizedStr );
 
-    string html = processNodeChildren( dom.root );
+    string html = referenceProcessNodeChildren( dom.root );
 
     // Lines seem to indicate paragraphs in Dsls, so we enclose each line within
     // a <p></p>.
@@ -587,17 +917,17 @@ string DslDictionary::dslToHtml( wstring const & str )
                                                          "<p>" + html + "</p>";
 }
 
-string DslDictionary::processNodeChildren( ArticleDom::Node const & node )
+string DslDictionary::referenceProcessNodeChildren( ArticleDom::Node const & node )
 {
     string result;
 
     for( const auto & i : node )
-        result += nodeToHtml( i );
+        result += referenceNodeToHtml( i );
 
     return result;
 }
 
-string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
+string DslDictionary::referenceNodeToHtml( ArticleDom::Node const & node )
 {
     if ( !node.isTag )
         return Html::escape( Utf8::encode( node.text ) );
@@ -606,15 +936,15 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
 
     if ( node.tagName == GD_NATIVE_TO_WS( L"b" ) ) {
         result += R"(<b class="dsl_b">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</b>";
     } else if ( node.tagName == GD_NATIVE_TO_WS( L"i" ) ) {
         result += R"(<i class="dsl_i">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</i>";
     } else if ( node.tagName == GD_NATIVE_TO_WS( L"u" ) )
     {
-        string nodeText = processNodeChildren( node );
+        string nodeText = referenceProcessNodeChildren( node );
 
         if ( !nodeText.empty() && isDslWs( nodeText[ 0 ] ) )
             result.push_back( ' ' ); // Fix a common problem where in "foo[i] bar[/i]"
@@ -632,31 +962,31 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
         else
             result += "c_default_color";
         result += R"(">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</font>";
     }
     else if ( node.tagName == GD_NATIVE_TO_WS( L"*" ) ) {
         result += R"(<span class="dsl_opt">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</span>";
     } else if ( node.tagName.size() == 2 && node.tagName[ 0 ] == L'm' &&
                 iswdigit( node.tagName[ 1 ] ) ) {
         result += R"(<div class="dsl_)";
         result += Utf8::encode( node.tagName );
         result += R"(">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</div>";
     } else if ( node.tagName == GD_NATIVE_TO_WS( L"trn" ) ) {
         result += R"(<span class="dsl_trn">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</span>";
     } else if ( node.tagName == GD_NATIVE_TO_WS( L"ex" ) ) {
         result += R"(<span class="dsl_ex">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</span>";
     } else if ( node.tagName == GD_NATIVE_TO_WS( L"com" ) ) {
         result += R"(<span class="dsl_com">)";
-        result += processNodeChildren( node );
+        result += referenceProcessNodeChildren( node );
         result += "</span>";
     } else if ( node.tagName == GD_NATIVE_TO_WS( L"s" ) ) {
         string filename = Utf8::encode( node.renderAsText() );
@@ -686,7 +1016,7 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
             result += R"(<a class="dsl_s" href=")";
             result += url.toEncoded().constData();
             result += R"(">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</a>";
         }
     }
@@ -695,11 +1025,11 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
             result += R"(<a class="dsl_url" href=")";
             result += Html::escape( Utf8::encode( node.renderAsText() ) );
             result += R"(">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</a>";
         } else if ( node.tagName == GD_NATIVE_TO_WS( L"!trs" ) ) {
             result += R"(<span class="dsl_trs">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</span>";
         } else if ( node.tagName == GD_NATIVE_TO_WS( L"p") )
         {
@@ -739,19 +1069,19 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
                 result += R"(")";
             }
 
-            result += ">" + processNodeChildren( node ) + "</span>";
+            result += ">" + referenceProcessNodeChildren( node ) + "</span>";
         }
         else if ( node.tagName == GD_NATIVE_TO_WS( L"'" ) )
         {
             result += R"(<span class="dsl_stress">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += Utf8::encode( wstring( 1, 0x301 ) );
             result += "</span>";
         }
         else if ( node.tagName == GD_NATIVE_TO_WS( L"lang" ) )
         {
             result += R"(<span class="dsl_lang">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</span>";
         }
         else if ( node.tagName == GD_NATIVE_TO_WS( L"ref" ) )
@@ -767,30 +1097,30 @@ string DslDictionary::nodeToHtml( ArticleDom::Node const & node )
             result += R"(<a class="dsl_ref" href=")";
             result += url.toEncoded().constData();
             result += R"(")";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</a>";
         }
         else if ( node.tagName == GD_NATIVE_TO_WS( L"sub" ) )
         {
             result += "<sub>";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</sub>";
         }
         else if ( node.tagName == GD_NATIVE_TO_WS( L"sup" ) )
         {
             result += "<sup>";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</sup>";
         }
         else if ( node.tagName == GD_NATIVE_TO_WS( L"t" ) )
         {
             result += R"(<span class="dsl_t">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</span>";
         }
         else {
             result += R"(<span class="dsl_unknown">)";
-            result += processNodeChildren( node );
+            result += referenceProcessNodeChildren( node );
             result += "</span>";
         }
 
@@ -840,13 +1170,20 @@ class DslArticleRequest: public Dictionary::DataRequest
 
 public:
 
+    /// With runNow, the lookup is done right away, in the calling thread.
     DslArticleRequest( wstring const & word_,
                        vector< wstring > const & alts_,
-                       DslDictionary & dict_ ):
+                       DslDictionary & dict_, bool runNow = false ):
         word( word_ ), alts( alts_ ), dict( dict_ )
     {
-        QThreadPool::globalInstance()->start(
-                    new DslArticleRequestRunnable( *this, hasExited ) );
+        if ( runNow )
+        {
+            run();
+            hasExited.release();
+        }
+        else
+            QThreadPool::globalInstance()->start(
+                        new DslArticleRequestRunnable( *this, hasExited ) );
     }
 
     void run(); // Run from another thread by DslArticleRequestRunnable
@@ -936,14 +1273,14 @@ void DslArticleRequest::run()
         articleText += R"(<span class="dsl_article">)";
         articleText += R"(<div class="dsl_headwords">)";
 
-        articleText += dict.dslToHtml( displayedHeadword );
+        dict.dslToHtml( displayedHeadword, articleText );
 
         articleText += "</div>";
 
         expandTildes( articleBody, tildeValue );
 
         articleText += R"(<div class="dsl_definition">)";
-        articleText += dict.dslToHtml( articleBody );
+        dict.dslToHtml( articleBody, articleText );
         articleText += "</div>";
         articleText += "</span>";
 
@@ -967,6 +1304,13 @@ sptr< Dictionary::DataRequest > DslDictionary::getArticle( wstring const & word,
     return new DslArticleRequest( word, alts, *this );
 }
 
+sptr< Dictionary::DataRequest > DslDictionary::getArticleNow( wstring const & word,
+                                                              vector< wstring > const & alts,
+                                                              wstring const & )
+{
+    return new DslArticleRequest( word, alts, *this, true );
+}
+
 void loadFromFile( string const & n, vector< char > & data )
 {
     File::Class f( n, "rb" );
@@ -1139,6 +1483,368 @@ sptr< Dictionary::DataRequest > DslDictionary::getResource( string const & name
     return new DslResourceRequest( *this, name );
 }
 
+/// Indexing
+
+/// An article as found by the scanner: its headword lines as they are, and
+/// its location in the file.
+struct ScannedArticle
+{
+    vector< wstring > headwords;
+    uint32_t offset, size;
+};
+
+/// An article with its headwords parsed, expanded and made into the index
+/// entries.
+struct ParsedArticle
+{
+    vector< IndexedWords::Entry > entries;
+    uint32_t wordCount; // The number of headwords, after the expansion
+    uint32_t offset, size;
+};
+
+/// A run of consecutive articles, which is parsed as a whole by one thread.
+struct IndexingBatch
+{
+    vector< ScannedArticle > scanned;
+    vector< ParsedArticle > parsed;
+    bool last; // No batches follow this one
+    std::exception_ptr error; // Rethrown when this batch is reached
+    QSemaphore isParsed;
+
+    IndexingBatch(): last( false )
+    {}
+};
+
+/// Scans the .dsl file and adds all the articles found to the index. The
+/// work is split into stages, each running on its own thread: the scanner
+/// decodes the file and splits it into articles, the batches of articles are
+/// then parsed in parallel, and the results are inserted into the index in
+/// the order of the articles, on the calling thread. The file itself can
+/// only be read sequentially, so it is split into batches at the article
+/// boundaries as it's being read. The result is exactly the same as if all
+/// the articles were processed one by one.
+class DslIndexer
+{
+public:
+
+    enum
+    {
+        ArticlesPerBatch = 512
+    };
+
+    /// The threads include the scanning one, and are at least two.
+    DslIndexer( DslScanner & scanner, string const & fileName, int threads );
+
+    /// Waits for all the threads to finish, cancelling them if needed.
+    ~DslIndexer();
+
+    /// Runs the whole process. Rethrows any exception the scanner throws.
+    void run( ChunkedStorage::Writer & chunks, IndexedWords & indexedWords,
+              uint32_t & articleCount, uint32_t & wordCount );
+
+    /// Run from the pool
+    void scan();
+    void parse( IndexingBatch & );
+
+private:
+
+    DslScanner & scanner;
+    string fileName;
+    QThreadPool pool;
+    QAtomicInt isCancelled;
+    QSemaphore freeSlots; // Bounds the number of batches in flight
+    QSemaphore hasBatches;
+    Mutex batchesMutex;
+    std::list< sptr< IndexingBatch > > batches;
+
+    void queueBatch( sptr< IndexingBatch > const & );
+};
+
+class DslScanRunnable: public QRunnable
+{
+    DslIndexer & indexer;
+
+public:
+
+    DslScanRunnable( DslIndexer & indexer_ ): indexer( indexer_ )
+    {}
+
+    void run() override
+    { indexer.scan(); }
+};
+
+class DslParseRunnable: public QRunnable
+{
+    DslIndexer & indexer;
+    sptr< IndexingBatch > batch;
+
+public:
+
+    DslParseRunnable( DslIndexer & indexer_, sptr< IndexingBatch > const & batch_ ):
+        indexer( indexer_ ), batch( batch_ )
+    {}
+
+    void run() override
+    { indexer.parse( *batch ); }
+};
+
+DslIndexer::DslIndexer( DslScanner & scanner_, string const & fileName_, int threads ):
+    scanner( scanner_ ), fileName( fileName_ )
+{
+    // One thread scans, and the rest parse. Make sure the parsing can always
+    // proceed while the scanner waits for free slots.
+    if ( threads < 2 )
+        threads = 2;
+
+    pool.setMaxThreadCount( threads );
+    freeSlots.release( threads * 2 );
+}
+
+DslIndexer::~DslIndexer()
+{
+    // If we're leaving early, make the scanner stop, and wake it up if it
+    // waits for a free slot
+    isCancelled.ref();
+    freeSlots.release( 1 );
+
+    pool.waitForDone();
+}
+
+void DslIndexer::queueBatch( sptr< IndexingBatch > const & batch )
+{
+    {
+        Mutex::Lock _( batchesMutex );
+
+        batches.push_back( batch );
+    }
+
+    hasBatches.release();
+
+    if ( batch->scanned.empty() )
+        batch->isParsed.release();
+    else
+        pool.start( new DslParseRunnable( *this, batch ) );
+}
+
+void DslIndexer::scan()
+{
+    sptr< IndexingBatch > batch;
+
+    try
+    {
+        bool hasString = false;
+        wstring curString;
+        size_t curOffset = 0;
+
+        for( ; ; )
+        {
+            if ( !batch )
+            {
+                freeSlots.acquire();
+
+                if ( isCancelled.load() != 0 )
+                    return;
+
+                batch = new IndexingBatch;
+
+                batch->scanned.reserve( ArticlesPerBatch );
+            }
+
+            // Find the main headword
+
+            if ( !hasString && !scanner.readNextLine( curString, curOffset ) )
+                break; // Clean end of file
+
+            hasString = false;
+
+            // The line read should either consist of pure whitespace, or be a
+            // headword
+
+            if ( curString.empty() )
+                continue;
+
+            if ( isDslWs( curString[ 0 ] ) )
+            {
+                // The first character is blank. Let's make sure that all other
+                // characters are blank, too.
+                for( size_t x = 1; x < curString.size(); ++x )
+                {
+                    if ( !isDslWs( curString[ x ] ) )
+                    {
+                        qWarning() << "Garbage string in " << fileName.c_str()
+                                   << " at offset " << QString::number(curOffset,16);
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            // Ok, got the headword
+
+            ScannedArticle article;
+
+            article.headwords.push_back( curString );
+            article.offset = curOffset;
+
+            // More headwords may follow
+
+            for( ; ; )
+            {
+                if ( ! ( hasString = scanner.readNextLine( curString, curOffset ) ) )
+                {
+                    qWarning() << "Premature end of file " << fileName.c_str();
+                    break;
+                }
+
+                if ( curString.empty() || isDslWs( curString[ 0 ] ) )
+                    break; // No more headwords
+
+                article.headwords.push_back( curString );
+            }
+
+            if ( !hasString )
+                break;
+
+            // Skip the article's body
+            for( ; ; )
+            {
+                if ( ! ( hasString = scanner.readNextLine( curString, curOffset ) ) )
+                    break;
+
+                if ( !curString.empty() && !isDslWs( curString[ 0 ] ) )
+                    break;
+            }
+
+            // Now that we're having read the first string after the article
+            // itself, we can use its offset to calculate the article's size.
+            // An end of file works here, too.
+
+            article.size = curOffset - article.offset;
+
+            batch->scanned.push_back( std::move( article ) );
+
+            if ( !hasString )
+                break;
+
+            if ( batch->scanned.size() >= ArticlesPerBatch )
+            {
+                queueBatch( batch );
+                batch.reset();
+            }
+        }
+    }
+    catch( ... )
+    {
+        if ( !batch )
+            batch = new IndexingBatch;
+
+        batch->error = std::current_exception();
+    }
+
+    batch->last = true;
+
+    queueBatch( batch );
+}
+
+void DslIndexer::parse( IndexingBatch & batch )
+{
+    try
+    {
+        batch.parsed.resize( batch.scanned.size() );
+
+        for( size_t x = 0; x < batch.scanned.size(); ++x )
+        {
+            if ( isCancelled.load() != 0 )
+                break;
+
+            ScannedArticle & scanned = batch.scanned[ x ];
+            ParsedArticle & parsed = batch.parsed[ x ];
+
+            list< wstring > allEntryWords;
+
+            processUnsortedParts( scanned.headwords[ 0 ], true );
+            expandOptionalParts( scanned.headwords[ 0 ], allEntryWords );
+
+            for( size_t y = 1; y < scanned.headwords.size(); ++y )
+            {
+                processUnsortedParts( scanned.headwords[ y ], true );
+                expandTildes( scanned.headwords[ y ], allEntryWords.front() );
+                expandOptionalParts( scanned.headwords[ y ], allEntryWords );
+            }
+
+            for( auto & word : allEntryWords )
+            {
+                unescapeDsl( word );
+                normalizeHeadword( word );
+
+                IndexedWords::makeEntries( word, parsed.entries );
+            }
+
+            parsed.wordCount = allEntryWords.size();
+
+            parsed.offset = scanned.offset;
+            parsed.size = scanned.size;
+
+            // Release memory early
+            vector< wstring >().swap( scanned.headwords );
+        }
+    }
+    catch( ... )
+    {
+        if ( !batch.error )
+            batch.error = std::current_exception();
+    }
+
+    batch.isParsed.release();
+}
+
+void DslIndexer::run( ChunkedStorage::Writer & chunks, IndexedWords & indexedWords,
+                      uint32_t & articleCount, uint32_t & wordCount )
+{
+    pool.start( new DslScanRunnable( *this ) );
+
+    for( ; ; )
+    {
+        hasBatches.acquire();
+
+        sptr< IndexingBatch > batch;
+
+        {
+            Mutex::Lock _( batchesMutex );
+
+            batch = batches.front();
+            batches.pop_front();
+        }
+
+        batch->isParsed.acquire();
+
+        if ( batch->error )
+            std::rethrow_exception( batch->error );
+
+        // Insert new entries
+
+        for( auto const & article : batch->parsed )
+        {
+            uint32_t descOffset = chunks.startNewBlock();
+
+            chunks.addToBlock( &article.offset, sizeof( article.offset ) );
+
+            for( auto const & entry : article.entries )
+                indexedWords.addEntry( entry, descOffset );
+
+            ++articleCount;
+            wordCount += article.wordCount;
+
+            chunks.addToBlock( &article.size, sizeof( article.size ) );
+        }
+
+        if ( batch->last )
+            break;
+
+        freeSlots.release();
+    }
+}
+
 } // anonymous namespace
 
 static bool tryPossibleName( string const & name, string & copyTo )
@@ -1250,7 +1956,13 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                     IndexedWords indexedWords;
 
-                    ChunkedStorage::Writer chunks( idx );
+                    BtreeIndexing::applyIndexingLimits( indexedWords, initializing );
+
+                    Codec::Type codec = Codec::getIndexCodec();
+
+                    idxHeader.codec = codec;
+
+                    ChunkedStorage::Writer chunks( idx, codec );
 
                     // Read the abbreviations
 
@@ -1346,114 +2058,10 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
                         }
                     }
 
-                    bool hasString = false;
-                    wstring curString;
-                    size_t curOffset = 0;
-
                     uint32_t articleCount = 0, wordCount = 0;
 
-                    for( ; ; )
-                    {
-                        // Find the main headword
-
-                        if ( !hasString && !scanner.readNextLine( curString, curOffset ) )
-                            break; // Clean end of file
-
-                        hasString = false;
-
-                        // The line read should either consist of pure whitespace, or be a
-                        // headword
-
-                        if ( curString.empty() )
-                            continue;
-
-                        if ( isDslWs( curString[ 0 ] ) )
-                        {
-                            // The first character is blank. Let's make sure that all other
-                            // characters are blank, too.
-                            for( size_t x = 1; x < curString.size(); ++x )
-                            {
-                                if ( !isDslWs( curString[ x ] ) )
-                                {
-                                    qWarning() << "Garbage string in " << fName.c_str()
-                                               << " at offset " << QString::number(curOffset,16);
-                                    break;
-                                }
-                            }
-                            continue;
-                        }
-
-                        // Ok, got the headword
-
-                        list< wstring > allEntryWords;
-
-                        processUnsortedParts( curString, true );
-                        expandOptionalParts( curString, allEntryWords );
-
-                        uint32_t articleOffset = curOffset;
-
-                        //printf( "Headword: %ls\n", curString.c_str() );
-
-                        // More headwords may follow
-
-                        for( ; ; )
-                        {
-                            if ( ! ( hasString = scanner.readNextLine( curString, curOffset ) ) )
-                            {
-                                qWarning() << "Premature end of file " << fName.c_str();
-                                break;
-                            }
-
-                            if ( curString.empty() || isDslWs( curString[ 0 ] ) )
-                                break; // No more headwords
-
-                            //printf( "Alt headword: %ls\n", curString.c_str() );
-
-                            processUnsortedParts( curString, true );
-                            expandTildes( curString, allEntryWords.front() );
-                            expandOptionalParts( curString, allEntryWords );
-                        }
-
-                        if ( !hasString )
-                            break;
-
-                        // Insert new entry
-
-                        uint32_t descOffset = chunks.startNewBlock();
-
-                        chunks.addToBlock( &articleOffset, sizeof( articleOffset ) );
-
-                        for( auto & word : allEntryWords )
-                        {
-                            unescapeDsl( word );
-                            normalizeHeadword( word );
-                            indexedWords.addWord( word, descOffset );
-                        }
-
-                        ++articleCount;
-                        wordCount += allEntryWords.size();
-
-                        // Skip the article's body
-                        for( ; ; )
-                        {
-                            if ( ! ( hasString = scanner.readNextLine( curString, curOffset ) ) )
-                                break;
-
-                            if ( !curString.empty() && !isDslWs( curString[ 0 ] ) )
-                                break;
-                        }
-
-                        // Now that we're having read the first string after the article
-                        // itself, we can use its offset to calculate the article's size.
-                        // An end of file works here, too.
-
-                        uint32_t articleSize = ( curOffset - articleOffset );
-
-                        chunks.addToBlock( &articleSize, sizeof( articleSize ) );
-
-                        if ( !hasString )
-                            break;
-                    }
+                    DslIndexer( scanner, fName, indexedWords.getMaxThreads() ).run(
+                                chunks, indexedWords, articleCount, wordCount );
 
                     // Finish with the chunks
 
@@ -1461,7 +2069,9 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                     // Build index
 
-                    IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx );
+                    IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx, codec );
+
+                    initializing.indexedDictionary( dictionaryName, indexedWords.getStats() );
 
                     idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
                     idxHeader.indexRootOffset = idxInfo.rootOffset;
@@ -1488,6 +2098,8 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                             IndexedWords zipFileNames;
 
+                            BtreeIndexing::applyIndexingLimits( zipFileNames, initializing );
+
                             ZipFile::CentralDirEntry entry;
 
                             while( ZipFile::readNextEntry( zipFile, entry ) )
@@ -1593,7 +2205,7 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                             // Build the resulting zip file index
 
-                            IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx );
+                            IndexInfo idxInfo = BtreeIndexing::buildIndex( zipFileNames, idx, codec );
 
                             idxHeader.zipIndexBtreeMaxElements = idxInfo.btreeMaxElements;
                             idxHeader.zipIndexRootOffset = idxInfo.rootOffset;
@@ -1648,5 +2260,17 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
     return dictionaries;
 }
 
+bool useReferenceRenderer( Dictionary::Class & dictionary, bool use )
+{
+    DslDictionary * dsl = dynamic_cast< DslDictionary * >( &dictionary );
+
+    if ( !dsl )
+        return false;
+
+    dsl->useReferenceRenderer.store( use ? 1 : 0 );
+
+    return true;
+}
+
 
 }
@@ -17,6 +17,13 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
                                       string const & indicesDir,
                                       Dictionary::Initializing & );
 
+/// Makes the given dictionary, which must be one made by makeDictionaries(),
+/// render its articles with the former renderer, which built a string per
+/// node of the article, or back with the current one. The former one is only
+/// kept as a reference to check the current one against, as the benchmark
+/// does. Returns false if the dictionary isn't a DSL one.
+bool useReferenceRenderer( Dictionary::Class &, bool use );
+
 }
 
 #endif
@@ -4,6 +4,9 @@
 #include "dsl_details.hh"
 #include "folding.hh"
 #include "langcoder.hh"
+#include "utf8.hh"
+#include "mutex.hh"
+#include <atomic>
 #include <cwctype>
 #include <cstdio>
 
@@ -468,7 +471,7 @@ void ArticleDom::nextChar()
 /////////////// DslScanner
 
 DslScanner::DslScanner( string const & fileName ):
-    encoding( Windows1252 ), iconv( encoding ), readBufferPtr( readBuffer ),
+    encoding( Windows1252 ), readBuffer( 65536 ), readBufferPtr( &readBuffer.front() ),
     readBufferLeft( 0 ), linesRead( 0 )
 {
     // Since .dz is backwards-compatible with .gz, we use gz- functions to
@@ -535,7 +538,7 @@ DslScanner::DslScanner( string const & fileName ):
                 }
             }
 
-    iconv.reinit( encoding );
+    setEncoding( encoding );
 
     // We now can use our own readNextLine() function
 
@@ -619,11 +622,11 @@ DslScanner::DslScanner( string const & fileName ):
     // next time it's called. To do that, we just use the slow gzseek() and
     // empty the read buffer.
     gzseek( f, offset, SEEK_SET );
-    readBufferPtr = readBuffer;
+    readBufferPtr = &readBuffer.front();
     readBufferLeft = 0;
 
     if ( needExactEncoding )
-        iconv.reinit( encoding );
+        setEncoding( encoding );
 }
 
 DslScanner::~DslScanner()
@@ -631,108 +634,266 @@ DslScanner::~DslScanner()
     gzclose( f );
 }
 
-bool DslScanner::readNextLine( wstring & out, size_t & offset )
+namespace {
+
+/// Marks the bytes which don't map to any char in a code page table.
+wchar const InvalidChar = static_cast< wchar >( -1 );
+
+/// Returns the table mapping the bytes of the given 8-bit encoding to chars.
+/// Each table is made on first use and kept for the lifetime of the program.
+wchar const * getCodePage( DslEncoding encoding )
 {
-    offset = static_cast<size_t>( gztell( f ) - readBufferLeft );
+    static wchar tables[ Utf8 + 1 ][ 256 ];
+    static std::atomic< bool > made[ Utf8 + 1 ];
+    static Mutex mutex;
 
-    // For now we just read one char at a time
-    size_t readMultiple = distanceToBytes( 1 );
+    // The encoding may come from an index file, so anything unknown falls
+    // back to Windows-1250, just as with getEncodingNameFor()
+    if ( static_cast< unsigned >( encoding ) > Utf8 )
+        encoding = Windows1250;
 
-    size_t leftInOut = wcharBuffer.size();
+    wchar * table = tables[ encoding ];
 
-    wchar * outPtr = &wcharBuffer.front();
+    if ( made[ encoding ].load( std::memory_order_acquire ) )
+        return table;
 
-    for( ; ; )
+    Mutex::Lock _( mutex );
+
+    if ( made[ encoding ].load( std::memory_order_relaxed ) )
+        return table;
+
+    // Ask iconv once for each byte. The ones it can't convert are marked
+    // with an invalid char, so they'd fail the decoding just as before.
+    DslIconv iconv( encoding );
+
+    for( unsigned x = 0; x < 256; ++x )
     {
-        // Check that we have bytes to read
-        if ( readBufferLeft < 4 ) // To convert one char, we need at most 4 bytes
+        char in = static_cast< char >( x );
+        void const * inPtr = &in;
+        size_t inLeft = 1;
+
+        wchar out;
+        void * outPtr = &out;
+        size_t outLeft = sizeof( out );
+
+        table[ x ] = InvalidChar;
+
+        try
         {
-            if ( !gzeof( f ) )
-            {
-                // To avoid having to deal with ring logic, we move the remaining bytes
-                // to the beginning
-                memmove( readBuffer, readBufferPtr, readBufferLeft );
+            iconv.reset();
 
-                // Read some more bytes to readBuffer
-                int result = gzread( f, readBuffer + readBufferLeft,
-                                     sizeof( readBuffer ) - readBufferLeft );
+            if ( iconv.convert( inPtr, inLeft, outPtr, outLeft ) == Iconv::Success &&
+                 !inLeft && !outLeft )
+                table[ x ] = out;
+        }
+        catch( Iconv::Ex & )
+        {
+        }
+    }
 
-                if ( result == -1 )
-                    throw exCantReadDslFile();
+    made[ encoding ].store( true, std::memory_order_release );
 
-                readBufferPtr = readBuffer;
-                readBufferLeft += static_cast<size_t>(result);
-            }
+    return table;
+}
+
+}
+
+void DslScanner::setEncoding( DslEncoding e )
+{
+    encoding = e;
+
+    if ( encoding != Utf16LE && encoding != Utf16BE && encoding != Utf8 )
+        getCodePage( encoding ); // Fail right away if iconv can't make it
+}
+
+bool DslScanner::readMoreData()
+{
+    // To avoid having to deal with ring logic, we move the remaining bytes
+    // to the beginning
+    memmove( &readBuffer.front(), readBufferPtr, readBufferLeft );
+    readBufferPtr = &readBuffer.front();
+
+    if ( readBufferLeft == readBuffer.size() )
+    {
+        // A line longer than the whole buffer
+        readBuffer.resize( readBuffer.size() * 2 );
+        readBufferPtr = &readBuffer.front();
+    }
+
+    int result = gzread( f, readBufferPtr + readBufferLeft,
+                         readBuffer.size() - readBufferLeft );
+
+    if ( result == -1 )
+        throw exCantReadDslFile();
+
+    readBufferLeft += static_cast<size_t>(result);
+
+    return result > 0;
+}
+
+size_t DslScanner::findNewline( char const * data, size_t size ) const
+{
+    // memchr() is vectorized by any decent libc, so we rely on it to find the
+    // candidates, and only check their alignment for UTF-16
+    if ( encoding != Utf16LE && encoding != Utf16BE )
+    {
+        void const * found = memchr( data, '\n', size );
+
+        return found ? static_cast< char const * >( found ) - data : string::npos;
+    }
+
+    size &= ~(size_t) 1; // Whole characters only
+
+    for( size_t pos = 0; pos < size; )
+    {
+        void const * found = memchr( data + pos, '\n', size - pos );
+
+        if ( !found )
+            break;
+
+        pos = static_cast< char const * >( found ) - data;
+
+        if ( encoding == Utf16LE )
+        {
+            if ( !( pos & 1 ) && !data[ pos + 1 ] )
+                return pos;
         }
+        else
+            if ( ( pos & 1 ) && !data[ pos - 1 ] )
+                return pos - 1;
+
+        ++pos;
+    }
 
-        if ( readBufferLeft < readMultiple )
+    return string::npos;
+}
+
+void DslScanner::decode( DslEncoding encoding, char const * data, size_t size,
+                         wstring & out )
+{
+    unsigned char const * in = reinterpret_cast< unsigned char const * >( data );
+
+    switch( encoding )
+    {
+        case Utf16LE:
+        case Utf16BE:
         {
-            // No more data. Return what we've got so far, forget the last byte if
-            // it was a 16-bit Unicode and a file had an odd number of bytes.
-            readBufferLeft = 0;
+            out.resize( size / 2 );
 
-            if ( outPtr != &wcharBuffer.front() )
+            wchar * outPtr = &out[ 0 ];
+            unsigned lo = ( encoding == Utf16LE ) ? 0 : 1;
+
+            for( size_t x = 0; x + 1 < size; x += 2 )
             {
-                // If there was a stray \r, remove it
-                if ( outPtr[ -1 ] == L'\r' )
-                    --outPtr;
+                wchar ch = in[ x + lo ] | ( wchar( in[ x + 1 - lo ] ) << 8 );
+
+                if ( ch >= 0xD800 && ch < 0xE000 )
+                {
+                    // A surrogate pair. The high one must go first
+                    if ( ch >= 0xDC00 || x + 3 >= size )
+                        throw exEncodingError();
 
-                out = wstring( &wcharBuffer.front(), outPtr - &wcharBuffer.front() );
+                    x += 2;
 
-                ++linesRead;
+                    wchar low = in[ x + lo ] | ( wchar( in[ x + 1 - lo ] ) << 8 );
 
-                return true;
+                    if ( low < 0xDC00 || low >= 0xE000 )
+                        throw exEncodingError();
+
+                    ch = 0x10000 + ( ( ch - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+                }
+
+                *outPtr++ = ch;
             }
 
-            return false;
+            out.resize( outPtr - &out[ 0 ] );
         }
+        break;
 
-        // Check that we have chars to write
-        if ( leftInOut < 2 ) // With 16-bit wchars, 2 is needed for a surrogate pair
+        case Utf8:
         {
-            wcharBuffer.resize( wcharBuffer.size() + 64 );
-            outPtr = &wcharBuffer.front() + wcharBuffer.size() - 64 - leftInOut;
-            leftInOut += 64;
-        }
+            out.resize( size );
+
+            long result = Utf8::decode( data, size, &out[ 0 ] );
 
-        // Ok, now convert one char
-        size_t outBytesLeft = sizeof( wchar );
+            if ( result < 0 )
+                throw exEncodingError();
 
-        Iconv::Result r =
-                iconv.convert( (void const *&)readBufferPtr, readBufferLeft,
-                               (void *&)outPtr, outBytesLeft );
+            out.resize( result );
+        }
+        break;
 
-        if ( r == Iconv::NeedMoreOut && outBytesLeft == sizeof( wchar ) )
+        default:
         {
-            // Seems to be a surrogate pair with a 16-bit target wchar
+            wchar const * codePage = getCodePage( encoding );
+
+            out.resize( size );
+
+            for( size_t x = 0; x < size; ++x )
+            {
+                wchar ch = codePage[ in[ x ] ];
+
+                if ( ch == InvalidChar )
+                    throw exEncodingError();
 
-            outBytesLeft *= 2;
-            r = iconv.convert( (void const *&)readBufferPtr, readBufferLeft,
-                               (void *&)outPtr, outBytesLeft );
-            --leftInOut; // Complements the next decremention
+                out[ x ] = ch;
+            }
         }
+    }
+}
+
+bool DslScanner::readNextLine( wstring & out, size_t & offset )
+{
+    offset = static_cast<size_t>( gztell( f ) - readBufferLeft );
+
+    size_t charSize = distanceToBytes( 1 );
+
+    // The number of bytes at readBufferPtr known to have no newlines. It is
+    // always a whole number of characters.
+    size_t scanned = 0;
+
+    for( ; ; )
+    {
+        size_t pos = findNewline( readBufferPtr + scanned, readBufferLeft - scanned );
+
+        if ( pos != string::npos )
+        {
+            size_t lineSize = scanned + pos;
+
+            decode( encoding, readBufferPtr, lineSize, out );
+
+            readBufferPtr += lineSize + charSize;
+            readBufferLeft -= lineSize + charSize;
 
-        if ( ( r != Iconv::Success && r != Iconv::NeedMoreOut ) || outBytesLeft )
-            throw exEncodingError();
+            break;
+        }
 
-        --leftInOut;
+        scanned = readBufferLeft - readBufferLeft % charSize;
 
-        // Have we got \n?
-        if ( outPtr[ -1 ] == L'\n' )
+        if ( !readMoreData() )
         {
-            --outPtr;
+            // No more data. Return what we've got so far, forget the last byte if
+            // it was a 16-bit Unicode and a file had an odd number of bytes.
+            size_t left = readBufferLeft - readBufferLeft % charSize;
 
-            // Now kill a \r if there is one, and return the result.
-            if ( outPtr != &wcharBuffer.front() && outPtr[ -1 ] == L'\r' )
-                --outPtr;
+            readBufferLeft = 0;
 
-            out = wstring( &wcharBuffer.front(), outPtr - &wcharBuffer.front() );
+            if ( !left )
+                return false;
 
-            ++linesRead;
+            decode( encoding, readBufferPtr, left, out );
 
-            return true;
+            break;
         }
     }
+
+    // Now kill a \r if there is one, and return the result.
+    if ( !out.empty() && out[ out.size() - 1 ] == L'\r' )
+        out.resize( out.size() - 1 );
+
+    ++linesRead;
+
+    return true;
 }
 
 
@@ -96,17 +96,17 @@ public:
 
 /// Opens the .dsl or .dsl.dz file and allows line-by-line reading. Auto-detects
 /// the encoding, and reads all headers by itself.
+/// The lines are located in the raw data first, and then decoded as a whole,
+/// with decode().
 class DslScanner
 {
   gzFile f;
   DslEncoding encoding;
-  DslIconv iconv;
   wstring dictionaryName;
   wstring langFrom, langTo;
-  char readBuffer[ 65536 ]{};
+  vector< char > readBuffer; // Grows if a single line doesn't fit
   char * readBufferPtr;
   size_t readBufferLeft;
-  vector< wchar > wcharBuffer;
   unsigned linesRead;
 
 public:
@@ -153,6 +153,29 @@ public:
   /// would occupy in the file, knowing its encoding. It's possible to know
   /// that because no multibyte encodings are supported in .dsls.
   inline size_t distanceToBytes( size_t ) const;
+
+private:
+
+  /// Switches to the given encoding, making sure the table of the 8-bit ones
+  /// is there.
+  void setEncoding( DslEncoding );
+
+  /// Moves the unread data to the beginning of readBuffer and appends more
+  /// data from the file to it. Returns false if there's no more data.
+  bool readMoreData();
+
+  /// Returns the offset of the first newline character in the given data,
+  /// which must begin at a character boundary, or string::npos if there's
+  /// none.
+  size_t findNewline( char const * data, size_t size ) const;
+
+public:
+
+  /// Decodes the given data of the given encoding, which must consist of
+  /// whole characters, to 'out'. No iconv is involved: the Unicode encodings
+  /// are decoded natively, and the 8-bit ones using tables, which are made
+  /// just once for the whole program. Throws exEncodingError on invalid data.
+  static void decode( DslEncoding, char const * data, size_t size, wstring & out );
 };
 
 /// This function either removes parts of string enclosed in braces, or leaves
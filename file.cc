@@ -8,6 +8,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 namespace File {
@@ -36,13 +37,15 @@ void Class::open( char const * filename, char const * mode )
 }
 
 Class::Class( char const * filename, char const * mode ):
-    f( nullptr ), writeBuffer( nullptr ), writeBufferLeft( 0 )
+    f( nullptr ), writeBuffer( nullptr ), writeBufferLeft( 0 ),
+    mapping( nullptr ), mappingSize( 0 )
 {
     open( filename, mode );
 }
 
 Class::Class( std::string const & filename, char const * mode ):
-    f( nullptr ), writeBuffer( nullptr ), writeBufferLeft( 0 )
+    f( nullptr ), writeBuffer( nullptr ), writeBufferLeft( 0 ),
+    mapping( nullptr ), mappingSize( 0 )
 {
     open( filename.c_str(), mode );
 }
@@ -61,6 +64,64 @@ void Class::read( void * buf, size_t size )
         throw exReadError();
 }
 
+void Class::readAt( void * buf, size_t size, size_t offset )
+{
+    if ( char const * mapped = mappedAt( offset, size ) )
+    {
+        memcpy( buf, mapped, size );
+        return;
+    }
+
+    if ( writeBuffer )
+        flushWriteBuffer();
+
+    int fd = fileno( f );
+
+    char * ptr = static_cast< char * >( buf );
+
+    while( size )
+    {
+        ssize_t result = pread( fd, ptr, size, static_cast< off_t >( offset ) );
+
+        if ( result < 0 && errno == EINTR )
+            continue;
+
+        if ( result <= 0 )
+            throw exReadError();
+
+        ptr += result;
+        offset += result;
+        size -= result;
+    }
+}
+
+bool Class::map()
+{
+    if ( mapping )
+        return true;
+
+    if ( writeBuffer )
+        flushWriteBuffer();
+
+    int fd = fileno( f );
+
+    struct stat st {};
+
+    if ( fstat( fd, &st ) != 0 || st.st_size <= 0 )
+        return false;
+
+    void * result = mmap( nullptr, static_cast< size_t >( st.st_size ), PROT_READ,
+                          MAP_SHARED, fd, 0 );
+
+    if ( result == MAP_FAILED )
+        return false;
+
+    mapping = static_cast< char * >( result );
+    mappingSize = static_cast< size_t >( st.st_size );
+
+    return true;
+}
+
 size_t Class::readRecords( void * buf, size_t size, size_t count )
 {
     if ( writeBuffer )
@@ -223,6 +284,7 @@ FILE * Class::file()
 FILE * Class::release()
 {
     releaseWriteBuffer();
+    unmap();
 
     FILE * c = f;
 
@@ -247,6 +309,7 @@ Class::~Class()
         catch( exWriteError & )
         {
         }
+        unmap();
         fclose( f );
     }
 }
@@ -264,6 +327,17 @@ void Class::flushWriteBuffer()
     }
 }
 
+void Class::unmap()
+{
+    if ( mapping )
+    {
+        munmap( mapping, mappingSize );
+
+        mapping = nullptr;
+        mappingSize = 0;
+    }
+}
+
 void Class::releaseWriteBuffer()
 {
     flushWriteBuffer();
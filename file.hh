@@ -30,6 +30,8 @@ class Class
   FILE * f;
   char * writeBuffer;
   size_t writeBufferLeft;
+  char * mapping;
+  size_t mappingSize;
 
   void open( char const * filename, char const * mode );
 
@@ -51,6 +53,30 @@ public:
   T read()
   { T value; read( value ); return value; }
 
+  /// Reads the number of bytes at the given offset to the buffer, throws an
+  /// error if it failed to fill the whole buffer. Unlike read(), this neither
+  /// uses nor moves the current file position, so several threads may do it
+  /// at once, without locking, as long as nobody writes to the file.
+  void readAt( void * buf, size_t size, size_t offset );
+
+  template< typename T >
+  T readAt( size_t offset )
+  { T value; readAt( &value, sizeof( value ), offset ); return value; }
+
+  /// Maps the whole file into memory for reading, if possible. Once it is
+  /// mapped, readAt() and mappedAt() use the mapping instead of doing any
+  /// syscalls. The file must not be written to afterwards. Returns true if
+  /// the file is mapped, false otherwise (in which case everything still
+  /// works as before).
+  bool map();
+
+  /// Returns a pointer to the given range of the mapped file, or 0 if the
+  /// file isn't mapped or the range doesn't lie within it. The pointer stays
+  /// valid until the file is closed or released.
+  char const * mappedAt( size_t offset, size_t size ) const
+  { return mapping && offset <= mappingSize && size <= mappingSize - offset ?
+             mapping + offset : 0; }
+
   /// Attempts reading at most 'count' records sized 'size'. Returns
   /// the number of records it managed to read, up to 'count'.
   size_t readRecords( void * buf, size_t size, size_t count );
@@ -116,6 +142,7 @@ private:
 
   void flushWriteBuffer();
   void releaseWriteBuffer();
+  void unmap();
 };
 
 }
@@ -2,6 +2,7 @@
  * Part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
 
 #include "folding.hh"
+#include <stdint.h>
 
 namespace Folding {
 
@@ -23,63 +24,275 @@ namespace
              ( ch >= 0xFE20 && ch <= 0xFE2F )
            );
   }
+
+  bool isWhitespaceSwitch( wchar ch );
+  bool isPunctSwitch( wchar ch );
+
+  enum
+  {
+    // All the multi-character sequences foldDiacritic() knows about have
+    // their second and third characters within this range. When the next
+    // character is outside of it, a single-character lookup is enough.
+    DiacriticFollowerMin = 0x300,
+    DiacriticFollowerMax = 0x5C2,
+
+    // Flags in Tables::flags
+    FlagWhitespace = 1,
+    FlagPunct = 2,
+    FlagCombiningMark = 4,
+    // Whitespace, punctuation or a combining mark -- dropped by apply()
+    FlagDropped = FlagWhitespace | FlagPunct | FlagCombiningMark
+  };
+
+  /// Flat lookup tables for the BMP, built once out of the generated switch
+  /// statements. A zero in a case table means the character has to be
+  /// handled by the switch (it folds into several characters, or out of the
+  /// BMP). Everything outside the BMP is always handled by the switches.
+  struct Tables
+  {
+    uint16_t fullCase[ 0x10000 ];
+    uint16_t simpleCase[ 0x10000 ];
+    uint16_t diacritic[ 0x10000 ];
+    unsigned char flags[ 0x10000 ];
+
+    Tables()
+    {
+      wchar buf[ foldCaseMaxOut ];
+
+      for( wchar ch = 0; ch < 0x10000; ++ch )
+      {
+        fullCase[ ch ] = ( foldCase( ch, buf ) == 1 && buf[ 0 ] < 0x10000 ) ? buf[ 0 ] : 0;
+
+        wchar simple = foldCaseSimple( ch );
+        simpleCase[ ch ] = simple < 0x10000 ? simple : 0;
+
+        size_t consumed;
+        diacritic[ ch ] = foldDiacritic( &ch, 1, consumed );
+
+        flags[ ch ] = ( isWhitespaceSwitch( ch ) ? FlagWhitespace : 0 ) |
+                      ( isPunctSwitch( ch ) ? FlagPunct : 0 ) |
+                      ( isCombiningMark( ch ) ? FlagCombiningMark : 0 );
+      }
+    }
+  };
+
+  Tables const & tables()
+  {
+    static Tables const t;
+
+    return t;
+  }
+
+  inline bool isBmp( wchar ch )
+  { return static_cast< uint32_t >( ch ) < 0x10000; }
+
+  /// A table-driven foldDiacritic().
+  inline wchar foldDiacriticFast( Tables const & t, wchar const * in,
+                                  size_t size, size_t & consumed )
+  {
+    if ( isBmp( in[ 0 ] ) &&
+         ( size == 1 || in[ 1 ] < DiacriticFollowerMin || in[ 1 ] > DiacriticFollowerMax ) )
+    {
+      consumed = 1;
+      return t.diacritic[ in[ 0 ] ];
+    }
+
+    return foldDiacritic( in, size, consumed );
+  }
+
+  /// A table-driven foldCase().
+  inline size_t foldCaseFast( Tables const & t, wchar ch, wchar * out )
+  {
+    if ( isBmp( ch ) && t.fullCase[ ch ] )
+    {
+      *out = t.fullCase[ ch ];
+      return 1;
+    }
+
+    return foldCase( ch, out );
+  }
+
+  inline bool isDropped( Tables const & t, wchar ch )
+  { return isBmp( ch ) && ( t.flags[ ch ] & FlagDropped ); }
+
+  /// Folds plain ASCII: lowercase letters and digits are kept, uppercase
+  /// letters are lowercased, and the rest (whitespace and punctuation, plus
+  /// control characters, which are kept) is marked with a zero.
+  struct AsciiTable
+  {
+    wchar map[ 0x80 ];
+
+    AsciiTable()
+    {
+      Tables const & t = tables();
+
+      for( wchar ch = 0; ch < 0x80; ++ch )
+        map[ ch ] = ( t.flags[ ch ] & FlagDropped ) ? 0 : t.fullCase[ ch ];
+    }
+  };
+
+  AsciiTable const & asciiTable()
+  {
+    static AsciiTable const t;
+
+    return t;
+  }
+
+  /// Returns the number of leading characters in the given range which are
+  /// plain ASCII. Checks four characters at a time, which compilers are able
+  /// to vectorize.
+  inline size_t asciiRunLength( wchar const * in, size_t size )
+  {
+    size_t x = 0;
+
+    for( ; x + 4 <= size; x += 4 )
+      if ( ( static_cast< uint32_t >( in[ x ] ) | static_cast< uint32_t >( in[ x + 1 ] ) |
+             static_cast< uint32_t >( in[ x + 2 ] ) | static_cast< uint32_t >( in[ x + 3 ] ) ) >= 0x80 )
+        break;
+
+    for( ; x < size; ++x )
+      if ( static_cast< uint32_t >( in[ x ] ) >= 0x80 )
+        break;
+
+    return x;
+  }
 }
 
-wstring apply( wstring const & in )
+namespace
 {
-  // First, strip diacritics and apply ws/punctuation removal
+  /// Does the actual work for apply(). Stores at most outSize characters,
+  /// not terminated, and returns the number of characters the result has,
+  /// regardless of whether they all fit or not.
+  size_t applyTo( wchar const * in, size_t inSize, wchar * out, size_t outSize )
+  {
+    Tables const & t = tables();
+    wchar const * ascii = asciiTable().map;
 
-  wstring withoutDiacritics;
+    // We keep on counting the required size once we're out of space
+    size_t used = 0;
 
-  withoutDiacritics.reserve( in.size() );
+    wchar buf[ foldCaseMaxOut ];
 
-  wchar const * nextChar = in.data();
+    for( size_t left = inSize; left; )
+    {
+      // Fold runs of plain ASCII in bulk. The last character of a run is left
+      // for the generic code, since it may combine with a following mark.
+      size_t run = asciiRunLength( in, left );
 
-  size_t consumed;
+      if ( run < left && run )
+        --run;
 
-  for( size_t left = in.size(); left; )
-  {
-    wchar ch = foldDiacritic( nextChar, left, consumed );
+      for( size_t x = 0; x < run; ++x )
+      {
+        wchar ch = ascii[ in[ x ] ];
 
-    if ( !isCombiningMark( ch ) && !isWhitespace( ch ) && !isPunct( ch ) )
-      withoutDiacritics.push_back( ch );
+        if ( ch || !in[ x ] )
+        {
+          if ( used < outSize )
+            out[ used ] = ch;
 
-    nextChar += consumed;
-    left -= consumed;
+          ++used;
+        }
+      }
+
+      in += run;
+      left -= run;
+
+      if ( !left )
+        break;
+
+      // Generic case: strip diacritics and apply ws/punctuation removal,
+      // then fold the case
+
+      size_t consumed;
+
+      wchar ch = foldDiacriticFast( t, in, left, consumed );
+
+      in += consumed;
+      left -= consumed;
+
+      if ( isDropped( t, ch ) )
+        continue;
+
+      size_t folded = foldCaseFast( t, ch, buf );
+
+      for( size_t x = 0; x < folded; ++x, ++used )
+        if ( used < outSize )
+          out[ used ] = buf[ x ];
+    }
+
+    return used;
   }
+}
 
-  // Now, fold the case
+ssize_t apply( wchar const * in, wchar * out, size_t outSize )
+{
+  size_t inSize = 0;
 
-  wstring caseFolded;
+  while( in[ inSize ] )
+    ++inSize;
 
-  caseFolded.reserve( withoutDiacritics.size() * foldCaseMaxOut );
+  return apply( in, inSize, out, outSize );
+}
 
-  nextChar = withoutDiacritics.data();
+ssize_t apply( wchar const * in, size_t inSize, wchar * out, size_t outSize )
+{
+  size_t used = applyTo( in, inSize, out, outSize );
 
-  wchar buf[ foldCaseMaxOut ];
+  // The terminator
 
-  for( size_t left = withoutDiacritics.size(); left--; )
-    caseFolded.append( buf, foldCase(  *nextChar++, buf ) );
+  if ( used < outSize )
+  {
+    out[ used ] = 0;
+    return -1;
+  }
 
-  return caseFolded;
+  return used + 1;
+}
+
+wstring apply( wstring const & in )
+{
+  // Short strings are folded on stack, so the result is the only allocation
+  enum { StackBufferSize = 256 };
+
+  wchar stackBuffer[ StackBufferSize ];
+
+  size_t outSize = in.size() * MaxOutPerChar + 1;
+
+  if ( outSize <= StackBufferSize )
+    return wstring( stackBuffer, applyTo( in.data(), in.size(), stackBuffer, StackBufferSize ) );
+
+  wstring out( outSize, 0 );
+
+  out.resize( applyTo( in.data(), in.size(), &out[ 0 ], outSize ) );
+
+  return out;
 }
 
 wstring applySimpleCaseOnly( wstring const & in )
 {
+  Tables const & t = tables();
+
   wchar const * nextChar = in.data();
 
   wstring out;
 
   out.reserve( in.size() );
 
-  for( size_t left = in.size(); left--; )
-    out.push_back( foldCaseSimple( *nextChar++ ) );
+  for( size_t left = in.size(); left--; ++nextChar )
+  {
+    wchar ch = *nextChar;
+
+    out.push_back( isBmp( ch ) && t.simpleCase[ ch ] ? t.simpleCase[ ch ] : foldCaseSimple( ch ) );
+  }
 
   return out;
 }
 
 wstring applyFullCaseOnly( wstring const & in )
 {
+  Tables const & t = tables();
+
   wstring caseFolded;
 
   caseFolded.reserve( in.size() * foldCaseMaxOut );
@@ -89,13 +302,15 @@ wstring applyFullCaseOnly( wstring const & in )
   wchar buf[ foldCaseMaxOut ];
 
   for( size_t left = in.size(); left--; )
-    caseFolded.append( buf, foldCase(  *nextChar++, buf ) );
+    caseFolded.append( buf, foldCaseFast( t, *nextChar++, buf ) );
 
   return caseFolded;
 }
 
 wstring applyDiacriticsOnly( wstring const & in )
 {
+  Tables const & t = tables();
+
   wstring withoutDiacritics;
 
   withoutDiacritics.reserve( in.size() );
@@ -106,9 +321,9 @@ wstring applyDiacriticsOnly( wstring const & in )
 
   for( size_t left = in.size(); left; )
   {
-    wchar ch = foldDiacritic( nextChar, left, consumed );
+    wchar ch = foldDiacriticFast( t, nextChar, left, consumed );
 
-    if ( !isCombiningMark( ch ) )
+    if ( !isBmp( ch ) || !( t.flags[ ch ] & FlagCombiningMark ) )
       withoutDiacritics.push_back( ch );
 
     nextChar += consumed;
@@ -164,6 +379,19 @@ wstring applyWhitespaceAndPunctOnly( wstring const & in )
 }
 
 bool isWhitespace( wchar ch )
+{
+  return isBmp( ch ) && ( tables().flags[ ch ] & FlagWhitespace );
+}
+
+bool isPunct( wchar ch )
+{
+  return isBmp( ch ) && ( tables().flags[ ch ] & FlagPunct );
+}
+
+namespace
+{
+
+bool isWhitespaceSwitch( wchar ch )
 {
   switch( ch )
   {
@@ -200,7 +428,7 @@ bool isWhitespace( wchar ch )
   }
 }
 
-bool isPunct( wchar ch )
+bool isPunctSwitch( wchar ch )
 {
   switch( ch )
   {
@@ -597,6 +825,8 @@ bool isPunct( wchar ch )
   }
 }
 
+}
+
 wstring trimWhitespaceOrPunct( wstring const & in )
 {
   wchar const * wordBegin = in.c_str();
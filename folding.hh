@@ -5,6 +5,7 @@
 #define __FOLDING_HH_INCLUDED__
 
 #include "wstring.hh"
+#include <sys/types.h>
 
 /// Folding provides means to translate several possible ways to write a
 /// symbol into one. This facilitates searching. Here we currently perform
@@ -71,12 +72,23 @@ wstring trimWhitespace( wstring const & );
 void normalizeWhitespace( wstring & );
 
 /// Same as apply( wstring ), but without any heap operations, therefore
-/// preferable when there're many strings to process. Returns -1 if the
+/// preferable when there're many strings to process. The input is
+/// zero-terminated, and so is the result stored in 'out'. Returns -1 if the
 /// operation succeded, or otherwise the minimum value of outSize required
-/// to succeed.
-/// Currently commented out, consider implementing it in case indices'
-/// generation would be too slow.
-//ssize_t apply( wchar const * in, wchar * out, size_t outSize );
+/// to succeed (including the terminator). An outSize of
+/// wcslen( in ) * MaxOutPerChar + 1 is always enough.
+ssize_t apply( wchar const * in, wchar * out, size_t outSize );
+
+/// Same as above, but the input has the given size and needs not to be
+/// zero-terminated.
+ssize_t apply( wchar const * in, size_t inSize, wchar * out, size_t outSize );
+
+/// The maximum number of characters apply() may produce out of a single
+/// input character.
+enum
+{
+  MaxOutPerChar = 3
+};
 
 }
 
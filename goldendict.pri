@@ -0,0 +1,84 @@
+# The dictionary code proper, shared by the library (goldendict.pro) and the
+# benchmark (bench/bench.pro), which builds it right in.
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/zipfile.cc \
+    $$PWD/wstring_qt.cc \
+    $$PWD/wstring.cc \
+    $$PWD/utf8.cc \
+    $$PWD/stardict.cc \
+    $$PWD/mutex.cc \
+    $$PWD/langcoder.cc \
+    $$PWD/folding.cc \
+    $$PWD/dsl_details.cc \
+    $$PWD/dsl.cc \
+    $$PWD/dictzip.c \
+    $$PWD/indexedzip.cc \
+    $$PWD/iconv.cc \
+    $$PWD/htmlescape.cc \
+    $$PWD/fsencoding.cc \
+    $$PWD/dictionary.cc \
+    $$PWD/dictdfiles.cc \
+    $$PWD/chunkedstorage.cc \
+    $$PWD/btreeidx.cc \
+    $$PWD/xdxf2html.cc \
+    $$PWD/file.cc \
+    $$PWD/filetype.cc \
+    $$PWD/wordfinder.cc \
+    $$PWD/romaji.cc \
+    $$PWD/transliteration.cc \
+    $$PWD/codec.cc \
+    $$PWD/metrics.cc \
+    $$PWD/batchlookup.cc
+
+HEADERS += \
+    $$PWD/zipfile.hh \
+    $$PWD/xdxf2html.hh \
+    $$PWD/wstring_qt.hh \
+    $$PWD/wstring.hh \
+    $$PWD/utf8.hh \
+    $$PWD/stardict.hh \
+    $$PWD/sptr.hh \
+    $$PWD/mutex.hh \
+    $$PWD/langcoder.hh \
+    $$PWD/ex.hh \
+    $$PWD/dsl_details.hh \
+    $$PWD/dsl.hh \
+    $$PWD/dictzip.h \
+    $$PWD/dictionary.hh \
+    $$PWD/indexedzip.hh \
+    $$PWD/iconv.hh \
+    $$PWD/htmlescape.hh \
+    $$PWD/fsencoding.hh \
+    $$PWD/folding.hh \
+    $$PWD/dictdfiles.hh \
+    $$PWD/chunkedstorage.hh \
+    $$PWD/btreeidx.hh \
+    $$PWD/file.hh \
+    $$PWD/inc_diacritic_folding.hh \
+    $$PWD/inc_case_folding.hh \
+    $$PWD/filetype.hh \
+    $$PWD/wordfinder.hh \
+    $$PWD/romaji.hh \
+    $$PWD/transliteration.hh \
+    $$PWD/codec.hh \
+    $$PWD/metrics.hh \
+    $$PWD/batchlookup.hh
+
+# Optional index codecs, enabled with "qmake CONFIG+=zstd CONFIG+=lz4"
+zstd {
+    DEFINES += HAVE_ZSTD
+    LIBS += -lzstd
+}
+
+lz4 {
+    DEFINES += HAVE_LZ4
+    LIBS += -llz4
+}
+
+# The lookup metrics are compiled in unless built with "qmake CONFIG+=no_metrics"
+no_metrics {
+    DEFINES += NO_METRICS
+}
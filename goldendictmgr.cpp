@@ -9,6 +9,7 @@
 #include <string>
 #include <set>
 #include <list>
+#include <algorithm>
 #include "goldendictmgr.hh"
 #include "dsl.hh"
 #include "stardict.hh"
@@ -20,10 +21,15 @@
 #include "utf8.hh"
 #include "romaji.hh"
 #include "fsencoding.hh"
+#include "btreeidx.hh"
 
 #include <QString>
 #include <QUrl>
 #include <QDebug>
+#include <QThreadPool>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QRunnable>
 
 #include <QUrlQuery>
 
@@ -65,7 +71,7 @@ QString getHostBase( QUrl const & url )
 }
 
 CGoldenDictMgr::CGoldenDictMgr(QObject *parent) :
-    QObject(parent)
+    QObject(parent), m_maxIndexingThreads( 0 ), m_indexingMemoryLimit( 0 ), m_articleTimeout( 0 )
 {
 }
 
@@ -75,7 +81,16 @@ sptr<Dictionary::DataRequest> CGoldenDictMgr::makeDefinitionFor(const QString &i
 
     string header = makeHtmlHeader( inWord.trimmed() );
 
-    return new ArticleRequest( inWord.trimmed(), "", contexts, dictionaries, header );
+    return new ArticleRequest( inWord.trimmed(), "", contexts, dictionaries, header,
+                               false, m_articleTimeout );
+}
+
+sptr<Dictionary::DataRequest> CGoldenDictMgr::makeDefinitionNow(const QString &inWord, const QMap<QString, QString> &contexts) const
+{
+    string header = makeHtmlHeader( inWord.trimmed() );
+
+    return new ArticleRequest( inWord.trimmed(), "", contexts, dictionaries, header,
+                               true, m_articleTimeout );
 }
 
 sptr<Dictionary::DataRequest> CGoldenDictMgr::makeNotFoundTextFor(const QString &word) const
@@ -105,6 +120,39 @@ sptr<Dictionary::DataRequest> CGoldenDictMgr::makeEmptyPage() const
     return r;
 }
 
+/// Converts the words the way makeDefinitionFor() does.
+static std::vector< gd::wstring > toBatchWords( QStringList const & words )
+{
+    std::vector< gd::wstring > result;
+
+    result.reserve( words.size() );
+
+    for( QString const & word : words )
+        result.push_back( gd::toWString( word.trimmed() ) );
+
+    return result;
+}
+
+std::vector< std::vector< BatchLookup::Article > >
+CGoldenDictMgr::lookupArticles( QStringList const & words ) const
+{
+    return BatchLookup::lookupArticles( dictionaries, toBatchWords( words ) );
+}
+
+std::vector< QStringList > CGoldenDictMgr::findMatches( QStringList const & words ) const
+{
+    std::vector< std::vector< gd::wstring > > matches =
+        BatchLookup::findMatches( dictionaries, toBatchWords( words ) );
+
+    std::vector< QStringList > result( matches.size() );
+
+    for( size_t x = 0; x < matches.size(); ++x )
+        for( auto const & headword : matches[ x ] )
+            result[ x ].append( gd::toQString( headword ) );
+
+    return result;
+}
+
 QStringList CGoldenDictMgr::getLoadedDictionaries()
 {
     QStringList res;
@@ -120,6 +168,22 @@ QStringList CGoldenDictMgr::getLoadedDictionaries()
 }
 
 
+Metrics::Snapshot CGoldenDictMgr::getDictionaryMetrics( QString const & dictionaryId ) const
+{
+    return Metrics::getSnapshot( dictionaryId.toStdString() );
+}
+
+QString CGoldenDictMgr::dumpMetrics( bool asJson ) const
+{
+    std::map< std::string, std::string > names;
+
+    for( unsigned x = 0; x < dictionaries.size(); ++x )
+        names[ dictionaries[ x ]->getId() ] = dictionaries[ x ]->getName();
+
+    return QString::fromUtf8( ( asJson ? Metrics::dumpJson( names ) :
+                                         Metrics::dumpText( names ) ).c_str() );
+}
+
 std::string CGoldenDictMgr::makeNotFoundBody(const QString &word)
 {
     string result( R"(<div class="gdnotfound"><p>)" );
@@ -171,13 +235,17 @@ void CGoldenDictMgr::loadDictionaries(const QStringList& dictPaths, const QStrin
 {
     dictionaries.clear();
 
+    // The cached search results refer to the old dictionaries
+    WordFinder::clearResultCache();
+
     showMessage(QString("Loading dictionaries..."));
 
     qInfo() << "Indexing dictionaries. Please wait.";
 
     m_dictIndexDir = dictIndexDir;
 
-    auto loadDicts = new CDictLoader(this, dictPaths, dictIndexDir);
+    auto loadDicts = new CDictLoader(this, dictPaths, dictIndexDir, m_maxIndexingThreads,
+                                     m_indexingMemoryLimit);
 
     QObject::connect( loadDicts, &CDictLoader::indexingDictionarySignal,
                       this, &CGoldenDictMgr::showMessage );
@@ -249,8 +317,65 @@ void CGoldenDictMgr::showMessage(const QString &msg)
 }
 
 
-CDictLoader::CDictLoader(QObject *parent, const QStringList &dictPaths, const QString &dictIndexDir)
-    : QThread(parent), paths(dictPaths), exceptionText( "Load did not finish" ), m_dictIndexDir(dictIndexDir)
+typedef vector< sptr< Dictionary::Class > > (*MakeDictionaries)( vector< string > const &,
+                                                                  string const &,
+                                                                  Dictionary::Initializing & );
+
+/// A single dictionary file to be handled by a single format
+struct DictLoadTask
+{
+    MakeDictionaries makeDictionaries;
+    string fileName;
+
+    vector< sptr< Dictionary::Class > > dictionaries;
+    string exceptionText; // Non-empty if the job has failed
+
+    DictLoadTask( MakeDictionaries makeDictionaries_, string const & fileName_ ):
+        makeDictionaries( makeDictionaries_ ), fileName( fileName_ )
+    {}
+};
+
+namespace
+{
+
+class DictLoadRunnable: public QRunnable
+{
+    DictLoadTask & task;
+    string const & indicesDir;
+    Dictionary::Initializing & initializing;
+
+public:
+
+    DictLoadRunnable( DictLoadTask & task_, string const & indicesDir_,
+                      Dictionary::Initializing & initializing_ ):
+        task( task_ ), indicesDir( indicesDir_ ), initializing( initializing_ )
+    {}
+
+    void run() override
+    {
+        try
+        {
+            task.dictionaries = task.makeDictionaries( vector< string >( 1, task.fileName ),
+                                                       indicesDir, initializing );
+        }
+        catch( std::exception & e )
+        {
+            task.exceptionText = e.what();
+        }
+    }
+
+    DictLoadRunnable(const DictLoadRunnable &) = delete;
+    DictLoadRunnable& operator =(DictLoadRunnable const&) = delete;
+    DictLoadRunnable(DictLoadRunnable&&) = delete;
+    DictLoadRunnable& operator=(DictLoadRunnable&&) = delete;
+};
+
+}
+
+CDictLoader::CDictLoader(QObject *parent, const QStringList &dictPaths, const QString &dictIndexDir,
+                         int maxThreads_, size_t memoryLimit_)
+    : QThread(parent), paths(dictPaths), exceptionText( "Load did not finish" ), m_dictIndexDir(dictIndexDir),
+      maxThreads( maxThreads_ ), memoryLimit( memoryLimit_ ), jobThreads( 0 ), jobMemoryLimit( 0 )
 {
     nameFilters << "*.ifo" << "*.dat"
                 << "*.dsl" << "*.dsl.dz"  << "*.index";
@@ -259,8 +384,60 @@ CDictLoader::CDictLoader(QObject *parent, const QStringList &dictPaths, const QS
 void CDictLoader::run()
 {
     try {
+        vector< DictLoadTask > tasks;
+
+        queuedFiles.clear();
+
         for (int i=0;i<paths.count();i++)
-            handlePath(paths.at(i),true);
+            handlePath(paths.at(i),true,tasks);
+
+        // Run the jobs. Each one stores its results into its own task, so
+        // there's no need to lock anything, and the order is kept.
+
+        string indicesDir = FsEncoding::encode( m_dictIndexDir );
+
+        int threads = maxThreads > 0 ? maxThreads : QThread::idealThreadCount();
+
+        if ( threads < 1 )
+            threads = 1;
+
+        // Each job gets an equal share of the threads and of the memory, as
+        // the indexers would otherwise take all of them for themselves. Each
+        // file is tried with every format, but only one of them indexes it
+        std::set< string > files;
+
+        for( auto const & task : tasks )
+            files.insert( task.fileName );
+
+        int jobs = std::max( 1, std::min( threads, static_cast< int >( files.size() ) ) );
+
+        jobThreads = std::max( 1, threads / jobs );
+        jobMemoryLimit = ( memoryLimit ? memoryLimit :
+                                         size_t( BtreeIndexing::DefaultIndexedWordsMemoryLimit ) ) / jobs;
+
+        if ( !jobMemoryLimit )
+            jobMemoryLimit = 1; // Zero would mean the indexer's default
+
+        QThreadPool pool;
+
+        pool.setMaxThreadCount( threads );
+
+        for( auto & task : tasks )
+            pool.start( new DictLoadRunnable( task, indicesDir, *this ) );
+
+        pool.waitForDone();
+
+        for( auto const & task : tasks )
+        {
+            if ( !task.exceptionText.empty() )
+            {
+                exceptionText = task.exceptionText;
+                return;
+            }
+
+            dictionaries.insert( dictionaries.end(), task.dictionaries.cbegin(),
+                                 task.dictionaries.cend() );
+        }
 
         exceptionText.clear();
     }
@@ -276,7 +453,16 @@ void CDictLoader::indexingDictionary(const std::string &dictionaryName)
     emit indexingDictionarySignal( msg );
 }
 
-void CDictLoader::handlePath(const QString &path, bool recursive)
+void CDictLoader::indexedDictionary( std::string const & dictionaryName,
+                                     Dictionary::IndexingStats const & stats )
+{
+    qDebug( "Indexed \"%s\": %llu entries, peak memory %llu KiB, %u runs spilled to disk",
+            dictionaryName.c_str(), static_cast< unsigned long long >( stats.entries ),
+            static_cast< unsigned long long >( stats.peakBytes / 1024 ), stats.spilledRuns );
+}
+
+void CDictLoader::handlePath(const QString &path, bool recursive,
+                             vector< DictLoadTask > & tasks)
 {
     std::vector< std::string > allFiles;
 
@@ -289,40 +475,32 @@ void CDictLoader::handlePath(const QString &path, bool recursive)
     {
         const QString fullName = fi.canonicalFilePath();
 
+        // The paths may overlap, and two jobs indexing the same file at
+        // once would write the same index
+        if ( !queuedFiles.insert( fullName.toStdString() ).second )
+            continue;
+
         if ( recursive && fi.isDir() )
         {
             // Make sure the path doesn't look like with dsl resources
             if ( !fullName.endsWith( ".dsl.files", Qt::CaseInsensitive ) &&
                  !fullName.endsWith( ".dsl.dz.files", Qt::CaseInsensitive ) )
-                handlePath( fullName, true );
+                handlePath( fullName, true, tasks );
         }
 
         allFiles.emplace_back( FsEncoding::encode(QDir::toNativeSeparators(fullName )) );
     }
 
-    {
-        std::vector< sptr< Dictionary::Class > > stardictDictionaries =
-                Stardict::makeDictionaries( allFiles, FsEncoding::encode(m_dictIndexDir), *this );
-
-        dictionaries.insert( dictionaries.end(), stardictDictionaries.cbegin(),
-                             stardictDictionaries.cend() );
-    }
-
-    {
-        std::vector< sptr< Dictionary::Class > > dslDictionaries =
-                Dsl::makeDictionaries( allFiles, FsEncoding::encode(m_dictIndexDir), *this );
-
-        dictionaries.insert( dictionaries.end(), dslDictionaries.cbegin(),
-                             dslDictionaries.cend() );
-    }
+    // Each format handles each file on its own, so every file becomes a
+    // separate job. Files the format doesn't recognize are skipped quickly.
 
-    {
-        std::vector< sptr< Dictionary::Class > > dictdDictionaries =
-                DictdFiles::makeDictionaries( allFiles, FsEncoding::encode(m_dictIndexDir), *this );
+    MakeDictionaries const formats[] = { &Stardict::makeDictionaries,
+                                         &Dsl::makeDictionaries,
+                                         &DictdFiles::makeDictionaries };
 
-        dictionaries.insert( dictionaries.end(), dictdDictionaries.cbegin(),
-                             dictdDictionaries.cend() );
-    }
+    for( auto format : formats )
+        for( auto const & fileName : allFiles )
+            tasks.emplace_back( format, fileName );
 }
 
 //////// ArticleRequest
@@ -331,14 +509,16 @@ ArticleRequest::ArticleRequest(
         QString const & word_, QString const & group_,
         QMap< QString, QString > const & contexts_,
         vector< sptr< Dictionary::Class > > const & activeDicts_,
-        string const & header ):
+        string const & header, bool synchronous_, unsigned bodyTimeout_ ):
     word( word_ ), group( group_ ), contexts( contexts_ ),
     activeDicts( activeDicts_ ),
-    altsDone( false ), bodyDone( false ), foundAnyDefinitions( false ),
+    altsDone( false ), bodyDone( false ), bodySlotsFlushed( 0 ),
+    bodyTimeout( bodyTimeout_ ), foundAnyDefinitions( false ),
     closePrevSpan( false ),
     currentSplittedWordStart( 0 ),
     currentSplittedWordEnd( 0 ),
-    firstCompoundWasFound( false )
+    firstCompoundWasFound( false ),
+    synchronous( synchronous_ )
 {
     // No need to lock dataMutex on construction
 
@@ -353,12 +533,18 @@ ArticleRequest::ArticleRequest(
     {
         sptr< Dictionary::WordSearchRequest > s = dict->findHeadwordsForSynonym( gd::toWString( word ) );
 
-        connect( s.get(), &Dictionary::WordSearchRequest::finished,
-                 this, &ArticleRequest::altSearchFinished );
+        if ( !synchronous )
+            connect( s.get(), &Dictionary::WordSearchRequest::finished,
+                     this, &ArticleRequest::altSearchFinished );
 
         altSearches.push_back( s );
     }
 
+    // Only wait once all of them are running, so they overlap
+    if ( synchronous )
+        for( const auto & s : altSearches )
+            s->waitUntilFinished();
+
     altSearchFinished(); // Handle any ones which have already finished
 }
 
@@ -399,136 +585,249 @@ void ArticleRequest::altSearchFinished()
 
         wstring wordStd = gd::toWString( word );
 
-        for( const auto & dict : activeDicts )
+        auto contextOf = [ this ]( sptr< Dictionary::Class > const & dict )
+        {
+            return gd::toWString( contexts.value( QString::fromStdString( dict->getId() ) ) );
+        };
+
+        bodySlots.resize( activeDicts.size() );
+
+        for( size_t x = 0; x < activeDicts.size(); ++x )
         {
+            if ( synchronous && !x && !bodyTimeout )
+            {
+                // Looked up below, in this very thread, while the other
+                // dictionaries are busy in the thread pool
+                continue;
+            }
+
             sptr< Dictionary::DataRequest > r =
-                    dict->getArticle( wordStd, altsVector,
-                                      gd::toWString( contexts.value(
-                                                         QString::fromStdString( dict->getId() ) ) ) );
+                    activeDicts[ x ]->getArticle( wordStd, altsVector, contextOf( activeDicts[ x ] ) );
+
+            if ( !synchronous )
+                connect( r.get(), &Dictionary::DataRequest::finished,
+                         this, &ArticleRequest::bodyFinished );
+
+            bodySlots[ x ].request = r;
+        }
+
+        if ( synchronous )
+        {
+            if ( !bodySlots.empty() && !bodySlots.front().request )
+                bodySlots.front().request = activeDicts.front()->getArticleNow(
+                                                wordStd, altsVector, contextOf( activeDicts.front() ) );
+
+            QElapsedTimer elapsed;
+            elapsed.start();
+
+            bool anyLate = false;
+
+            for( const auto & slot : bodySlots )
+            {
+                if ( !bodyTimeout )
+                    slot.request->waitUntilFinished();
+                else
+                {
+                    qint64 left = qint64( bodyTimeout ) - elapsed.elapsed();
 
-            connect( r.get(), &Dictionary::DataRequest::finished,
-                     this, &ArticleRequest::bodyFinished );
+                    if ( !slot.request->waitUntilFinished( left > 0 ? left : 0 ) )
+                        anyLate = true;
+                }
+            }
 
-            bodyRequests.push_back( r );
+            if ( anyLate )
+                bodyTimedOut();
         }
+        else
+        if ( bodyTimeout )
+            QTimer::singleShot( bodyTimeout, this, &ArticleRequest::bodyTimedOut );
 
         bodyFinished(); // Handle any ones which have already finished
     }
 }
 
-void ArticleRequest::bodyFinished()
+void ArticleRequest::renderBody( size_t index, QString const & errorString, long dataSize,
+                                 bool flushedNext )
 {
-    if ( bodyDone )
-        return;
+    BodySlot & slot = bodySlots[ index ];
+
+    slot.ready = true;
+
+    if ( dataSize < 0 && errorString.isEmpty() )
+        return; // No article there
+
+    sptr< Dictionary::Class > const & activeDict = activeDicts[ index ];
 
-    //printf( "some body finished\n" );
+    // The start of the article depends on whether there are any articles
+    // before it, so it's only added when it's moved to 'data'
+    string & head = slot.html;
 
-    bool wasUpdated = false;
+    head = R"(" id="gdfrom-)";
+    string jsVal = Html::escapeForJavaScript( activeDict->getId() );
+
+    head += Html::escape( activeDict->getId() );
+    head += R"(" onClick="gdMakeArticleActive( ')";
+    head += jsVal;
+    head += R"(' );" onContextMenu="gdMakeArticleActive( ')";
+    head += jsVal;
+    head += R"(' );">)";
+
+    head += string( R"(<div class="gddictname"><span class="gdfromprefix">)" );
+    head += Html::escape( QString( "From " ).toUtf8().constData() );
+    head += "</span>";
+    head += Html::escape( activeDict->getName() );
+
+    head += R"(</div><span class="gdarticlebody gdlangfrom-)";
+    head += LangCoder::intToCode2( activeDict->getLangFrom() ).toLatin1().constData();
+    head += R"(" lang=")";
+    head += LangCoder::intToCode2( activeDict->getLangTo() ).toLatin1().constData();
+    head += R"(">)";
+
+    if ( errorString.size() )
+    {
+        head += R"(<div class="gderrordesc">)";
+        head += Html::escape( QString( "Query error: %1" )
+                              .arg( errorString ).toUtf8().constData() );
+        head += "</div>";
+    }
 
-    while ( !bodyRequests.empty() )
+    if ( dataSize > 0 )
     {
-        // Since requests should go in order, check the first one first
-        if ( bodyRequests.front()->isFinished() )
+        if ( flushedNext )
+            slot.dataLeft = dataSize;
+        else
         {
-            // Good
+            size_t headSize = head.size();
 
-            //printf( "one finished.\n" );
+            head.resize( headSize + dataSize );
 
-            Dictionary::DataRequest & req = *bodyRequests.front();
+            slot.request->getDataSlice( 0, dataSize, &head.front() + headSize );
+        }
+    }
 
-            QString errorString = req.getErrorString();
+    slot.found = true;
+}
 
-            if ( req.dataSize() >= 0 || errorString.size() )
-            {
-                sptr< Dictionary::Class > const & activeDict =
-                        activeDicts[ activeDicts.size() - bodyRequests.size() ];
+void ArticleRequest::bodyFinished()
+{
+    // The late requests are still connected here, so this is where they're
+    // let go of once finished
+    lateRequests.remove_if( []( sptr< Dictionary::DataRequest > const & r )
+                            { return r->isFinished(); } );
 
-                string dictId = activeDict->getId();
+    if ( bodyDone )
+        return;
 
-                string head;
+    // Render every article whose request has finished, whatever the order
+    // they finish in, so that a slow dictionary doesn't hold the rest back.
+    // The ones with nothing pending before them are moved to 'data' right
+    // below, so their data goes there directly
+    bool inOrder = true;
 
-                string gdFrom = "gdfrom-" + Html::escape( dictId );
+    for( size_t x = bodySlotsFlushed; x < bodySlots.size(); ++x )
+    {
+        BodySlot & slot = bodySlots[ x ];
 
-                if ( closePrevSpan )
-                {
-                    head += R"(</span></span><span class="gdarticleseparator"></span>)";
-                }
-                else
-                {
-                    // This is the first article
-                    head += R"(<script language="JavaScript">var gdCurrentArticle=")";
-                    head += gdFrom;
-                    head += R"(";</script>)";
-                }
+        if ( !slot.ready && slot.request->isFinished() )
+        {
+            renderBody( x, slot.request->getErrorString(), slot.request->dataSize(), inOrder );
 
-                string jsVal = Html::escapeForJavaScript( dictId );
-                head += R"(<script language="JavaScript">var gdArticleContents; )";
-                head += R"(if ( !gdArticleContents ) gdArticleContents = ")";
-                head += jsVal;
-                head += R"( "; else gdArticleContents += ")";
-                head += jsVal;
-                head += R"( ";</script>)";
-
-                head += R"(<span class="gdarticle)";
-                if ( !closePrevSpan )
-                    head += " gdactivearticle";
-                head += R"(" id=")";
-                head += gdFrom;
-                head += R"(" onClick="gdMakeArticleActive( ')";
-                head += jsVal;
-                head += R"(' );" onContextMenu="gdMakeArticleActive( ')";
-                head += jsVal;
-                head += R"(' );">)";
-
-                closePrevSpan = true;
-
-                head += string( R"(<div class="gddictname"><span class="gdfromprefix">)" );
-                head += Html::escape( QString( "From " ).toUtf8().constData() );
-                head += "</span>";
-                head += Html::escape( activeDict->getName() );
-
-                head += R"(</div><span class="gdarticlebody gdlangfrom-)";
-                head += LangCoder::intToCode2( activeDict->getLangFrom() ).toLatin1().constData();
-                head += R"(" lang=")";
-                head += LangCoder::intToCode2( activeDict->getLangTo() ).toLatin1().constData();
-                head += R"(">)";
-
-                if ( errorString.size() )
-                {
-                    head += R"(<div class="gderrordesc">)";
-                    head += Html::escape( QString( "Query error: %1" )
-                                          .arg( errorString ).toUtf8().constData() );
-                    head += "</div>";
-                }
+            if ( !slot.dataLeft )
+                slot.request.reset();
+        }
+
+        inOrder = inOrder && slot.ready;
+    }
 
-                Mutex::Lock _( dataMutex );
+    // Then move to 'data' the ones which have nothing pending before them, so
+    // the articles still go in the order of the dictionaries
 
-                size_t offset = data.size();
+    vector< string > starts; // The start of each article moved
+    size_t firstToFlush = bodySlotsFlushed, totalSize = 0;
 
-                data.resize( data.size() + head.size() + ( req.dataSize() > 0 ? req.dataSize() : 0 ) );
+    for( ; bodySlotsFlushed < bodySlots.size() && bodySlots[ bodySlotsFlushed ].ready;
+         ++bodySlotsFlushed )
+    {
+        BodySlot const & slot = bodySlots[ bodySlotsFlushed ];
 
-                memcpy( &data.front() + offset, head.data(), head.size() );
+        if ( !slot.found )
+            continue;
 
-                if ( req.dataSize() > 0 )
-                    bodyRequests.front()->getDataSlice( 0, req.dataSize(),
-                                                        &data.front() + offset + head.size() );
+        string gdFrom = "gdfrom-" + Html::escape( activeDicts[ bodySlotsFlushed ]->getId() );
+        string jsVal = Html::escapeForJavaScript( activeDicts[ bodySlotsFlushed ]->getId() );
 
-                wasUpdated = true;
+        string head;
 
-                foundAnyDefinitions = true;
-            }
-            //printf( "erasing..\n" );
-            bodyRequests.pop_front();
-            //printf( "erase done..\n" );
+        if ( closePrevSpan )
+        {
+            head += R"(</span></span><span class="gdarticleseparator"></span>)";
         }
         else
         {
-            //printf( "one not finished.\n" );
-            break;
+            // This is the first article
+            head += R"(<script language="JavaScript">var gdCurrentArticle=")";
+            head += gdFrom;
+            head += R"(";</script>)";
+        }
+
+        head += R"(<script language="JavaScript">var gdArticleContents; )";
+        head += R"(if ( !gdArticleContents ) gdArticleContents = ")";
+        head += jsVal;
+        head += R"( "; else gdArticleContents += ")";
+        head += jsVal;
+        head += R"( ";</script>)";
+
+        head += R"(<span class="gdarticle)";
+        if ( !closePrevSpan )
+            head += " gdactivearticle";
+
+        closePrevSpan = true;
+
+        totalSize += head.size() + slot.html.size() + slot.dataLeft;
+        starts.push_back( head );
+    }
+
+    if ( !starts.empty() )
+    {
+        Mutex::Lock _( dataMutex );
+
+        size_t offset = data.size();
+
+        data.resize( data.size() + totalSize );
+
+        auto start = starts.cbegin();
+
+        for( size_t x = firstToFlush; x < bodySlotsFlushed; ++x )
+        {
+            BodySlot & slot = bodySlots[ x ];
+
+            if ( !slot.found )
+                continue;
+
+            memcpy( &data.front() + offset, start->data(), start->size() );
+            offset += start->size();
+            ++start;
+
+            if ( slot.html.size() )
+                memcpy( &data.front() + offset, slot.html.data(), slot.html.size() );
+            offset += slot.html.size();
+
+            string().swap( slot.html );
+
+            if ( slot.dataLeft )
+            {
+                slot.request->getDataSlice( 0, slot.dataLeft, &data.front() + offset );
+                offset += slot.dataLeft;
+
+                slot.dataLeft = 0;
+                slot.request.reset();
+            }
         }
+
+        foundAnyDefinitions = true;
     }
 
-    if ( bodyRequests.empty() )
+    if ( bodySlotsFlushed == bodySlots.size() )
     {
         // No requests left, end the article
 
@@ -554,8 +853,11 @@ void ArticleRequest::bodyFinished()
                 // When there were no definitions, we run stemmed search.
                 stemmedWordFinder = new WordFinder( this );
 
-                connect( stemmedWordFinder.get(), &WordFinder::finished,
-                         this, &ArticleRequest::stemmedSearchFinished, Qt::QueuedConnection );
+                if ( synchronous )
+                    stemmedWordFinder->setSynchronous( true );
+                else
+                    connect( stemmedWordFinder.get(), &WordFinder::finished,
+                             this, &ArticleRequest::stemmedSearchFinished, Qt::QueuedConnection );
 
                 stemmedWordFinder->stemmedMatch( word, activeDicts );
             }
@@ -574,15 +876,46 @@ void ArticleRequest::bodyFinished()
         }
 
         if ( stemmedWordFinder )
+        {
             update();
+
+            if ( synchronous )
+                stemmedSearchFinished(); // The search is done already
+        }
         else
             finish();
     }
     else
-        if ( wasUpdated )
+        if ( !starts.empty() )
             update();
 }
 
+void ArticleRequest::bodyTimedOut()
+{
+    if ( bodyDone )
+        return;
+
+    // Whatever hasn't finished by now is given up on, so that the articles
+    // after it can go on
+    for( size_t x = bodySlotsFlushed; x < bodySlots.size(); ++x )
+    {
+        BodySlot & slot = bodySlots[ x ];
+
+        if ( !slot.ready && !slot.request->isFinished() )
+        {
+            slot.request->cancel();
+
+            renderBody( x, QString( "the dictionary hasn't answered in %1 ms" ).arg( bodyTimeout ),
+                        -1, false );
+
+            lateRequests.push_back( slot.request );
+            slot.request.reset();
+        }
+    }
+
+    bodyFinished();
+}
+
 void ArticleRequest::stemmedSearchFinished()
 {
     // Got stemmed matching results
@@ -616,11 +949,14 @@ void ArticleRequest::stemmedSearchFinished()
 
     if ( splittedWords.first.size() > 1 ) // Contains more than one word
     {
-        disconnect( stemmedWordFinder.get(), &WordFinder::finished,
-                    this, &ArticleRequest::stemmedSearchFinished );
+        if ( !synchronous )
+        {
+            disconnect( stemmedWordFinder.get(), &WordFinder::finished,
+                        this, &ArticleRequest::stemmedSearchFinished );
 
-        connect( stemmedWordFinder.get(), &WordFinder::finished,
-                 this, &ArticleRequest::individualWordFinished, Qt::QueuedConnection );
+            connect( stemmedWordFinder.get(), &WordFinder::finished,
+                     this, &ArticleRequest::individualWordFinished, Qt::QueuedConnection );
+        }
 
         currentSplittedWordStart = -1;
         currentSplittedWordEnd = currentSplittedWordStart;
@@ -646,7 +982,15 @@ void ArticleRequest::stemmedSearchFinished()
     }
 
     if ( continueMatching )
+    {
         update();
+
+        // Each step's search is done by the time it returns, so just keep
+        // on stepping until the last one finishes the request
+        if ( synchronous )
+            while( !isFinished() )
+                individualWordFinished();
+    }
     else
         finish();
 }
@@ -21,9 +21,19 @@
 #include "sptr.hh"
 #include "dictionary.hh"
 #include "wordfinder.hh"
+#include "codec.hh"
+#include "metrics.hh"
+#include "batchlookup.hh"
 
 #include "goldendict_global.hh"
 
+struct DictLoadTask;
+
+/// Finds and loads the dictionaries, indexing them if needed. Each dictionary
+/// file is handled by a separate job, and up to maxThreads jobs run at once.
+/// The maxThreads and the memoryLimit are split between the jobs running at
+/// once, so that all of them together stay within those.
+/// The resulting order is the same as if they were all loaded one by one.
 class GOLDENDICT_SHARED_EXPORT CDictLoader : public QThread, public Dictionary::Initializing
 {
     Q_OBJECT
@@ -34,9 +44,18 @@ private:
     std::vector< sptr< Dictionary::Class > > dictionaries;
     std::string exceptionText;
     QString m_dictIndexDir;
+    int maxThreads;
+    size_t memoryLimit;
+    int jobThreads; // The share of maxThreads of each job
+    size_t jobMemoryLimit; // The share of the memory limit of each job
+    std::set< std::string > queuedFiles; // So that each file is handled once
 
 public:
-    CDictLoader(QObject * parent, const QStringList& dictPaths, const QString& dictIndexDir);
+    /// A maxThreads of zero or less means one thread per core. The memoryLimit
+    /// is for the words being indexed, see setIndexingMemoryLimit() of
+    /// CGoldenDictMgr; zero means the indexer's default.
+    CDictLoader(QObject * parent, const QStringList& dictPaths, const QString& dictIndexDir,
+                int maxThreads = 0, size_t memoryLimit = 0);
     virtual void run();
     std::vector< sptr< Dictionary::Class > > const & getDictionaries() const
     { return dictionaries; }
@@ -47,10 +66,26 @@ signals:
     void indexingDictionarySignal( QString const & dictionaryName );
 
 public:
+    /// Called from the loading jobs, possibly from several threads at once.
+    /// It only emits a signal, which is queued to the receivers' threads.
     virtual void indexingDictionary( std::string const & dictionaryName );
 
+    /// Logs the memory the dictionary's words took while it was indexed.
+    void indexedDictionary( std::string const & dictionaryName,
+                            Dictionary::IndexingStats const & ) override;
+
+    /// These give each job its share of the threads and the memory.
+    int indexingThreads() override
+    { return jobThreads; }
+
+    size_t indexingMemoryLimit() override
+    { return jobMemoryLimit; }
+
 private:
-    void handlePath( const QString& path, bool recursive );
+    /// Appends the jobs needed to load all the dictionaries in the given path
+    /// to the given list, in the order the results are to be stored in.
+    void handlePath( const QString& path, bool recursive,
+                     std::vector< DictLoadTask > & tasks );
 };
 
 class GOLDENDICT_SHARED_EXPORT ArticleRequest: public Dictionary::DataRequest
@@ -64,7 +99,29 @@ class GOLDENDICT_SHARED_EXPORT ArticleRequest: public Dictionary::DataRequest
     std::set< gd::wstring > alts; // Accumulated main forms
     std::list< sptr< Dictionary::WordSearchRequest > > altSearches;
     bool altsDone, bodyDone;
-    std::list< sptr< Dictionary::DataRequest > > bodyRequests;
+
+    /// The article of one of the dictionaries. It is rendered into its slot as
+    /// soon as the dictionary's request finishes, and moved to 'data' once all
+    /// the slots before it are, which keeps the order of the dictionaries.
+    struct BodySlot
+    {
+        sptr< Dictionary::DataRequest > request; // Reset once its data is taken
+        std::string html; // All of the article but its start and dataLeft
+        long dataLeft; // The data still to be copied from the request to 'data'
+        bool ready; // Rendered, or known to have no article
+        bool found; // There is an article
+
+        BodySlot(): dataLeft( 0 ), ready( false ), found( false )
+        {}
+    };
+
+    std::vector< BodySlot > bodySlots; // One per each of activeDicts
+    size_t bodySlotsFlushed; // The number of slots already moved to 'data'
+    /// The requests given up on by bodyTimedOut(). Destroying a request which
+    /// is still running waits for it, so they're only let go of once they've
+    /// finished, or else when this request is destroyed.
+    std::list< sptr< Dictionary::DataRequest > > lateRequests;
+    unsigned bodyTimeout; // In ms, zero for none
     bool foundAnyDefinitions;
     bool closePrevSpan; // Indicates whether the last opened article span is to
     // be closed after the article ends.
@@ -84,13 +141,21 @@ class GOLDENDICT_SHARED_EXPORT ArticleRequest: public Dictionary::DataRequest
     QString currentSplittedWordCompound;
     QString lastGoodCompoundResult;
     bool firstCompoundWasFound;
+    bool synchronous;
 
 public:
 
+    /// When synchronous, the whole lookup is done by the constructor, which
+    /// waits for each step instead of being signalled, so the request is
+    /// finished once constructed and no event loop is needed.
+    /// If bodyTimeout is non-zero, the dictionaries which haven't returned
+    /// their articles in that many ms are given up on, getting an error note
+    /// in place of the article, so that the ones after them can be shown.
     ArticleRequest( QString const & word, QString const & group,
                     QMap< QString, QString > const & contexts,
                     std::vector< sptr< Dictionary::Class > > const & activeDicts,
-                    std::string const & header );
+                    std::string const & header, bool synchronous = false,
+                    unsigned bodyTimeout = 0 );
 
     virtual void cancel()
     { finish(); } // Add our own requests cancellation here
@@ -99,11 +164,19 @@ private slots:
 
     void altSearchFinished();
     void bodyFinished();
+    void bodyTimedOut();
     void stemmedSearchFinished();
     void individualWordFinished();
 
 private:
 
+    /// Renders the article of the given body slot. A negative dataSize means
+    /// there's no article data, as with the requests which have failed. If
+    /// the slot is about to be moved to 'data', its data is left in the
+    /// request, to be copied there directly rather than through 'html'.
+    void renderBody( size_t index, QString const & errorString, long dataSize,
+                     bool flushedNext );
+
     /// Appends the given string to 'data', with locking its mutex.
     void appendToData( std::string const & );
 
@@ -132,15 +205,76 @@ public:
     sptr< Dictionary::DataRequest > makeDefinitionFor( QString const & word,
                                                        QMap< QString, QString > const & contexts ) const;
 
+    /// Does the same as makeDefinitionFor(), but synchronously: the request
+    /// returned is already finished and holds the very same html. No event
+    /// loop is needed, so it can be called right from any worker thread.
+    sptr< Dictionary::DataRequest > makeDefinitionNow( QString const & word,
+                                                       QMap< QString, QString > const & contexts ) const;
+
     sptr< Dictionary::DataRequest > makeNotFoundTextFor( QString const & word ) const;
 
     /// Creates an 'untitled' page. The result is guaranteed to be instant.
     sptr< Dictionary::DataRequest > makeEmptyPage() const;
 
+    /// Looks up many words at once in all the dictionaries, for the bulk
+    /// jobs. Returns each word's articles, in the same order as the words.
+    /// The call blocks until all the lookups are done, so it's best made from
+    /// a worker thread. See BatchLookup::lookupArticles().
+    std::vector< std::vector< BatchLookup::Article > >
+    lookupArticles( QStringList const & words ) const;
+
+    /// Finds the headwords exactly matching each of the words, in all the
+    /// dictionaries. Returns a list per word, in the same order as the words.
+    /// Blocks until done, see BatchLookup::findMatches().
+    std::vector< QStringList > findMatches( QStringList const & words ) const;
+
     QStringList getLoadedDictionaries();
 
+    /// Sets the number of threads loadDictionaries() may use, which is also
+    /// the maximum number of dictionaries being indexed at once. Those which
+    /// are indexed at once share the threads. Zero, the default, means one
+    /// per core.
+    void setMaxIndexingThreads( int maxThreads )
+    { m_maxIndexingThreads = maxThreads; }
+
+    /// Sets how much memory, in bytes, the words being indexed by
+    /// loadDictionaries() may take, in total, before they're spilled to
+    /// temporary files. Zero, the default, means 256 MiB.
+    void setIndexingMemoryLimit( size_t bytes )
+    { m_indexingMemoryLimit = bytes; }
+
+    /// Sets how long, in ms, each dictionary is given to return its article
+    /// in the definitions made from now on. The articles are added in the
+    /// order of the dictionaries, so a slow one holds back all the ones
+    /// after it; once it's late, it's skipped, with an error note. Zero, the
+    /// default, means waiting for as long as it takes.
+    void setArticleTimeout( unsigned timeoutMs )
+    { m_articleTimeout = timeoutMs; }
+
+    /// Sets the codec the indexes created from now on are compressed with.
+    /// The existing indexes are read with whatever codec they were written
+    /// with. Returns false if the codec isn't built in.
+    bool setIndexCodec( Codec::Type codec )
+    { return Codec::setIndexCodec( codec ); }
+
+    /// Returns the lookup metrics of the given dictionary: its index node
+    /// and chunk reads, cache hits, lock waits and so on. They're all zero
+    /// if the library was built with CONFIG+=no_metrics.
+    Metrics::Snapshot getDictionaryMetrics( QString const & dictionaryId ) const;
+
+    /// Dumps the metrics of all the dictionaries as a plain text table, or
+    /// as a JSON document if asJson is true.
+    QString dumpMetrics( bool asJson = false ) const;
+
+    /// Zeroes the metrics of all the dictionaries.
+    void resetMetrics()
+    { Metrics::reset(); }
+
 private:
     QString m_dictIndexDir;
+    int m_maxIndexingThreads;
+    size_t m_indexingMemoryLimit;
+    unsigned m_articleTimeout;
     std::string makeHtmlHeader( QString const & word ) const;
     static std::string makeNotFoundBody( QString const & word );
 
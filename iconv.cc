@@ -3,6 +3,9 @@
 
 #include "iconv.hh"
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <string>
 #include <cerrno>
 #include <cstring>
 
@@ -37,6 +40,61 @@ Iconv::~Iconv()
     iconv_close( state );
 }
 
+void Iconv::reset()
+{
+    iconv( state, nullptr, nullptr, nullptr, nullptr );
+}
+
+namespace {
+
+/// A converter kept open by getCachedIconv().
+struct CachedIconv
+{
+    std::string to, from;
+    std::unique_ptr< Iconv > iconv;
+};
+
+/// Returns a converter between the given encodings, reset to its initial
+/// state. The converters are kept open per thread, as opening one costs much
+/// more than converting the short blocks, like articles or file names, that
+/// they are normally used for.
+Iconv & getCachedIconv( char const * to, char const * from )
+{
+    // There are only a few pairs in use, so the least recently used one is
+    // only dropped if there are many
+    size_t const MaxCached = 8;
+
+    static thread_local std::vector< CachedIconv > cache;
+
+    for( size_t x = 0; x < cache.size(); ++x )
+        if ( cache[ x ].to == to && cache[ x ].from == from )
+        {
+            // Keep the most recently used ones at the end
+            std::rotate( cache.begin() + x, cache.begin() + x + 1, cache.end() );
+
+            Iconv & result = *cache.back().iconv;
+
+            result.reset();
+
+            return result;
+        }
+
+    CachedIconv made;
+
+    made.to = to;
+    made.from = from;
+    made.iconv.reset( new Iconv( to, from ) );
+
+    if ( cache.size() >= MaxCached )
+        cache.erase( cache.begin() );
+
+    cache.push_back( std::move( made ) );
+
+    return *cache.back().iconv;
+}
+
+}
+
 Iconv::Result Iconv::convert( void const * & inBuf, size_t  & inBytesLeft,
                               void * & outBuf, size_t & outBytesLeft )
 {
@@ -72,7 +130,7 @@ gd::wstring Iconv::toWstring( char const * fromEncoding, void const * fromData,
     if ( !dataSize )
         return gd::wstring();
 
-    Iconv ic( GdWchar, fromEncoding );
+    Iconv & ic = getCachedIconv( GdWchar, fromEncoding );
 
     /// This size is usually enough, but may be enlarged during the conversion
     std::vector< wchar > outBuf( dataSize );
@@ -111,7 +169,7 @@ std::string Iconv::toUtf8( char const * fromEncoding, void const * fromData,
     if ( !dataSize )
         return std::string();
 
-    Iconv ic( Utf8, fromEncoding );
+    Iconv & ic = getCachedIconv( Utf8, fromEncoding );
 
     std::vector< char > outBuf( dataSize );
 
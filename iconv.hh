@@ -32,6 +32,10 @@ public:
   // Changes to another pair of encodings. All the internal state is reset.
   void reinit( char const * to, char const * from );
 
+  // Resets the internal state, so that the next conversion starts afresh,
+  // just as with a newly opened converter.
+  void reset();
+
   ~Iconv();
 
   enum Result
@@ -45,6 +49,8 @@ public:
                   void * & outBuf, size_t & outBytesLeft );
 
   // Converts a given block of data from the given encoding to a wide string.
+  // This and toUtf8() reuse the converters they open, keeping them per
+  // thread, so calling them for many short blocks is cheap.
   static gd::wstring toWstring( char const * fromEncoding, void const * fromData,
                                  size_t dataSize );
 
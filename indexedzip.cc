@@ -17,6 +17,15 @@ bool IndexedZip::openZipFile( QString const & name )
 
     zipIsOpen = zip.open( QFile::ReadOnly );
 
+    zipData = nullptr;
+    zipSize = 0;
+
+    if ( zipIsOpen )
+    {
+        zipSize = zip.size();
+        zipData = zip.map( 0, zipSize );
+    }
+
     return zipIsOpen;
 }
 
@@ -66,12 +75,26 @@ bool IndexedZip::loadFile( gd::wstring const & name, vector< char > & data )
         {
             //printf( "Deflated\n" );
 
-            // Now do the deflation
+            // Now do the deflation. If the zip is mapped, inflate right from
+            // the mapping, otherwise read the compressed data in first.
 
-            QByteArray compressedData = zip.read( header.compressedSize );
+            QByteArray compressedData;
+            Bytef const * compressed;
 
-            if ( compressedData.size() != static_cast<int>(header.compressedSize) )
-                return false;
+            qint64 dataOffset = zip.pos();
+
+            if ( zipData && dataOffset <= zipSize &&
+                 header.compressedSize <= zipSize - dataOffset )
+                compressed = zipData + dataOffset;
+            else
+            {
+                compressedData = zip.read( header.compressedSize );
+
+                if ( compressedData.size() != static_cast<int>(header.compressedSize) )
+                    return false;
+
+                compressed = reinterpret_cast< Bytef const * >( compressedData.constData() );
+            }
 
             data.resize( header.uncompressedSize );
 
@@ -79,8 +102,8 @@ bool IndexedZip::loadFile( gd::wstring const & name, vector< char > & data )
 
             memset( &stream, 0, sizeof( stream ) );
 
-            stream.next_in = reinterpret_cast< Bytef *>(compressedData.data());
-            stream.avail_in = compressedData.size();
+            stream.next_in = const_cast< Bytef * >( compressed );
+            stream.avail_in = header.compressedSize;
             stream.next_out = reinterpret_cast< Bytef *>(&data.front());
             stream.avail_out = data.size();
 
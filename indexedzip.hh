@@ -13,16 +13,20 @@ class IndexedZip: public BtreeIndexing::BtreeIndex
 {
   QFile zip;
   bool zipIsOpen;
+  uchar const * zipData; // The whole zip file, if it could be mapped
+  qint64 zipSize;
 
 public:
 
-  IndexedZip(): zipIsOpen( false )
+  IndexedZip(): zipIsOpen( false ), zipData( 0 ), zipSize( 0 )
   {}
 
   /// Opens the index. The values are those previously returned by buildIndex().
   using BtreeIndexing::BtreeIndex::openIndex;
 
   /// Opens the zip file itself. Returns true if succeeded, false otherwise.
+  /// The file gets memory-mapped if possible, so that the compressed data
+  /// could be inflated without copying it first.
   bool openZipFile( QString const & );
 
   /// Returns true if the zip is open, false otherwise.
@@ -0,0 +1,379 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+#include "metrics.hh"
+
+#include <memory>
+#include <cstdio>
+#include <cmath>
+
+namespace Metrics {
+
+namespace {
+
+struct ProbeInfo
+{
+    char const * name;
+    bool timed;
+};
+
+ProbeInfo const probeInfo[ ProbeCount ] = {
+    { "indexNodeRead", true },
+    { "indexNodeCacheHit", false },
+    { "chunkRead", true },
+    { "chunkCacheHit", false },
+    { "articleRead", true },
+    { "folding", true },
+    { "articleRender", true },
+    { "lockWait", true }
+};
+
+/// All the sets, by the dictionaries' ids. The sets are never deleted, so
+/// the references to them stay valid.
+struct Registry
+{
+    Mutex mutex;
+    std::map< string, std::unique_ptr< Set > > sets;
+};
+
+Registry & registry()
+{
+    static Registry instance;
+
+    return instance;
+}
+
+unsigned bucketOf( uint64_t nanoseconds )
+{
+    unsigned bucket = 0;
+
+    while( nanoseconds >>= 1 )
+        ++bucket;
+
+    return bucket < HistogramBuckets ? bucket : HistogramBuckets - 1;
+}
+
+string jsonEscape( string const & str )
+{
+    string result;
+
+    for( char c : str )
+    {
+        if ( c == '"' || c == '\\' )
+        {
+            result.push_back( '\\' );
+            result.push_back( c );
+        }
+        else
+        if ( static_cast< unsigned char >( c ) < 0x20 )
+        {
+            char buf[ 8 ];
+            snprintf( buf, sizeof( buf ), "\\u%04x", c );
+            result += buf;
+        }
+        else
+            result.push_back( c );
+    }
+
+    return result;
+}
+
+string number( uint64_t value )
+{
+    char buf[ 24 ];
+
+    snprintf( buf, sizeof( buf ), "%llu", static_cast< unsigned long long >( value ) );
+
+    return buf;
+}
+
+/// Formats nanoseconds as microseconds, with three decimals.
+string microseconds( uint64_t nanoseconds )
+{
+    char buf[ 32 ];
+
+    snprintf( buf, sizeof( buf ), "%.3f", nanoseconds / 1000.0 );
+
+    return buf;
+}
+
+bool hasAny( Snapshot const & snapshot )
+{
+    for( auto const & probe : snapshot.probes )
+        if ( probe.count )
+            return true;
+
+    return false;
+}
+
+}
+
+uint64_t ProbeStats::percentileNs( double fraction ) const
+{
+    uint64_t total = 0;
+
+    for( auto bucket : buckets )
+        total += bucket;
+
+    if ( !total )
+        return 0;
+
+    // The rank of the sample, counting from one
+    uint64_t rank = static_cast< uint64_t >( std::ceil( fraction * total ) );
+
+    if ( rank < 1 )
+        rank = 1;
+
+    uint64_t seen = 0;
+
+    for( unsigned x = 0; x < HistogramBuckets; ++x )
+    {
+        seen += buckets[ x ];
+
+        if ( seen >= rank )
+            return ( uint64_t( 2 ) << x ) - 1;
+    }
+
+    return ( uint64_t( 2 ) << ( HistogramBuckets - 1 ) ) - 1;
+}
+
+char const * name( Probe probe )
+{
+    return probeInfo[ probe ].name;
+}
+
+bool isTimed( Probe probe )
+{
+    return probeInfo[ probe ].timed;
+}
+
+Set::Set()
+{
+    reset();
+}
+
+void Set::record( Probe probe, uint64_t nanoseconds )
+{
+    Counter & counter = counters[ probe ];
+
+    counter.count.fetch_add( 1, std::memory_order_relaxed );
+    counter.totalNs.fetch_add( nanoseconds, std::memory_order_relaxed );
+    counter.buckets[ bucketOf( nanoseconds ) ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+Snapshot Set::getSnapshot() const
+{
+    Snapshot result;
+
+    for( unsigned x = 0; x < ProbeCount; ++x )
+    {
+        Counter const & counter = counters[ x ];
+        ProbeStats & stats = result.probes[ x ];
+
+        stats.count = counter.count.load( std::memory_order_relaxed );
+        stats.totalNs = counter.totalNs.load( std::memory_order_relaxed );
+
+        for( unsigned y = 0; y < HistogramBuckets; ++y )
+            stats.buckets[ y ] = counter.buckets[ y ].load( std::memory_order_relaxed );
+    }
+
+    return result;
+}
+
+void Set::reset()
+{
+    for( auto & counter : counters )
+    {
+        counter.count.store( 0, std::memory_order_relaxed );
+        counter.totalNs.store( 0, std::memory_order_relaxed );
+
+        for( auto & bucket : counter.buckets )
+            bucket.store( 0, std::memory_order_relaxed );
+    }
+}
+
+Set & forDictionary( string const & id )
+{
+    Registry & r = registry();
+
+    Mutex::Lock _( r.mutex );
+
+    std::unique_ptr< Set > & set = r.sets[ id ];
+
+    if ( !set )
+        set.reset( new Set );
+
+    return *set;
+}
+
+bool isEnabled()
+{
+#ifndef NO_METRICS
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::map< string, Snapshot > getSnapshots()
+{
+    Registry & r = registry();
+
+    Mutex::Lock _( r.mutex );
+
+    std::map< string, Snapshot > result;
+
+    for( auto const & i : r.sets )
+        result[ i.first ] = i.second->getSnapshot();
+
+    return result;
+}
+
+Snapshot getSnapshot( string const & id )
+{
+    Registry & r = registry();
+
+    Mutex::Lock _( r.mutex );
+
+    auto i = r.sets.find( id );
+
+    return i != r.sets.end() ? i->second->getSnapshot() : Snapshot();
+}
+
+void reset()
+{
+    Registry & r = registry();
+
+    Mutex::Lock _( r.mutex );
+
+    for( auto const & i : r.sets )
+        i.second->reset();
+}
+
+string dumpText( std::map< string, string > const & names )
+{
+    string result;
+
+    if ( !isEnabled() )
+        return "The metrics are compiled out.\n";
+
+    char line[ 160 ];
+
+    for( auto const & i : getSnapshots() )
+    {
+        if ( !hasAny( i.second ) )
+            continue;
+
+        auto nameIter = names.find( i.first );
+
+        result += i.first;
+
+        if ( nameIter != names.end() )
+            result += " (" + nameIter->second + ")";
+
+        result += ":\n";
+
+        for( unsigned x = 0; x < ProbeCount; ++x )
+        {
+            ProbeStats const & stats = i.second.probes[ x ];
+
+            if ( !stats.count )
+                continue;
+
+            if ( isTimed( Probe( x ) ) )
+                snprintf( line, sizeof( line ),
+                          "  %-18s %12llu  mean %10s us  p50 %10s us  p99 %10s us\n",
+                          name( Probe( x ) ), static_cast< unsigned long long >( stats.count ),
+                          microseconds( stats.totalNs / stats.count ).c_str(),
+                          microseconds( stats.percentileNs( 0.5 ) ).c_str(),
+                          microseconds( stats.percentileNs( 0.99 ) ).c_str() );
+            else
+                snprintf( line, sizeof( line ), "  %-18s %12llu\n", name( Probe( x ) ),
+                          static_cast< unsigned long long >( stats.count ) );
+
+            result += line;
+        }
+    }
+
+    return result;
+}
+
+string dumpJson( std::map< string, string > const & names )
+{
+    string result = "{\"enabled\":";
+
+    result += isEnabled() ? "true" : "false";
+    result += ",\"dictionaries\":[";
+
+    bool firstDictionary = true;
+
+    for( auto const & i : getSnapshots() )
+    {
+        if ( !hasAny( i.second ) )
+            continue;
+
+        if ( !firstDictionary )
+            result += ',';
+
+        firstDictionary = false;
+
+        result += "{\"id\":\"" + jsonEscape( i.first ) + "\"";
+
+        auto nameIter = names.find( i.first );
+
+        if ( nameIter != names.end() )
+            result += ",\"name\":\"" + jsonEscape( nameIter->second ) + "\"";
+
+        result += ",\"probes\":{";
+
+        bool firstProbe = true;
+
+        for( unsigned x = 0; x < ProbeCount; ++x )
+        {
+            ProbeStats const & stats = i.second.probes[ x ];
+
+            if ( !firstProbe )
+                result += ',';
+
+            firstProbe = false;
+
+            result += string( "\"" ) + name( Probe( x ) ) + "\":{\"count\":" + number( stats.count );
+
+            if ( isTimed( Probe( x ) ) )
+            {
+                result += ",\"totalNs\":" + number( stats.totalNs );
+                result += ",\"p50Ns\":" + number( stats.percentileNs( 0.5 ) );
+                result += ",\"p90Ns\":" + number( stats.percentileNs( 0.9 ) );
+                result += ",\"p99Ns\":" + number( stats.percentileNs( 0.99 ) );
+
+                // The histogram is trimmed after the last non-empty bucket
+                unsigned used = HistogramBuckets;
+
+                while( used && !stats.buckets[ used - 1 ] )
+                    --used;
+
+                result += ",\"histogram\":[";
+
+                for( unsigned y = 0; y < used; ++y )
+                {
+                    if ( y )
+                        result += ',';
+
+                    result += number( stats.buckets[ y ] );
+                }
+
+                result += "]";
+            }
+
+            result += "}";
+        }
+
+        result += "}}";
+    }
+
+    result += "]}";
+
+    return result;
+}
+
+}
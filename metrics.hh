@@ -0,0 +1,206 @@
+/* This file is part of GoldenDict. Licensed under GPLv3 or later, see the
+ * LICENSE file */
+
+#ifndef __METRICS_HH_INCLUDED__
+#define __METRICS_HH_INCLUDED__
+
+#include "mutex.hh"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+
+#include <cstdint>
+
+/// Counters and latency histograms of the lookups' hot paths, kept per
+/// dictionary. The recording is done through the GD_METRICS_* macros below,
+/// which compile to nothing when built with CONFIG+=no_metrics, so that the
+/// hot paths are left untouched then. The registry itself is always there,
+/// it just stays empty.
+namespace Metrics {
+
+using std::string;
+
+/// The things measured. The values index the name table in metrics.cc.
+enum Probe
+{
+  IndexNodeRead,     // A btree node read and uncompressed, timed
+  IndexNodeCacheHit, // A btree node taken from the node cache
+  ChunkRead,         // A chunk read and uncompressed, timed
+  ChunkCacheHit,     // A chunk taken from the chunk cache
+  ArticleRead,       // An article read from the dictionary file, timed
+  Folding,           // Folding of a word looked up, timed
+  ArticleRender,     // Conversion of an article to html, timed
+  LockWait,          // Waiting on a contended cache lock, timed
+  ProbeCount
+};
+
+enum
+{
+  /// Bucket x of a histogram counts the durations of [ 2^x, 2^(x+1) ) ns,
+  /// with the last one taking everything longer.
+  HistogramBuckets = 32
+};
+
+/// A point-in-time copy of a single probe's numbers.
+struct ProbeStats
+{
+  uint64_t count;
+  uint64_t totalNs; // Zero for the probes which aren't timed
+  uint64_t buckets[ HistogramBuckets ];
+
+  /// Estimates the given percentile, 0..1, from the histogram. The result is
+  /// the upper bound of the bucket it falls into, in nanoseconds.
+  uint64_t percentileNs( double ) const;
+};
+
+/// The numbers of all the probes of a dictionary.
+struct Snapshot
+{
+  ProbeStats probes[ ProbeCount ];
+};
+
+/// Returns the probe's name, as used in the dumps.
+char const * name( Probe );
+
+/// Returns true if the probe measures durations rather than just counts.
+bool isTimed( Probe );
+
+/// The metrics of a single dictionary. All the functions are thread-safe and
+/// lock-free.
+class Set
+{
+public:
+
+  Set();
+
+  /// Counts an occurrence of the probe.
+  void add( Probe probe )
+  { counters[ probe ].count.fetch_add( 1, std::memory_order_relaxed ); }
+
+  /// Counts an occurrence of the probe which took the given time.
+  void record( Probe, uint64_t nanoseconds );
+
+  Snapshot getSnapshot() const;
+
+  void reset();
+
+private:
+
+  struct Counter
+  {
+    std::atomic< uint64_t > count, totalNs;
+    std::atomic< uint64_t > buckets[ HistogramBuckets ];
+  };
+
+  Counter counters[ ProbeCount ];
+
+  Set( Set const & );
+};
+
+/// Returns the metrics of the dictionary with the given id, creating them
+/// if there are none yet. The reference stays valid for the whole lifetime
+/// of the program, so it is normally looked up just once per dictionary.
+Set & forDictionary( string const & id );
+
+/// Returns false if the library was built with the metrics compiled out.
+bool isEnabled();
+
+/// Returns the snapshots of all the dictionaries, by their ids.
+std::map< string, Snapshot > getSnapshots();
+
+/// Returns the snapshot of the dictionary with the given id, or an empty one
+/// if it has no metrics. Unlike forDictionary(), creates nothing.
+Snapshot getSnapshot( string const & id );
+
+/// Zeroes the metrics of all the dictionaries.
+void reset();
+
+/// These dump the metrics of all the dictionaries that have any, as a plain
+/// text table or as a JSON document. The names, if given, map the
+/// dictionaries' ids to their names, which are added to the output.
+string dumpText( std::map< string, string > const & names = std::map< string, string >() );
+string dumpJson( std::map< string, string > const & names = std::map< string, string >() );
+
+/// Records the time from its construction to its destruction to the given
+/// set, if there's one. Use GD_METRICS_TIME rather than this directly.
+class Timer
+{
+  Set * set;
+  Probe probe;
+  std::chrono::steady_clock::time_point start;
+
+public:
+
+  Timer( Set * set_, Probe probe_ ): set( set_ ), probe( probe_ )
+  {
+    if ( set )
+      start = std::chrono::steady_clock::now();
+  }
+
+  ~Timer()
+  {
+    if ( set )
+      set->record( probe, std::chrono::duration_cast< std::chrono::nanoseconds >(
+                            std::chrono::steady_clock::now() - start ).count() );
+  }
+
+private:
+  Timer( Timer const & );
+};
+
+/// Works like Mutex::Lock, additionally recording the time spent waiting for
+/// the mutex as LockWait, if the mutex was contended. Uncontended locking
+/// costs the same as with Mutex::Lock.
+class Lock
+{
+  Mutex & m;
+
+public:
+
+#ifndef NO_METRICS
+  Lock( Mutex & m_, Set * set ): m( m_ )
+  {
+    if ( !m.tryLock() )
+    {
+      Timer _( set, LockWait );
+      m.lock();
+    }
+  }
+#else
+  Lock( Mutex & m_, Set * ): m( m_ )
+  { m.lock(); }
+#endif
+
+  ~Lock()
+  { m.unlock(); }
+
+private:
+  Lock( Lock const & );
+};
+
+}
+
+#define GD_METRICS_CONCAT2( a, b ) a##b
+#define GD_METRICS_CONCAT( a, b ) GD_METRICS_CONCAT2( a, b )
+
+#ifndef NO_METRICS
+
+/// Counts an occurrence of the probe in the set, which may be null.
+#define GD_METRICS_ADD( set, probe ) \
+  do { Metrics::Set * gdMetricsSet = ( set ); \
+       if ( gdMetricsSet ) gdMetricsSet->add( Metrics::probe ); } while( 0 )
+
+/// Times the rest of the enclosing scope as the given probe.
+#define GD_METRICS_TIME( set, probe ) \
+  Metrics::Timer GD_METRICS_CONCAT( gdMetricsTimer, __LINE__ )( ( set ), Metrics::probe )
+
+#else
+
+#define GD_METRICS_ADD( set, probe ) do {} while( 0 )
+#define GD_METRICS_TIME( set, probe ) do {} while( 0 )
+
+#endif
+
+#endif
@@ -4,30 +4,82 @@
 #ifndef __SPTR_HH_INCLUDED__
 #define __SPTR_HH_INCLUDED__
 
-// A generic non-intrusive smart-pointer template. We could use boost::, tr1::
+#include <atomic>
+#include <type_traits>
+
+// A generic smart-pointer template. We could use boost::, tr1::
 // or whatever, but since there's no standard solution yet, it isn't worth
 // the dependency given the simplicity of the template.
+//
+// The reference counting is atomic, so the pointers to the same object can
+// be copied and destroyed from different threads. Objects derived from
+// sptr_counted keep their reference count inside, so they cost no extra
+// allocation. For any other objects, the count is allocated separately.
+
+/// Derive from this to have the sptr's reference count stored in the object
+/// itself.
+class sptr_counted
+{
+  template< class TT > friend class sptr_base;
+
+  std::atomic< unsigned > sptrCount;
+
+protected:
+
+  sptr_counted(): sptrCount( 0 ) {}
+
+  // The count belongs to the object's identity, so it is never copied
+  sptr_counted( sptr_counted const & ): sptrCount( 0 ) {}
+
+  sptr_counted & operator = ( sptr_counted const & )
+  { return *this; }
+};
 
 template< class T >
 class sptr_base
 {
   template< class TT > friend class sptr_base;
 
-  T * p;
-  unsigned * count;
+  typedef std::atomic< unsigned > Count;
 
+  enum { Intrusive = std::is_base_of< sptr_counted, T >::value };
+
+  T * p;
+  Count * count;
 
   void increment()
   {
     if ( count )
-      ++*count;
+      count->fetch_add( 1, std::memory_order_relaxed );
+  }
+
+  static Count * countFor( T * p_, std::true_type )
+  {
+    if ( !p_ )
+      return 0;
+
+    Count * c = &static_cast< sptr_counted * >( p_ )->sptrCount;
+
+    c->fetch_add( 1, std::memory_order_relaxed );
+
+    return c;
   }
 
+  static Count * countFor( T * p_, std::false_type )
+  { return p_ ? new Count( 1 ) : 0; }
+
+  static void deleteCount( Count * c, std::true_type )
+  { (void) c; }
+
+  static void deleteCount( Count * c, std::false_type )
+  { delete c; }
+
 public:
 
   sptr_base(): p( 0 ), count( 0 ) {}
 
-  sptr_base( T * p_ ): p( p_ ), count( p ? new unsigned( 1 ) : 0 )
+  sptr_base( T * p_ ): p( p_ ),
+    count( countFor( p_, std::integral_constant< bool, Intrusive >() ) )
   {
   }
 
@@ -38,37 +90,33 @@ public:
   template< class TT >
   sptr_base( sptr_base< TT > const & other ): p( ( T * ) other.p ),
     count( other.count )
-  { increment(); }
+  {
+    static_assert( (bool) sptr_base< TT >::Intrusive == (bool) Intrusive,
+                   "Both types must either derive from sptr_counted or not" );
+    increment();
+  }
 
   void reset()
   {
     if ( count )
     {
-      if ( ! -- *count )
-      {
-        delete count;
+      Count * count_ = count;
+      T * p_ = p;
 
-        count = 0;
+      p = 0;
+      count = 0;
 
-        if ( p )
-        {
-          T * p_ = p;
-  
-          p = 0;
-  
-          delete p_;
-        }
-      }
-      else
+      if ( count_->fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
       {
-        p = 0;
-        count = 0;
+        deleteCount( count_, std::integral_constant< bool, Intrusive >() );
+
+        delete p_;
       }
     }
   }
 
   unsigned use_count() const
-  { return count; }
+  { return count ? count->load( std::memory_order_relaxed ) : 0; }
 
   sptr_base & operator = ( sptr_base const & other )
   { if ( &other != this ) { reset(); p = other.p; count = other.count; increment(); }
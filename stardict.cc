@@ -71,7 +71,7 @@ struct Ifo
 enum
 {
     Signature = 0x58444953, // SIDX on little-endian, XDIS on big-endian
-    CurrentFormatVersion = 7 + BtreeIndexing::FormatVersion + Folding::Version
+    CurrentFormatVersion = 8 + BtreeIndexing::FormatVersion + Folding::Version
 };
 
 struct IdxHeader
@@ -87,6 +87,7 @@ struct IdxHeader
     uint32_t sameTypeSequenceSize; // That string's size. Used to read it then.
     uint32_t langFrom;  // Source language
     uint32_t langTo;    // Target language
+    uint32_t codec; // Codec::Type of the btree and the chunks
 }
 __attribute__((packed))
 ;
@@ -99,7 +100,8 @@ bool indexIsOldOrBad( string const & indexFile )
 
     return idx.readRecords( &header, sizeof( header ), 1 ) != 1 ||
                                                               header.signature != Signature ||
-                                                                                  header.formatVersion != CurrentFormatVersion;
+                                                                                  header.formatVersion != CurrentFormatVersion ||
+                                                                                  !Codec::isSupported( header.codec );
 }
 
 
@@ -111,8 +113,7 @@ class StardictDictionary: public BtreeIndexing::BtreeDictionary
     string bookName;
     string sameTypeSequence;
     ChunkedStorage::Reader chunks;
-    Mutex dzMutex;
-    dictData * dz;
+    dictData * dz; // Thread-safe, needs no locking
 
 public:
 
@@ -141,6 +142,10 @@ public:
 
     sptr< Dictionary::WordSearchRequest > findHeadwordsForSynonym( wstring const & ) override;
 
+    sptr< Dictionary::DataRequest > getArticleNow( wstring const &,
+                                                   vector< wstring > const & alts,
+                                                   wstring const & ) override;
+
     sptr< Dictionary::DataRequest > getArticle( wstring const &,
                                                         vector< wstring > const & alts,
                                                         wstring const & ) override;
@@ -163,6 +168,11 @@ private:
                        string & headword,
                        string & articleText );
 
+    /// Converts the article data, 'size' bytes long, to html.
+    void parseArticle( char const * data, uint32_t size,
+                       string const & headword,
+                       string & articleText );
+
     string loadString( size_t size );
 
     friend class StardictArticleRequest;
@@ -177,8 +187,10 @@ StardictDictionary::StardictDictionary( string const & id,
     idxHeader( idx.read< IdxHeader >() ),
     bookName( loadString( idxHeader.bookNameSize ) ),
     sameTypeSequence( loadString( idxHeader.sameTypeSequenceSize ) ),
-    chunks( idx, idxHeader.chunksOffset )
+    chunks( idx, idxHeader.chunksOffset, static_cast< Codec::Type >( idxHeader.codec ) )
 {
+    chunks.setMetrics( metrics );
+
     // Open the .dict file
 
     dz = dict_data_open( dictionaryFiles[ 2 ].c_str(), 0 );
@@ -189,7 +201,8 @@ StardictDictionary::StardictDictionary( string const & id,
     // Initialize the index
 
     openIndex( IndexInfo( idxHeader.indexBtreeMaxElements,
-                          idxHeader.indexRootOffset ),
+                          idxHeader.indexRootOffset,
+                          static_cast< Codec::Type >( idxHeader.codec ) ),
                idx, idxMutex );
 }
 
@@ -212,11 +225,11 @@ void StardictDictionary::getArticleProps( uint32_t articleAddress,
                                           string & headword,
                                           uint32_t & offset, uint32_t & size )
 {
-    vector< char > chunk;
+    // The reader is thread-safe and caches the chunks itself, so no locking
+    // or copying is needed here
+    ChunkedStorage::ChunkPtr chunk;
 
-    Mutex::Lock _( idxMutex );
-
-    char * articleData = chunks.getBlock( articleAddress, chunk );
+    char const * articleData = chunks.getBlock( articleAddress, chunk );
 
     memcpy( &offset, articleData, sizeof( uint32_t ) );
     articleData += sizeof( uint32_t );
@@ -226,6 +239,169 @@ void StardictDictionary::getArticleProps( uint32_t articleAddress,
     headword = articleData;
 }
 
+/// Returns true if the html has the given word, in lower case, at the given
+/// position, comparing case-insensitively.
+bool hasWordAt( string const & html, size_t pos, char const * word )
+{
+    for( ; *word; ++word, ++pos )
+        if ( pos == html.size() ||
+             ( *word >= 'a' && *word <= 'z' ? ( html[ pos ] | 0x20 ) : html[ pos ] ) != *word )
+            return false;
+
+    return true;
+}
+
+/// Returns the length of the UTF-8 encoded space at the given position of
+/// the html, or 0 if there's none. The spaces are those of QChar::isSpace(),
+/// which is what \s used to match when the links were fixed with a QRegExp.
+size_t htmlSpaceAt( string const & html, size_t pos )
+{
+    if ( pos >= html.size() )
+        return 0;
+
+    unsigned char c = html[ pos ];
+
+    if ( c == ' ' || ( c >= '\t' && c <= '\r' ) )
+        return 1;
+
+    if ( c < 0xC2 || c > 0xE3 || html.size() - pos < 2 )
+        return 0;
+
+    unsigned char c1 = html[ pos + 1 ];
+
+    if ( c == 0xC2 ) // U+0085, U+00A0
+        return c1 == 0x85 || c1 == 0xA0 ? 2 : 0;
+
+    if ( html.size() - pos < 3 )
+        return 0;
+
+    unsigned char c2 = html[ pos + 2 ];
+
+    switch( c )
+    {
+        case 0xE1: // U+1680
+            return c1 == 0x9A && c2 == 0x80 ? 3 : 0;
+
+        case 0xE2: // U+2000..U+200A, U+2028, U+2029, U+202F, U+205F
+            if ( c1 == 0x80 )
+                return ( c2 >= 0x80 && c2 <= 0x8A ) || c2 == 0xA8 || c2 == 0xA9 ||
+                       c2 == 0xAF ? 3 : 0;
+
+            return c1 == 0x81 && c2 == 0x9F ? 3 : 0;
+
+        case 0xE3: // U+3000
+            return c1 == 0x80 && c2 == 0x80 ? 3 : 0;
+
+        default:
+            return 0;
+    }
+}
+
+/// Returns the position of the first non-space at or after the given one.
+size_t skipHtmlSpaces( string const & html, size_t pos )
+{
+    while( size_t length = htmlSpaceAt( html, pos ) )
+        pos += length;
+
+    return pos;
+}
+
+/// Checks whether there's an href="bword://..." at the given position of the
+/// html. Returns the position of the "//" if so, or string::npos otherwise.
+size_t findBwordHref( string const & html, size_t pos )
+{
+    if ( !hasWordAt( html, pos, "href" ) )
+        return string::npos;
+
+    pos += 4;
+
+    pos = skipHtmlSpaces( html, pos );
+
+    if ( pos == html.size() || html[ pos++ ] != '=' )
+        return string::npos;
+
+    pos = skipHtmlSpaces( html, pos );
+
+    if ( pos == html.size() || ( html[ pos ] != '"' && html[ pos ] != '\'' ) )
+        return string::npos;
+
+    ++pos;
+
+    pos = skipHtmlSpaces( html, pos );
+
+    if ( !hasWordAt( html, pos, "bword://" ) )
+        return string::npos;
+
+    return pos + 6;
+}
+
+/// Turns the bword:// links of the html into bword: ones, which is what the
+/// links to other words look like. It does what replacing
+/// (<\s*a\s+[^>]*href\s*=\s*["']\s*)bword:// with \1bword: case-insensitively
+/// would, right on the bytes and in a single pass.
+void fixBwordLinks( string & html )
+{
+    vector< size_t > slashes; // The positions of the "//"s to remove
+
+    for( size_t x = 0; ( x = html.find( '<', x ) ) != string::npos; )
+    {
+        size_t pos = x + 1;
+
+        pos = skipHtmlSpaces( html, pos );
+
+        size_t spaceLength;
+
+        if ( pos < html.size() && ( html[ pos ] | 0x20 ) == 'a' &&
+             ( spaceLength = htmlSpaceAt( html, pos + 1 ) ) )
+        {
+            // Like the greedy [^>]* would, take the last href in the tag
+            size_t tagEnd = html.find( '>', pos );
+
+            if ( tagEnd == string::npos )
+                tagEnd = html.size();
+
+            size_t found = string::npos;
+
+            for( pos += 1 + spaceLength; pos < tagEnd; ++pos )
+            {
+                size_t slash = findBwordHref( html, pos );
+
+                if ( slash != string::npos )
+                    found = slash;
+            }
+
+            if ( found != string::npos )
+            {
+                // The scheme is written in lower case, whatever it was
+                memcpy( &html[ found - 6 ], "bword", 5 );
+
+                slashes.push_back( found );
+                x = found + 2;
+                continue;
+            }
+        }
+
+        ++x;
+    }
+
+    if ( slashes.empty() )
+        return;
+
+    // Move everything between the slashes to remove in place
+    size_t to = slashes.front();
+
+    for( size_t x = 0; x < slashes.size(); ++x )
+    {
+        size_t from = slashes[ x ] + 2;
+        size_t next = x + 1 < slashes.size() ? slashes[ x + 1 ] : html.size();
+
+        memmove( &html[ to ], &html[ from ], next - from );
+        to += next - from;
+    }
+
+    html.resize( to );
+}
+
 /// This function tries to make an html of the Stardict's resource typed
 /// 'type', contained in a block pointed to by 'resource', 'size' bytes long.
 string handleResource( char type, char const * resource, size_t size )
@@ -282,21 +458,37 @@ void StardictDictionary::loadArticle( uint32_t address,
 
     getArticleProps( address, headword, offset, size );
 
-    char * articleBody;
+    // The view usually points right into the cached chunk. It isn't
+    // zero-terminated then, so the entries are never scanned past its end.
+    dictView articleBody;
 
     {
-        Mutex::Lock _( dzMutex );
+        GD_METRICS_TIME( metrics, ArticleRead );
 
-        // Note that the function always zero-pads the result.
-        articleBody = dict_data_read_( dz, offset, size, nullptr, nullptr );
+        if ( dict_data_read_view( dz, offset, size, &articleBody ) != 0 )
+            throw exCantReadFile( getDictionaryFilenames()[ 2 ] );
     }
 
-    if ( !articleBody )
-        throw exCantReadFile( getDictionaryFilenames()[ 2 ] );
+    try
+    {
+        GD_METRICS_TIME( metrics, ArticleRender );
 
-    articleText.clear();
+        parseArticle( articleBody.data, size, headword, articleText );
+    }
+    catch( ... )
+    {
+        dict_data_release_view( &articleBody );
+        throw;
+    }
+
+    dict_data_release_view( &articleBody );
+}
 
-    char * ptr = articleBody;
+void StardictDictionary::parseArticle( char const * ptr, uint32_t size,
+                                       string const & headword,
+                                       string & articleText )
+{
+    articleText.clear();
 
     if ( !sameTypeSequence.empty() )
     {
@@ -324,7 +516,11 @@ void StardictDictionary::loadArticle( uint32_t address,
             {
                 // Zero-terminated entry, unless it's the last one
                 if ( !entrySizeKnown )
-                    entrySize = strlen( ptr );
+                {
+                    char const * end = (char const *) memchr( ptr, 0, size );
+
+                    entrySize = end ? end - ptr : size + 1; // Too big if unterminated
+                }
 
                 if ( size < entrySize )
                 {
@@ -341,7 +537,7 @@ void StardictDictionary::loadArticle( uint32_t address,
                 size -= entrySize;
             }
             else
-                if ( isupper( *ptr ) )
+                if ( isupper( type ) )
                 {
                     // An entry which has its size before contents, unless it's the last one
 
@@ -391,7 +587,8 @@ void StardictDictionary::loadArticle( uint32_t address,
             if ( islower( *ptr ) )
             {
                 // Zero-terminated entry
-                size_t len = strlen( ptr + 1 );
+                char const * end = (char const *) memchr( ptr + 1, 0, size - 1 );
+                size_t len = end ? end - ( ptr + 1 ) : size; // Too big if unterminated
 
                 if ( size < len + 2 )
                 {
@@ -444,7 +641,7 @@ void StardictDictionary::loadArticle( uint32_t address,
         }
     }
 
-    free( articleBody );
+    fixBwordLinks( articleText );
 }
 
 
@@ -545,10 +742,13 @@ void StardictHeadwordsRequest::run()
                 return;
             }
 
-            string headword, articleText;
+            // Every entry, the synonyms' ones included, points to the block of
+            // its article in the index, which has the article's headword. So
+            // the headword is known without reading the article itself.
+            string headword;
+            uint32_t offset, size;
 
-            dict.loadArticle( cx.articleOffset,
-                              headword, articleText );
+            dict.getArticleProps( cx.articleOffset, headword, offset, size );
 
             wstring headwordDecoded = Utf8::decode( headword );
 
@@ -620,13 +820,20 @@ class StardictArticleRequest: public Dictionary::DataRequest
 
 public:
 
+    /// With runNow, the lookup is done right away, in the calling thread.
     StardictArticleRequest( wstring const & word_,
                             vector< wstring > const & alts_,
-                            StardictDictionary & dict_ ):
+                            StardictDictionary & dict_, bool runNow = false ):
         word( word_ ), alts( alts_ ), dict( dict_ )
     {
-        QThreadPool::globalInstance()->start(
-                    new StardictArticleRequestRunnable( *this, hasExited ) );
+        if ( runNow )
+        {
+            run();
+            hasExited.release();
+        }
+        else
+            QThreadPool::globalInstance()->start(
+                        new StardictArticleRequestRunnable( *this, hasExited ) );
     }
 
     void run(); // Run from another thread by StardictArticleRequestRunnable
@@ -752,10 +959,6 @@ void StardictArticleRequest::run()
             result += i->second.second;
             result += cleaner;
         }
-        result = QString::fromUtf8( result.c_str() )
-                 .replace( QRegExp( R"((<\s*a\s+[^>]*href\s*=\s*["']\s*)bword://)", Qt::CaseInsensitive ),
-                           R"(\1bword:)" )
-                 .toUtf8().constData();
 
         Mutex::Lock _( dataMutex );
 
@@ -780,6 +983,13 @@ sptr< Dictionary::DataRequest > StardictDictionary::getArticle( wstring const &
     return new StardictArticleRequest( word, alts, *this );
 }
 
+sptr< Dictionary::DataRequest > StardictDictionary::getArticleNow( wstring const & word,
+                                                                   vector< wstring > const & alts,
+                                                                   wstring const & )
+{
+    return new StardictArticleRequest( word, alts, *this, true );
+}
+
 
 char const * beginsWith( char const * substr, char const * str )
 {
@@ -996,6 +1206,9 @@ static void handleIdxSynFile( string const & fileName,
             if ( offsetInIndex >= articleOffsets->size() )
                 throw exIncorrectOffset( fileName );
 
+            // The synonym shares the block of its headword's article, which
+            // makes the block the synonym-to-headword mapping, as used by
+            // findHeadwordsForSynonym()
             offset = (*articleOffsets)[ offsetInIndex ];
 
             // Some StarDict dictionaries are in fact badly converted Babylon ones.
@@ -1106,7 +1319,13 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                 IndexedWords indexedWords;
 
-                ChunkedStorage::Writer chunks( idx );
+                BtreeIndexing::applyIndexingLimits( indexedWords, initializing );
+
+                Codec::Type codec = Codec::getIndexCodec();
+
+                idxHeader.codec = codec;
+
+                ChunkedStorage::Writer chunks( idx, codec );
 
                 // Load indices
                 if ( !ifo.synwordcount )
@@ -1130,7 +1349,9 @@ vector< sptr< Dictionary::Class > > makeDictionaries(
 
                 // Build index
 
-                IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx );
+                IndexInfo idxInfo = BtreeIndexing::buildIndex( indexedWords, idx, codec );
+
+                initializing.indexedDictionary( ifo.bookname, indexedWords.getStats() );
 
                 idxHeader.indexBtreeMaxElements = idxInfo.btreeMaxElements;
                 idxHeader.indexRootOffset = idxInfo.rootOffset;
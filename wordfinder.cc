@@ -4,15 +4,144 @@
 #include "wordfinder.hh"
 #include "folding.hh"
 #include "wstring_qt.hh"
+#include "btreeidx.hh"
+#include "utf8.hh"
+#include "mutex.hh"
 #include <QThreadPool>
 #include <map>
+#include <unordered_map>
 #include <QDebug>
 
 using std::vector;
+using std::string;
 using gd::wstring;
 using gd::wchar;
 using std::pair;
 
+namespace {
+
+/// The merged, but not yet ranked, results of a finished search.
+struct CachedResults
+{
+    vector< pair< wstring, bool > > words; // bool is a "was suggested" flag
+    bool uncertain;
+    bool complete; // No dictionary has truncated its matches
+};
+
+/// A bounded LRU cache of search results, shared by all the word finders.
+/// The keys consist of the search params, the ids of the dictionaries
+/// queried and the words searched.
+class ResultCache
+{
+public:
+
+    enum
+    {
+        MaxWords = 32768 // The total number of the words cached
+    };
+
+    ResultCache(): words( 0 )
+    {}
+
+    bool find( string const & key, CachedResults & result )
+    {
+        Mutex::Lock _( mutex );
+
+        auto i = index.find( key );
+
+        if ( i == index.end() )
+            return false;
+
+        lru.splice( lru.begin(), lru, i->second );
+
+        result = i->second->second;
+
+        return true;
+    }
+
+    void insert( string const & key, CachedResults const & result )
+    {
+        if ( result.words.size() > MaxWords / 4 )
+            return; // Not worth evicting everything else
+
+        Mutex::Lock _( mutex );
+
+        auto i = index.find( key );
+
+        if ( i != index.end() )
+        {
+            words -= i->second->second.words.size();
+            lru.erase( i->second );
+            index.erase( i );
+        }
+
+        lru.push_front( Lru::value_type( key, result ) );
+        index[ key ] = lru.begin();
+        words += result.words.size();
+
+        while( words > MaxWords )
+        {
+            words -= lru.back().second.words.size();
+            index.erase( lru.back().first );
+            lru.pop_back();
+        }
+    }
+
+    void clear()
+    {
+        Mutex::Lock _( mutex );
+
+        lru.clear();
+        index.clear();
+        words = 0;
+    }
+
+private:
+
+    typedef std::list< pair< string, CachedResults > > Lru;
+
+    Mutex mutex;
+    Lru lru; // Most recently used entries go first
+    std::unordered_map< string, Lru::iterator > index;
+    size_t words;
+};
+
+ResultCache & resultCache()
+{
+    static ResultCache cache;
+
+    return cache;
+}
+
+/// Checks whether the word would be found by a btree prefix search of the
+/// given folded string, that is, whether the word itself or any part of it
+/// starting with a new word begins with it once folded. This mirrors
+/// IndexedWords::addWord().
+bool hasFoldedPrefix( wstring const & word, wstring const & foldedPrefix )
+{
+    for( wchar const * nextChar = word.c_str(); ; )
+    {
+        // Skip any whitespace/punctuation
+        for( ; ; ++nextChar )
+        {
+            if ( !*nextChar )
+                return false;
+
+            if ( !Folding::isWhitespace( *nextChar ) && !Folding::isPunct( *nextChar ) )
+                break;
+        }
+
+        if ( Folding::apply( nextChar ).compare( 0, foldedPrefix.size(), foldedPrefix ) == 0 )
+            return true;
+
+        // Skip the word itself
+        for( ; *nextChar && !Folding::isWhitespace( *nextChar ) &&
+               !Folding::isPunct( *nextChar ); ++nextChar ) ;
+    }
+}
+
+}
+
 WordFinder::WordFinder( QObject * parent ):
     QObject( parent ),
     searchResultsUncertain( false ),
@@ -23,7 +152,10 @@ WordFinder::WordFinder( QObject * parent ):
     requestedMaxResults( 0 ),
     stemmedMinLength( 0 ),
     stemmedMaxSuffixVariation( 0 ),
-    inputDicts ( nullptr )
+    inputDicts ( nullptr ),
+    searchCacheable( false ),
+    searchResultsComplete( false ),
+    synchronous( false )
 {
     updateResultsTimer.setInterval( 1000 ); // We use a one second update timer
     updateResultsTimer.setSingleShot( true );
@@ -53,6 +185,7 @@ void WordFinder::prefixMatch( QString const & str,
 
     resultsArray.clear();
     resultsIndex.clear();
+    resultsArrival.clear();
     searchResults.clear();
 
     if ( queuedRequests.empty() )
@@ -85,6 +218,7 @@ void WordFinder::stemmedMatch( QString const & str,
 
     resultsArray.clear();
     resultsIndex.clear();
+    resultsArrival.clear();
     searchResults.clear();
 
     if ( queuedRequests.empty() )
@@ -102,6 +236,7 @@ void WordFinder::startSearch()
 
     searchErrorString.clear();
     searchResultsUncertain = false;
+    searchResultsComplete = true;
 
     searchQueued = false;
     searchInProgress = true;
@@ -120,6 +255,41 @@ void WordFinder::startSearch()
         allWordWritings.insert( allWordWritings.end(), writings.cbegin(), writings.cend() );
     }
 
+    // Make up the result cache key of the search params and the dictionaries
+    // to be queried. Only the searches done solely in btree dictionaries can
+    // be narrowed down later, since we know how they match the words.
+
+    searchParamsKey = QString( "%1 %2 %3 %4 %5\n" ).arg( searchType )
+                      .arg( requestedMaxResults ).arg( int( requestedFeatures ) )
+                      .arg( stemmedMinLength ).arg( stemmedMaxSuffixVariation )
+                      .toStdString();
+
+    bool allBtree = true;
+
+    for( const auto & dict : (*inputDicts) )
+    {
+        if ( ( dict->getFeatures() & requestedFeatures ) != requestedFeatures )
+            continue;
+
+        searchParamsKey += dict->getId();
+        searchParamsKey.push_back( '\n' );
+
+        if ( !dynamic_cast< BtreeIndexing::BtreeDictionary * >( dict.get() ) )
+            allBtree = false;
+    }
+
+    searchCacheable = true;
+
+    if ( !allBtree )
+        searchResultsComplete = false; // Never narrow these down
+
+    if ( takeCachedResults() )
+    {
+        searchCacheable = false; // Already there
+        updateResults();
+        return;
+    }
+
     // Query each dictionary for all word writings
 
     for( const auto & dict : (*inputDicts) )
@@ -138,8 +308,9 @@ void WordFinder::startSearch()
                                                 stemmedMaxSuffixVariation,
                                                 requestedMaxResults );
 
-                connect( sr.get(), &Dictionary::WordSearchRequest::finished,
-                         this, &WordFinder::requestFinished, Qt::QueuedConnection );
+                if ( !synchronous )
+                    connect( sr.get(), &Dictionary::WordSearchRequest::finished,
+                             this, &WordFinder::requestFinished, Qt::QueuedConnection );
 
                 queuedRequests.push_back( sr );
             }
@@ -147,10 +318,18 @@ void WordFinder::startSearch()
             {
                 qWarning() << QStringLiteral("Word '%1' search error (%2) in '%3'.")
                               .arg(inputWord,e.what(),dict->getName().c_str());
+
+                searchCacheable = false;
             }
         }
     }
 
+    if ( synchronous )
+    {
+        for( const auto & request : queuedRequests )
+            request->waitUntilFinished();
+    }
+
     // Handle any requests finished already
 
     requestFinished();
@@ -171,6 +350,105 @@ void WordFinder::clear()
     finishedRequests.clear();
 }
 
+void WordFinder::clearResultCache()
+{
+    resultCache().clear();
+}
+
+bool WordFinder::takeCachedResults()
+{
+    string writingsKey;
+
+    for( const auto & writing : allWordWritings )
+    {
+        writingsKey += Utf8::encode( writing );
+        writingsKey.push_back( '\n' );
+    }
+
+    CachedResults cached;
+
+    bool found = resultCache().find( searchParamsKey + writingsKey, cached );
+
+    if ( !found && searchType == PrefixMatch && searchResultsComplete &&
+         allWordWritings.size() == 1 )
+    {
+        // See if there are complete results for a shorter word this one
+        // begins with, which is the case when typing it in. Every word found
+        // by this search would have been found by that one, too.
+
+        wstring const & word = allWordWritings[ 0 ];
+        wstring folded = Folding::apply( word );
+
+        for( size_t size = word.size(); !found && size-- > 1; )
+        {
+            wstring prefix( word, 0, size );
+            wstring prefixFolded = Folding::apply( prefix );
+
+            if ( prefixFolded.empty() ||
+                 folded.compare( 0, prefixFolded.size(), prefixFolded ) != 0 )
+                continue;
+
+            if ( resultCache().find( searchParamsKey + Utf8::encode( prefix ) + '\n', cached ) &&
+                 cached.complete )
+            {
+                found = true;
+
+                size_t kept = 0;
+
+                for( size_t x = 0; x < cached.words.size(); ++x )
+                    if ( hasFoldedPrefix( cached.words[ x ].first, folded ) )
+                        cached.words[ kept++ ] = cached.words[ x ];
+
+                cached.words.resize( kept );
+            }
+        }
+    }
+
+    if ( !found )
+        return false;
+
+    for( const auto & word : cached.words )
+    {
+        resultsArray.push_back( OneResult() );
+
+        resultsArray.back().word = word.first;
+        resultsArray.back().rank = INT_MAX;
+        resultsArray.back().wasSuggested = word.second;
+
+        resultsIndex[ Folding::applySimpleCaseOnly( word.first ) ] = --resultsArray.end();
+        resultsArrival.push_back( --resultsArray.end() );
+    }
+
+    searchResultsUncertain = cached.uncertain;
+
+    return true;
+}
+
+void WordFinder::cacheResults()
+{
+    string key = searchParamsKey;
+
+    for( const auto & writing : allWordWritings )
+    {
+        key += Utf8::encode( writing );
+        key.push_back( '\n' );
+    }
+
+    CachedResults cached;
+
+    // The words are stored in the order they arrived in rather than the ranked
+    // one, so that ranking them again gives the same list as a new search
+    cached.words.reserve( resultsArrival.size() );
+
+    for( const auto & result : resultsArrival )
+        cached.words.push_back( pair< wstring, bool >( result->word, result->wasSuggested ) );
+
+    cached.uncertain = searchResultsUncertain;
+    cached.complete = searchResultsComplete && !searchResultsUncertain;
+
+    resultCache().insert( key, cached );
+}
+
 void WordFinder::requestFinished()
 {
     bool newResults = false;
@@ -181,11 +459,17 @@ void WordFinder::requestFinished()
         if ( (*i)->isFinished() )
         {
             if ( searchInProgress && !(*i)->getErrorString().isEmpty() )
+            {
                 searchErrorString = tr( "Failed to query some dictionaries." );
+                searchCacheable = false; // The failure might be temporary
+            }
 
             if ( (*i)->isUncertain() )
                 searchResultsUncertain = true;
 
+            if ( (*i)->matchesCount() >= (*i)->getMaxResults() )
+                searchResultsComplete = false; // Some matches might be left out
+
             if ( (*i)->matchesCount() )
             {
                 newResults = true;
@@ -316,6 +600,7 @@ void WordFinder::updateResults()
                 resultsArray.back().wasSuggested = ( weight != 0 );
 
                 insertResult.first->second = --resultsArray.end();
+                resultsArrival.push_back( insertResult.first->second );
             }
         }
         finishedRequests.erase( i++ );
@@ -454,6 +739,9 @@ void WordFinder::updateResults()
     else
     {
         // That were all of them.
+        if ( searchCacheable )
+            cacheResults();
+
         searchInProgress = false;
         emit finished();
     }
@@ -51,6 +51,13 @@ private:
   std::vector< sptr< Dictionary::Class > > const * inputDicts;
 
   std::vector< gd::wstring > allWordWritings; // All writings of the inputWord
+
+  // The result cache key of the search params, excluding the words searched
+  std::string searchParamsKey;
+  // Whether the results of the current search are eligible for caching, and
+  // whether each dictionary has returned all of its matches
+  bool searchCacheable, searchResultsComplete;
+  bool synchronous; // See setSynchronous()
   
   struct OneResult
   {
@@ -65,6 +72,8 @@ private:
   typedef std::map< gd::wstring, ResultsArray::iterator > ResultsIndex;
   ResultsArray resultsArray;
   ResultsIndex resultsIndex;
+  // The results in the order they arrived in, before being ranked
+  std::vector< ResultsArray::iterator > resultsArrival;
     
 public:
 
@@ -94,6 +103,12 @@ public:
                      unsigned long maxResults = 30,
                      Dictionary::Features = Dictionary::NoFeatures );
   
+  /// Makes prefixMatch() and stemmedMatch() block until the search is done,
+  /// so the results are final once they return. No event loop is needed
+  /// then. The finished() signal is still emitted before they return.
+  void setSynchronous( bool value )
+  { synchronous = value; }
+
   /// Returns the vector containing search results from the last operation.
   /// If it didn't finish yet, the result is not final and may be changing
   /// over time.
@@ -118,6 +133,10 @@ public:
   /// cancel(), this may take some time to finish.
   void clear();
 
+  /// Drops all the search results cached. The cache is shared by all the
+  /// word finders, and must be cleared each time the dictionaries change.
+  static void clearResultCache();
+
 signals:
 
   /// Indicates that the search has got some more results, and continues
@@ -140,6 +159,15 @@ private:
   // Starts the previously queued search.
   void startSearch();
 
+  /// Tries to take the results of the current search from the result cache,
+  /// either the ones of the very same search, or by narrowing the complete
+  /// results of a search for a prefix of the input word. Returns true if the
+  /// results were taken.
+  bool takeCachedResults();
+
+  /// Stores the results of the search just finished in the result cache.
+  void cacheResults();
+
   // Cancels all searches. Useful to do before destroying them all, since they
   // would cancel in parallel.
   void cancelSearches();
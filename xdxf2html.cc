@@ -2,11 +2,496 @@
  * Part of GoldenDict. Licensed under GPLv3 or later, see the LICENSE file */
 
 #include "xdxf2html.hh"
+#include "ex.hh"
 #include <QtXml>
 
+#include <cstring>
+#include <vector>
+
 namespace Xdxf2Html {
 
+namespace {
+
+DEF_EX_STR( exMalformed, "xml parse failed:", std::exception )
+
+/// An xdxf element and the html one it's converted to.
+struct Mapping
+{
+    char const * xdxfName;
+    char const * htmlName;
+    char const * htmlClass;
+};
+
+Mapping const mappings[] = {
+    { "ex", "span", "xdxf_ex" }, // Example
+    { "k", "span", "xdxf_k" }, // Key
+    { "kref", "a", "xdxf_kref" }, // Reference to another word
+    { "abr", "span", "xdxf_abr" }, // Abbreviation
+    { "dtrn", "span", "xdxf_dtrn" }, // Direct translation
+    { "c", "font", "xdxf_c" }, // Color
+    { "co", "span", "xdxf_co" }, // Editorial comment
+    { "tr", "span", "xdxf_tr" }, // Transcription
+    // We don't really know how to handle this at the moment, so we'll just
+    // convert it to a span and leave it as is for now.
+    { "rref", "span", "xdxf_rref" } // Resource reference
+};
+
+bool isNameStart( char c )
+{
+    return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '_' || c == ':' ||
+           ( c & 0x80 );
+}
+
+bool isNameChar( char c )
+{
+    return isNameStart( c ) || ( c >= '0' && c <= '9' ) || c == '-' || c == '.';
+}
+
+bool isSpace( char c )
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/// Converts the xdxf in a single pass over it, writing the html right to the
+/// output as it goes. Only the well-formedness the conversion relies on is
+/// checked: the tags, the attributes and the references must be properly
+/// formed, and the elements properly nested.
+class Converter
+{
+    char const * begin, * ptr, * end;
+    string & out;
+
+    /// An element opened and not closed yet.
+    struct Element
+    {
+        char const * name;
+        size_t nameSize;
+        Mapping const * mapping;
+
+        // Those are only used by the references, whose start tags are only
+        // written once their ends, and so their texts, are known
+        size_t start; // Where the start tag goes in the output
+        string startTag; // Without its href and the closing '>'
+        string text;
+    };
+
+    std::vector< Element > elements;
+    unsigned openReferences; // The number of the kref elements in 'elements'
+    bool afterEol;
+
+public:
+
+    Converter( string const & in, string & out_ ):
+        begin( in.data() ), ptr( begin ), end( begin + in.size() ), out( out_ ),
+        openReferences( 0 ), afterEol( false )
+    {}
+
+    /// Does the conversion. Throws exMalformed if the input isn't a proper xml.
+    void run();
+
+private:
+
+    void startElement();
+    void endElement();
+
+    /// Copies the construct starting at ptr and ending after the given
+    /// terminator to the output, as it is.
+    void copyUntil( char const * terminator );
+
+    /// Checks the reference starting at ptr, returning its size.
+    size_t referenceSize();
+
+    /// Reads a name, returning its size.
+    size_t nameSize();
+
+    void skipSpaces()
+    {
+        while( ptr != end && isSpace( *ptr ) )
+            ++ptr;
+    }
+
+    /// Adds the text to the texts of the references opened.
+    void addText( char const * text, size_t size );
+
+    [[noreturn]] void malformed( char const * what );
+};
+
+void Converter::run()
+{
+    while( ptr != end )
+    {
+        switch( *ptr )
+        {
+            case '<':
+                afterEol = false;
+
+                if ( end - ptr >= 4 && !memcmp( ptr, "<!--", 4 ) )
+                    copyUntil( "-->" );
+                else
+                if ( end - ptr >= 9 && !memcmp( ptr, "<![CDATA[", 9 ) )
+                    copyUntil( "]]>" );
+                else
+                if ( end - ptr >= 2 && ptr[ 1 ] == '?' )
+                    copyUntil( "?>" );
+                else
+                if ( end - ptr >= 2 && ptr[ 1 ] == '/' )
+                    endElement();
+                else
+                    startElement();
+                break;
+
+            case '&':
+            {
+                afterEol = false;
+
+                size_t size = referenceSize();
+
+                addText( ptr, size );
+                out.append( ptr, size );
+                ptr += size;
+                break;
+            }
+
+            // Convert spaces after each end of line to &nbsp;s, and then each
+            // end of line to a <br>
+
+            case '\n':
+                afterEol = true;
+                out.append( "<br/>" );
+                ++ptr;
+                break;
+
+            case ' ':
+                if ( afterEol )
+                {
+                    out.append( "&nbsp;" );
+                    addText( ptr, 1 );
+                    ++ptr;
+                    break;
+                }
+                // Fall-through
+                [[clang::fallthrough]];
+            default:
+            {
+                afterEol = false;
+
+                // Take the whole run of plain text at once
+                char const * text = ptr;
+
+                while( ++ptr != end && *ptr != '<' && *ptr != '&' && *ptr != '\n' )
+                {}
+
+                addText( text, ptr - text );
+                out.append( text, ptr - text );
+            }
+        }
+    }
+
+    if ( !elements.empty() )
+        malformed( "unclosed element" );
+}
+
+void Converter::startElement()
+{
+    ++ptr; // The '<'
+
+    char const * name = ptr;
+    size_t size = nameSize();
+
+    Mapping const * mapping = nullptr;
+
+    for( auto const & m : mappings )
+        if ( strlen( m.xdxfName ) == size && !memcmp( m.xdxfName, name, size ) )
+        {
+            mapping = &m;
+            break;
+        }
+
+    bool isReference = mapping && !strcmp( mapping->xdxfName, "kref" );
+
+    // The start tags of the references are collected separately, see Element
+    string startTag;
+    string & tag = isReference ? startTag : out;
+
+    tag += '<';
+
+    if ( mapping )
+    {
+        tag += mapping->htmlName;
+        tag += " class=\"";
+        tag += mapping->htmlClass;
+        tag += '"';
+    }
+    else
+        tag.append( name, size );
+
+    for( ; ; )
+    {
+        char const * beforeSpaces = ptr;
+
+        skipSpaces();
+
+        if ( ptr == end )
+            malformed( "unfinished tag" );
+
+        if ( *ptr == '>' || *ptr == '/' )
+            break;
+
+        if ( ptr == beforeSpaces )
+            malformed( "no space before an attribute" );
+
+        char const * attribute = ptr;
+        size_t attributeSize = nameSize();
+
+        skipSpaces();
+
+        if ( ptr == end || *ptr++ != '=' )
+            malformed( "attribute without a value" );
+
+        skipSpaces();
+
+        if ( ptr == end || ( *ptr != '"' && *ptr != '\'' ) )
+            malformed( "unquoted attribute value" );
+
+        char quote = *ptr++;
+        char const * value = ptr;
+
+        while( ptr != end && *ptr != quote )
+        {
+            if ( *ptr == '<' )
+                malformed( "'<' in an attribute value" );
+
+            ptr += *ptr == '&' ? referenceSize() : 1;
+        }
+
+        if ( ptr == end )
+            malformed( "unfinished attribute value" );
+
+        size_t valueSize = ptr++ - value;
+
+        auto is = [ attribute, attributeSize ]( char const * n )
+        {
+            return strlen( n ) == attributeSize && !memcmp( n, attribute, attributeSize );
+        };
+
+        if ( mapping )
+        {
+            // The class is replaced, and so is the href of the references
+            if ( is( "class" ) || ( isReference && is( "href" ) ) )
+                continue;
+
+            if ( is( "c" ) && !strcmp( mapping->xdxfName, "c" ) )
+            {
+                tag += " color=";
+                tag += quote;
+                tag.append( value, valueSize );
+                tag += quote;
+                continue;
+            }
+        }
+
+        tag += ' ';
+        tag.append( attribute, value + valueSize + 1 - attribute );
+    }
+
+    bool isEmpty = *ptr == '/';
+
+    if ( isEmpty && ( ++ptr == end || *ptr != '>' ) )
+        malformed( "'/' in a tag" );
+
+    ++ptr; // The '>'
+
+    if ( isReference && isEmpty )
+    {
+        out += startTag;
+        out += " href=\"bword:\"/>";
+    }
+    else
+    if ( isEmpty )
+        out += "/>";
+    else
+    {
+        Element element;
+
+        element.name = name;
+        element.nameSize = size;
+        element.mapping = mapping;
+
+        if ( isReference )
+        {
+            element.start = out.size();
+            element.startTag.swap( startTag );
+            ++openReferences;
+        }
+        else
+            out += '>';
+
+        elements.push_back( std::move( element ) );
+    }
+}
+
+void Converter::endElement()
+{
+    ptr += 2; // The '</'
+
+    char const * name = ptr;
+    size_t size = nameSize();
+
+    skipSpaces();
+
+    if ( ptr == end || *ptr++ != '>' )
+        malformed( "unfinished end tag" );
+
+    if ( elements.empty() || elements.back().nameSize != size ||
+         memcmp( elements.back().name, name, size ) )
+        malformed( "mismatched end tag" );
+
+    Element & element = elements.back();
+
+    out += "</";
+
+    if ( element.mapping )
+        out += element.mapping->htmlName;
+    else
+        out.append( name, size );
+
+    out += '>';
+
+    if ( !element.startTag.empty() )
+    {
+        // The text is already escaped, as it comes from the xml, save for
+        // the quotes
+        string & tag = element.startTag;
+
+        tag += " href=\"bword:";
+
+        for( char c : element.text )
+            if ( c == '"' )
+                tag += "&quot;";
+            else
+                tag += c;
+
+        tag += "\">";
+
+        out.insert( element.start, tag );
+
+        --openReferences;
+    }
+
+    elements.pop_back();
+}
+
+void Converter::copyUntil( char const * terminator )
+{
+    char const * start = ptr;
+    size_t terminatorSize = strlen( terminator );
+
+    for( ; ; ++ptr )
+    {
+        if ( size_t( end - ptr ) < terminatorSize )
+            malformed( "unterminated markup" );
+
+        if ( !memcmp( ptr, terminator, terminatorSize ) )
+            break;
+    }
+
+    ptr += terminatorSize;
+
+    out.append( start, ptr - start );
+}
+
+size_t Converter::referenceSize()
+{
+    char const * p = ptr + 1;
+
+    if ( p != end && *p == '#' )
+    {
+        ++p;
+
+        bool hex = p != end && *p == 'x';
+
+        if ( hex )
+            ++p;
+
+        char const * digits = p;
+
+        while( p != end && ( ( *p >= '0' && *p <= '9' ) ||
+                             ( hex && ( ( *p >= 'a' && *p <= 'f' ) || ( *p >= 'A' && *p <= 'F' ) ) ) ) )
+            ++p;
+
+        if ( p == digits )
+            malformed( "bad character reference" );
+    }
+    else
+    {
+        if ( p == end || !isNameStart( *p ) )
+            malformed( "bad entity reference" );
+
+        while( p != end && isNameChar( *p ) )
+            ++p;
+    }
+
+    if ( p == end || *p != ';' )
+        malformed( "unterminated reference" );
+
+    return p + 1 - ptr;
+}
+
+size_t Converter::nameSize()
+{
+    char const * name = ptr;
+
+    if ( ptr == end || !isNameStart( *ptr ) )
+        malformed( "bad name" );
+
+    while( ++ptr != end && isNameChar( *ptr ) )
+    {}
+
+    return ptr - name;
+}
+
+void Converter::addText( char const * text, size_t size )
+{
+    if ( openReferences )
+        for( auto & element : elements )
+            if ( !element.startTag.empty() )
+                element.text.append( text, size );
+}
+
+void Converter::malformed( char const * what )
+{
+    throw exMalformed( string( what ) + " at offset " +
+                       std::to_string( ptr - begin ) );
+}
+
+}
+
 string convert( string const & in )
+{
+    string result;
+
+    result.reserve( in.size() + in.size() / 4 + 32 );
+
+    result += "<div class=\"sdct_x\">";
+
+    try
+    {
+        Converter( in, result ).run();
+    }
+    catch( exMalformed & e )
+    {
+        qWarning() << "Xdxf2html error," << e.what();
+        qWarning() << "The input was: " << in.c_str();
+
+        return in;
+    }
+
+    result += "</div>";
+
+    return result;
+}
+
+string convertWithDom( string const & in )
 {
     //printf( "Source>>>>>>>>>>: %s\n\n\n", in.c_str() );
 
@@ -162,4 +647,3 @@ string convert( string const & in )
 }
 
 }
-
@@ -13,9 +13,15 @@ namespace Xdxf2Html {
 using std::string;
 
 /// Converts the given xdxf markup to an html one. This is currently used
-/// for Stardict's 'x' records.
+/// for Stardict's 'x' records. It's done in a single pass, with no dom built.
+/// If the markup isn't a well-formed xml, it is returned as it is.
 string convert( string const & );
 
+/// Does the same as convert(), by building a QDomDocument of the markup and
+/// transforming it. This is how convert() used to work, and it's only kept
+/// as a reference to compare convert() against, as the benchmark does.
+string convertWithDom( string const & );
+
 }
 
 #endif